@@ -12,6 +12,7 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -60,11 +61,51 @@ extern "C" {
 
 		 - TRY_ONCE_LOCK: If you can't grab the lock on the first try,
        return with an error code.
+
+		 Lookups never take the locks.  Unless called with NO_LOCK, they
+		 run optimistically and are retried if an update modified the part
+		 of the CQF they read in the meantime.
 	*/
 #define QF_NO_LOCK (0x01)
 #define QF_TRY_ONCE_LOCK (0x02)
 #define QF_WAIT_FOR_LOCK (0x04)
 
+	/* How WAIT_FOR_LOCK waits while another thread holds the lock:
+
+		 - SPIN: spin on the lock (the default).
+
+		 - BACKOFF: spin with pause instructions, backing off exponentially.
+
+		 - PARK: back off for a while, then sleep in the kernel (futex) until
+       the lock is released.  Use it when there are more threads than
+       cores, or when page faults may stall the holder of a lock (e.g. a
+       file-backed CQF).
+
+		 Set the policy right after creating the CQF, before other threads
+		 use it.
+	*/
+	enum qf_lock_policy {
+		QF_LOCK_SPIN,
+		QF_LOCK_BACKOFF,
+		QF_LOCK_PARK
+	};
+
+	void qf_set_lock_policy(QF *qf, enum qf_lock_policy policy);
+
+	/* Each lock covers a region of slots_per_lock slots, a power of 2 of at
+		 least 2^13 (2^16 by default).  Smaller regions let more threads work
+		 at once, larger ones keep the lock array small.  With padded, every
+		 lock gets a cache line of its own, so that threads don't contend on
+		 neighbouring locks.  Call it before other threads use the CQF.
+		 Returns false, keeping the old granularity, if slots_per_lock is not
+		 valid or the new locks can't be allocated. */
+	bool qf_set_lock_granularity(QF *qf, uint64_t slots_per_lock, bool padded);
+
+	/* Pick the lock granularity from the size of the CQF and the expected
+		 number of threads: regions as large as possible while each thread
+		 still gets at least 64 of them. */
+	void qf_tune_lock_granularity(QF *qf, uint32_t nthreads, bool padded);
+
 	/* It is sometimes useful to insert a key that has already been
 		 hashed. */
 #define QF_KEY_IS_HASH (0x08)
@@ -79,15 +120,48 @@ extern "C" {
 	 * Create an empty CQF in "buffer".  If there is not enough space at
 	 * buffer then it will return the total size needed in bytes to
 	 * initialize the CQF.  This function takes ownership of buffer.
+	 * Returns 0 if the locks or counters of the CQF can't be allocated.
 	 */
 	uint64_t qf_init(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
 									 value_bits, enum qf_hashmode hash, uint32_t seed, void*
 									 buffer, uint64_t buffer_len);
 
+	/* Block layouts.  In the packed layout, the default, blocks follow
+		 each other with no padding, so most blocks straddle cache lines.  In
+		 the aligned layout every block is padded to a multiple of 64 bytes,
+		 and its offset and metadata words are in its first cache line, at
+		 the cost of the padding (e.g. 81 bytes become 128 with 8-bit slots).
+		 The split layout keeps the offsets and metadata words of all the
+		 blocks in one dense array, followed by the slots of all the blocks,
+		 so that a negative lookup (an empty home slot) or a walk over the
+		 runends of a few blocks reads no slots at all.  CQFs in the split
+		 layout can't be expanded or shrunk in place.  The layout is recorded
+		 in the metadata, so it is kept by resizing, serialization and
+		 qf_use.
+
+		 QF_LAYOUT_WIDE_OFFSETS can be or'ed into any layout.  The 8-bit
+		 offset of a block saturates at 255 in long clusters (high load or
+		 big counters), after which finding a run end has to walk back to
+		 the start of the cluster.  With wide offsets, a 16-bit copy of every
+		 saturated offset is kept in a table after the blocks, for 2 bytes
+		 per block.  Such CQFs can't be expanded or shrunk in place either. */
+#define QF_LAYOUT_PACKED (0x00)
+#define QF_LAYOUT_ALIGNED (0x01)
+#define QF_LAYOUT_SPLIT (0x02)
+#define QF_LAYOUT_WIDE_OFFSETS (0x04)
+
+	/* Like qf_init, with the given layout.  For the blocks to be aligned,
+		 buffer must be 64-byte aligned. */
+	uint64_t qf_init_layout(QF *qf, uint64_t nslots, uint64_t key_bits,
+													uint64_t value_bits, enum qf_hashmode hash, uint32_t
+													seed, uint32_t layout, void* buffer, uint64_t
+													buffer_len);
+
 	/* Create a CQF in "buffer". Note that this does not initialize the
 	 contents of bufferss Use this function if you have read a CQF, e.g.
 	 off of disk or network, and want to begin using that stream of
-	 bytes as a CQF. The CQF takes ownership of buffer.  */
+	 bytes as a CQF. The CQF takes ownership of buffer.  Returns 0 if the
+	 runtime data, locks or counters of the CQF can't be allocated. */
 	uint64_t qf_use(QF* qf, void* buffer, uint64_t buffer_len);
 
 	/* Destroy this CQF.  Returns a pointer to the memory that the CQF was
@@ -112,6 +186,55 @@ extern "C" {
 	bool qf_malloc(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
 								 value_bits, enum qf_hashmode hash, uint32_t seed);
 
+	bool qf_malloc_layout(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
+												value_bits, enum qf_hashmode hash, uint32_t seed,
+												uint32_t layout);
+
+	/* Where a CQF gets its memory from: its buffer, runtime data, locks and
+		 counters, and the CQFs that it is resized into.  alloc and
+		 aligned_alloc return NULL when they fail; free is passed the size
+		 that was asked for.  ctx is passed to all three. */
+	typedef struct qf_allocator {
+		void *(*alloc)(void *ctx, size_t size);
+		void *(*aligned_alloc)(void *ctx, size_t alignment, size_t size);
+		void (*free)(void *ctx, void *ptr, size_t size);
+		void *ctx;
+	} qf_allocator;
+
+	/* Like qf_malloc_layout, with the memory from allocator (malloc and free
+		 if it is NULL), which is copied into the CQF.  Returns false if the
+		 buffer or the runtime data can't be allocated.  Release the CQF with
+		 qf_free. */
+	bool qf_malloc_allocator(QF *qf, uint64_t nslots, uint64_t key_bits,
+													 uint64_t value_bits, enum qf_hashmode hash,
+													 uint32_t seed, uint32_t layout, const qf_allocator
+													 *allocator);
+
+	/* Huge pages for the memory of a CQF.  Slots are accessed at random, so
+		 with 4 KB pages nearly every operation on a big CQF misses the TLB.
+		 THP asks for transparent huge pages with madvise(MADV_HUGEPAGE).  2MB
+		 and 1GB map hugetlb pages (MAP_HUGETLB), which must have been
+		 reserved, e.g. through /proc/sys/vm/nr_hugepages. */
+#define QF_HUGEPAGES_NONE (0x00)
+#define QF_HUGEPAGES_THP (0x01)
+#define QF_HUGEPAGES_2MB (0x02)
+#define QF_HUGEPAGES_1GB (0x03)
+
+	/* Like qf_malloc_layout, but the memory comes from mmap, with huge pages
+		 of the kind hugepages or, if there are none of that kind, of the
+		 biggest smaller kind there is.  Resizing asks for the same kind again.
+		 Returns false if the memory can't be mapped.  Release the CQF with
+		 qf_free. */
+	bool qf_malloc_hugepages(QF *qf, uint64_t nslots, uint64_t key_bits,
+													 uint64_t value_bits, enum qf_hashmode hash,
+													 uint32_t seed, uint32_t layout, uint32_t hugepages);
+
+	/* The kind of huge pages (QF_HUGEPAGES_*) that the memory of qf got.
+		 File-backed CQFs get hugetlb pages when their file is on hugetlbfs.
+		 With QF_HUGEPAGES_THP, the kernel may still back parts of the memory
+		 with small pages. */
+	uint32_t qf_get_hugepages(const QF *qf);
+
 	bool qf_free(QF *qf);
 
 	/* Resize the QF to the specified number of slots.  Uses malloc() to
@@ -121,11 +244,80 @@ extern "C" {
 	 * */
 	int64_t qf_resize_malloc(QF *qf, uint64_t nslots);
 
+	/* Double the number of slots of the QF in place: each remainder gives
+	 * its top bit to the quotient and the blocks are laid out again inside
+	 * the same buffer, grown with realloc(), so no second copy of the CQF
+	 * is needed.  Requires a CQF from qf_malloc with at least 3 key
+	 * remainder bits; the false-positive rate doubles with every expansion.
+	 * Return value:
+	 *    >= 0: number of keys moved.
+	 *    == QF_NO_SPACE: the CQF can't be expanded in place.
+	 * */
+	int64_t qf_expand_malloc(QF *qf);
+
+	/* Halve the number of slots of the QF in place, folding the low bit of
+	 * each quotient back into the remainder, and shrink its buffer with
+	 * realloc().  Requires a CQF from qf_malloc.
+	 * Return value:
+	 *    >= 0: number of keys moved.
+	 *    == QF_NO_SPACE: the items don't fit in half the slots.
+	 * */
+	int64_t qf_shrink_malloc(QF *qf);
+
 	/* Turn on automatic resizing.  Resizing is performed by calling
 		 qf_resize_malloc, so the CQF must meet the requirements of that
 		 function. */
 	void qf_set_auto_resize(QF* qf, bool enabled);
 
+	/* Halve the CQF with the shrink function of its container
+		 (qf_shrink_malloc or qf_shrink_file).  Returns as those do. */
+	int64_t qf_shrink(QF *qf);
+
+	/* Turn on automatic shrinking: once a remove leaves the CQF less than a
+		 quarter full, it is halved with qf_shrink. */
+	void qf_set_auto_shrink(QF* qf, bool enabled);
+
+	/* How automatic resizing grows the CQF:
+
+		 - REBUILD copies all the items into a new, doubled CQF at once
+       (qf_resize_malloc or qf_resize_file), stalling the insert that
+       triggers it.
+
+		 - INCREMENTAL (malloc-backed CQFs only) allocates the doubled CQF
+       and then copies a few runs into it on every insert.  New items go
+       into the doubled CQF and lookups and removes consult both until
+       the copy is done.  While a resize is in progress, iterators,
+       merges, serialization, qf_copy, qf_get_unique_index and the
+       counters of the CQF only see the old CQF; call qf_resize_finish
+       before using them.  The steps swap out the memory of the CQF, so
+       only inserts with QF_NO_LOCK start an incremental resize (others
+       resize at once, as in REBUILD), and no other thread may use the
+       CQF until it is finished.
+
+		 - IN_PLACE doubles the CQF inside its own buffer (qf_expand_malloc
+       or qf_expand_file), trading one remainder bit for each doubling,
+       and falls back to REBUILD once no remainder bit is left to trade.
+	*/
+	enum qf_resize_mode {
+		QF_RESIZE_REBUILD,
+		QF_RESIZE_INCREMENTAL,
+		QF_RESIZE_IN_PLACE
+	};
+
+	void qf_set_resize_mode(QF *qf, enum qf_resize_mode mode);
+
+	/* Returns true if an incremental resize is in progress. */
+	bool qf_is_resizing(const QF *qf);
+
+	/* Copy up to nruns more runs of an incremental resize, e.g. from an
+		 idle loop.  Steps hold the metadata lock, taken as flags say, and
+		 insert into the new CQF with flags.  Returns true if the resize is
+		 still in progress, including when the lock was busy. */
+	bool qf_resize_step(QF *qf, uint64_t nruns, uint8_t flags);
+
+	/* Complete an incremental resize, if one is in progress. */
+	void qf_resize_finish(QF *qf);
+
 	/***********************************
    Functions for modifying the CQF.
 	***********************************/
@@ -144,6 +336,64 @@ extern "C" {
 	int qf_insert(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
 								flags);
 
+	/* Increment the counters of nkeys key/value pairs.  The keys are hashed
+	 * ahead of the inserts and the home blocks of upcoming keys are
+	 * prefetched, so the cache misses of consecutive inserts overlap.
+	 * values may be NULL (all values are 0) and counts may be NULL (every
+	 * count is 1).  If rets is not NULL, rets[i] receives the qf_insert
+	 * return value for the i'th pair, e.g. to retry QF_COULDNT_LOCK failures.
+	 * Return value:
+	 *    >= 0: number of pairs that were inserted successfully.
+	 */
+	int64_t qf_insert_batch(QF *qf, const uint64_t *keys, const uint64_t
+													*values, const uint64_t *counts, uint64_t nkeys,
+													uint8_t flags, int *rets);
+
+	/* Build the CQF from nkeys key/value pairs in one linear pass.  The
+	 * hashes are radix-sorted (unless they already arrive in hash order,
+	 * e.g. a dump taken with qfi_get_hash and QF_KEY_IS_HASH) and the
+	 * counters, occupieds, runends and block offsets are then written out
+	 * in slot order, without calling qf_insert for each pair.  Repeated
+	 * pairs are combined into one counter.  values may be NULL (all values
+	 * are 0) and counts may be NULL (every count is 1).
+	 * The CQF must not be accessed concurrently.  Like qf_insert, the load
+	 * stops at a load factor of 95%; with auto resizing, the CQF is then
+	 * doubled and loaded again.  If it is not empty, the pairs are
+	 * inserted with qf_insert_batch instead.
+	 * Return value:
+	 *    >= 0: number of pairs loaded, which is less than nkeys only if the
+	 *          CQF was not empty and filled up.
+	 *    == QF_NO_SPACE: the pairs don't fit in the empty CQF, or there is
+	 *                    no memory to sort them.  The CQF is left empty.
+	 */
+	int64_t qf_bulk_load(QF *qf, const uint64_t *keys, const uint64_t *values,
+											 const uint64_t *counts, uint64_t nkeys, uint8_t flags);
+
+	/* Buffered concurrent inserts.  Each thread owns a QFbuffer, in which
+	 * qf_buffer_insert collects hashed pairs.  When the buffer is full (or
+	 * qf_buffer_flush is called), it is sorted, the counts of repeated
+	 * pairs are combined, and each lock region's pairs are inserted under
+	 * a single acquisition of its lock, instead of one per pair.  Pairs are
+	 * only visible to lookups once they have been flushed.
+	 *
+	 * flags of qf_buffer_init is the locking mode of the flushes; flags of
+	 * qf_buffer_insert only says whether key is already hashed.
+	 * qf_buffer_insert and qf_buffer_flush return 0 or, if a flush fails,
+	 * QF_NO_SPACE or QF_COULDNT_LOCK.  Pairs that couldn't be inserted stay
+	 * in the buffer, and the pair passed to a failing qf_buffer_insert is
+	 * not added.  Call qf_buffer_flush before qf_buffer_free.
+	 * qf_buffer_init returns false if capacity is 0 or the buffer, which
+	 * comes from the allocator of qf, can't be allocated. */
+	typedef struct quotient_filter_insert_buffer quotient_filter_insert_buffer;
+	typedef quotient_filter_insert_buffer QFbuffer;
+
+	bool qf_buffer_init(QFbuffer *buf, QF *qf, uint64_t capacity, uint8_t
+											flags);
+	int qf_buffer_insert(QFbuffer *buf, uint64_t key, uint64_t value, uint64_t
+											 count, uint8_t flags);
+	int qf_buffer_flush(QFbuffer *buf);
+	void qf_buffer_free(QFbuffer *buf);
+
 	/* Set the counter for this key/value pair to count. 
 	 Return value: Same as qf_insert. 
 	 Returns 0 if new count is equal to old count.
@@ -184,8 +434,7 @@ extern "C" {
 	/* Lookup the value associated with key.  Returns the count of that
 		 key/value pair in the QF.  If it returns 0, then, the key is not
 		 present in the QF. Only returns the first value associated with key
-		 in the QF.  If you want to see others, use an iterator. 
-		 May return QF_COULDNT_LOCK if called with QF_TRY_LOCK.  */
+		 in the QF.  If you want to see others, use an iterator. */
 	uint64_t qf_query(const QF *qf, uint64_t key, uint64_t *value, uint8_t
 										flags);
 
@@ -195,11 +444,23 @@ extern "C" {
 	//uint64_t qf_count_key(const QF *qf, uint64_t key);
 
 	/* Return the number of times key has been inserted, with the given
-		 value, into qf.
-		 May return QF_COULDNT_LOCK if called with QF_TRY_LOCK.  */
+		 value, into qf. */
 	uint64_t qf_count_key_value(const QF *qf, uint64_t key, uint64_t value,
 															uint8_t flags);
 
+	/* Batched versions of qf_count_key_value and qf_query.  The keys are
+		 hashed ahead of the lookups and the blocks of upcoming keys are
+		 prefetched, so many lookups have cache misses outstanding at once.
+		 counts[i] (and values[i] for qf_query_batch) receive the result for
+		 keys[i].  For qf_count_key_value_batch, values may be NULL, in which
+		 case all values are 0.
+		 Returns the number of keys with a non-zero count. */
+	uint64_t qf_count_key_value_batch(const QF *qf, const uint64_t *keys,
+																		const uint64_t *values, uint64_t nkeys,
+																		uint64_t *counts, uint8_t flags);
+	uint64_t qf_query_batch(const QF *qf, const uint64_t *keys, uint64_t nkeys,
+													uint64_t *values, uint64_t *counts, uint8_t flags);
+
 	/* Returns a unique index corresponding to the key in the CQF.  Note
 		 that this can change if further modifications are made to the
 		 CQF.
@@ -222,9 +483,13 @@ extern "C" {
 
 	/* Space usage info. */
 	bool     qf_is_auto_resize_enabled(const QF *qf);
+	bool     qf_is_auto_shrink_enabled(const QF *qf);
 	uint64_t qf_get_total_size_in_bytes(const QF *qf);
 	uint64_t qf_get_nslots(const QF *qf);
 	uint64_t qf_get_num_occupied_slots(const QF *qf);
+	/* Cheaper, but may be off by the counts that the partitioned counters
+		 hold back (see qf_set_counters). */
+	uint64_t qf_get_num_occupied_slots_approx(const QF *qf);
 
 	/* Bit-sizes info. */
 	uint64_t qf_get_num_key_bits(const QF *qf);
@@ -238,6 +503,16 @@ extern "C" {
 
 	void qf_sync_counters(const QF *qf);
 
+	/* The item counts are partitioned counters: each thread adds to one of
+		 num_counters local counters (0 for one per CPU, the default), which
+		 is moved to the global count once it passes threshold (100 by
+		 default).  More counters mean less contention between threads,
+		 larger thresholds fewer updates of the global count; both let the
+		 global count lag further behind.  Call it before other threads use
+		 the CQF.  Returns false, keeping the old counters, if threshold is not
+		 positive or the new counters can't be allocated. */
+	bool qf_set_counters(QF *qf, uint32_t num_counters, int32_t threshold);
+
 	/****************************************
 		Iterators
 	*****************************************/
@@ -305,11 +580,21 @@ extern "C" {
 	void qf_copy(QF *dest, const QF *src);
 
 	/* merge two QFs into the third one. Note: merges with any existing
-		 values in qfc.  */
-	void qf_merge(const QF *qfa, const QF *qfb, QF *qfc);
-
-	/* merge multiple QFs into the final QF one. */
-	void qf_multi_merge(const QF *qf_arr[], int nqf, QF *qfr);
+		 values in qfc.  If qfc is empty, it is filled in a single sequential
+		 pass instead of one insert per item.  Returns 0, or QF_NO_SPACE if
+		 qfc filled up, in which case it keeps the items merged so far.  */
+	int qf_merge(const QF *qfa, const QF *qfb, QF *qfc);
+
+	/* merge multiple QFs into the final QF one.  Same as qf_merge. */
+	int qf_multi_merge(const QF *qf_arr[], int nqf, QF *qfr);
+
+	/* merge multiple QFs into the final QF one using nthreads threads, each
+		 merging a range of hashes into its own region of qfr.  qfr should be
+		 empty; otherwise (or if qfr is too small or too full to be split
+		 into ranges) this is the same as qf_multi_merge.  Returns as
+		 qf_merge does.  */
+	int qf_multi_merge_parallel(const QF *qf_arr[], int nqf, QF *qfr, int
+															nthreads);
 
 	/* find cosine similarity between two QFs. */
 	uint64_t qf_inner_product(const QF *qfa, const QF *qfb);
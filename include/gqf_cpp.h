@@ -0,0 +1,144 @@
+/*
+ * ============================================================================
+ *
+ *        Authors:  Prashant Pandey <ppandey@cs.stonybrook.edu>
+ *                  Rob Johnson <robj@vmware.com>
+ *
+ * ============================================================================
+ */
+
+#ifndef _GQF_CPP_H_
+#define _GQF_CPP_H_
+
+#include <inttypes.h>
+#include <assert.h>
+#include <new>
+
+#include "gqf.h"
+#include "gqf_int.h"
+extern "C" {
+#include "hashutil.h"
+}
+
+/* A CQF whose remainder and value widths are fixed at compile time.  It is
+ * an ordinary CQF (the same qfblock layout, usable with all the qf_*
+ * functions through get()), but lookups hash and split keys with its
+ * widths as constants and go straight to the C library's kernel for its
+ * slot width, which reads 8, 16, 32 and 64-bit slots with one load.
+ * Filters of several widths can be used side by side in one program.
+ * Layout is one of the QF_LAYOUT_* block layouts.  The constructor throws
+ * std::bad_alloc if the CQF can't be allocated.
+ *
+ * Updates go through the C library.  The slot width changes when a CQF is
+ * resized, so these CQFs never resize automatically.  One that is resized
+ * through get() anyway is looked up through the C library. */
+template <unsigned RemainderBits, unsigned ValueBits = 0,
+					enum qf_hashmode HashMode = QF_HASH_DEFAULT,
+					uint32_t Layout = QF_LAYOUT_PACKED>
+class cqf {
+	public:
+		static const unsigned bits_per_slot = RemainderBits + ValueBits;
+		static_assert(RemainderBits >= 2 && (bits_per_slot <= 56 ||
+																				 bits_per_slot == 64),
+									"slots must have 2 to 56, or 64, bits");
+
+		/* nslots must be a power of 2. */
+		explicit cqf(uint64_t nslots, uint32_t seed = 0) {
+			uint64_t key_bits = RemainderBits;
+			while (nslots > 1ULL << (key_bits - RemainderBits))
+				key_bits++;
+			if (!qf_malloc_layout(&qf_, nslots, key_bits, ValueBits, HashMode, seed,
+														Layout))
+				throw std::bad_alloc();
+			assert(qf_.metadata->bits_per_slot == bits_per_slot);
+		}
+
+		~cqf() { qf_free(&qf_); }
+
+		QF *get() { return &qf_; }
+		const QF *get() const { return &qf_; }
+
+		int insert(uint64_t key, uint64_t value, uint64_t count, uint8_t flags) {
+			return qf_insert(&qf_, key, value, count, flags);
+		}
+
+		int remove(uint64_t key, uint64_t value, uint64_t count, uint8_t flags) {
+			return qf_remove(&qf_, key, value, count, flags);
+		}
+
+		/* Like qf_count_key_value. */
+		uint64_t count(uint64_t key, uint64_t value, uint8_t flags) const {
+			uint64_t hash = key_value_hash(key, value, flags);
+			uint64_t bucket = hash >> bits_per_slot;
+			uint64_t seq, count;
+
+			if (!compiled_width())
+				return qf_count_key_value(&qf_, key, value, flags);
+			if ((flags & QF_NO_LOCK) == QF_NO_LOCK)
+				return count_hash(hash);
+			do {
+				seq = qf_read_start(&qf_, bucket);
+				count = count_hash(hash);
+			} while (qf_read_changed(&qf_, bucket, seq));
+			return count;
+		}
+
+		/* Like qf_query. */
+		uint64_t query(uint64_t key, uint64_t *value, uint8_t flags) const {
+			uint64_t hash = key_value_hash(key, 0, flags) >> ValueBits;
+			uint64_t bucket = hash >> RemainderBits;
+			uint64_t seq, count;
+
+			if (!compiled_width())
+				return qf_query(&qf_, key, value, flags);
+			if ((flags & QF_NO_LOCK) == QF_NO_LOCK)
+				return query_hash(hash, value);
+			do {
+				seq = qf_read_start(&qf_, bucket);
+				count = query_hash(hash, value);
+			} while (qf_read_changed(&qf_, bucket, seq));
+			return count;
+		}
+
+	private:
+		QF qf_;
+
+		cqf(const cqf&);
+		cqf& operator=(const cqf&);
+
+		/* Whether the slots are still those the hashes are compiled for: not
+		 * while an incremental resize is running, nor after the CQF was
+		 * resized. */
+		bool compiled_width() const {
+			return qf_.runtimedata->resize_dst == NULL &&
+				qf_.metadata->bits_per_slot == bits_per_slot;
+		}
+
+		static uint64_t mask(unsigned nbits) {
+			return nbits == 64 ? 0xffffffffffffffffULL : (1ULL << nbits) - 1;
+		}
+
+		/* The run walks are those of the C library, through the kernel it
+		 * picked for the slot width. */
+		uint64_t count_hash(uint64_t hash) const {
+			return qf_.runtimedata->kernels->count_key_value(&qf_, hash);
+		}
+
+		uint64_t query_hash(uint64_t hash, uint64_t *value) const {
+			return qf_.runtimedata->kernels->query(&qf_, hash, value);
+		}
+
+		uint64_t key_value_hash(uint64_t key, uint64_t value, uint8_t flags)
+			const {
+			if ((flags & QF_KEY_IS_HASH) != QF_KEY_IS_HASH) {
+				if (HashMode == QF_HASH_DEFAULT)
+					key = MurmurHash64A(&key, sizeof(key), qf_.metadata->seed) &
+						mask(qf_.metadata->key_bits);
+				else if (HashMode == QF_HASH_INVERTIBLE)
+					key = hash_64(key, mask(qf_.metadata->key_bits));
+			}
+			return key << ValueBits | (value & mask(ValueBits));
+		}
+};
+
+#endif // _GQF_CPP_H_
@@ -25,6 +25,11 @@ extern "C" {
 									value_bits, enum qf_hashmode hash, uint32_t seed, const char*
 									filename);
 
+	/* Like qf_initfile, with one of the QF_LAYOUT_* layouts. */
+	bool qf_initfile_layout(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
+													value_bits, enum qf_hashmode hash, uint32_t seed,
+													uint32_t layout, const char* filename);
+
 #define QF_USEFILE_READ_ONLY (0x01)
 #define QF_USEFILE_READ_WRITE (0x02)
 
@@ -38,6 +43,23 @@ extern "C" {
 	 * */
 	int64_t qf_resize_file(QF *qf, uint64_t nslots);
 
+	/* Double the number of slots of the QF in place, like
+	 * qf_expand_malloc, growing the file and its mapping with
+	 * posix_fallocate() and mremap() instead of writing a second file.
+	 * Return value:
+	 *    >= 0: number of keys moved.
+	 *    == QF_NO_SPACE: the CQF can't be expanded in place.
+	 * */
+	int64_t qf_expand_file(QF *qf);
+
+	/* Halve the number of slots of the QF in place, like qf_shrink_malloc,
+	 * then shrink the mapping and truncate the file.
+	 * Return value:
+	 *    >= 0: number of keys moved.
+	 *    == QF_NO_SPACE: the items don't fit in half the slots.
+	 * */
+	int64_t qf_shrink_file(QF *qf);
+
 	bool qf_closefile(QF* qf);
 
 	bool qf_deletefile(QF* qf);
@@ -12,6 +12,7 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "gqf.h"
 #include "partitioned_counter.h"
@@ -27,7 +28,9 @@ extern "C" {
    8, 16, 32, or 64 (for optimized versions),
    or other integer <= 56 (for compile-time-optimized bit-shifting-based versions)
 */
+#ifndef QF_BITS_PER_SLOT
 #define QF_BITS_PER_SLOT 0
+#endif
 
 /* Must be >= 6.  6 seems fastest. */
 #define QF_BLOCK_OFFSET_BITS (6)
@@ -57,8 +60,10 @@ extern "C" {
 #endif
 	} qfblock;
 
+#ifndef __cplusplus
 	struct __attribute__ ((__packed__)) qfblock;
 	typedef struct qfblock qfblock;
+#endif
 
   typedef struct file_info {
 		int fd;
@@ -74,17 +79,69 @@ extern "C" {
 		uint64_t locks_acquired_single_attempt;
 	} wait_time_data;
 
+	/* The operations that walk and shift slots.  gqf.c is also built with
+	 * QF_BITS_PER_SLOT set to 8, 16, 32 and 64 (and QF_KERNELS_ONLY), which
+	 * gives a version of them with fixed-width slot accesses for each of
+	 * those widths.  qf_init_kernels picks the one matching a CQF's slot
+	 * width, or the generic one. */
+	typedef struct quotient_filter_kernels {
+		uint64_t bits_per_slot;		/* 0 for the generic kernels */
+		int (*insert1)(QF *qf, __uint128_t hash, uint8_t runtime_lock);
+		int (*insert)(QF *qf, __uint128_t hash, uint64_t count, uint8_t
+									runtime_lock);
+		int (*remove)(QF *qf, __uint128_t hash, uint64_t count, uint8_t
+									runtime_lock);
+		uint64_t (*count_key_value)(const QF *qf, uint64_t hash);
+		uint64_t (*query)(const QF *qf, uint64_t hash, uint64_t *value);
+		uint64_t (*decode_counter)(const QF *qf, uint64_t index, uint64_t
+															 *remainder, uint64_t *count);
+	} qf_kernels;
+
+	extern const qf_kernels qf_kernels_generic;
+	extern const qf_kernels qf_kernels_8;
+	extern const qf_kernels qf_kernels_16;
+	extern const qf_kernels qf_kernels_32;
+	extern const qf_kernels qf_kernels_64;
+
 	typedef struct quotient_filter_runtime_data {
 		file_info f_info;
 		uint32_t auto_resize;
+		uint32_t resize_mode;
+		uint32_t auto_shrink;
+		/* An automatic shrink that failed, with the CQF at shrink_failed_nslots
+		 * slots and shrink_failed_at occupied slots, is not retried until half
+		 * of those are left. */
+		uint64_t shrink_failed_nslots;
+		uint64_t shrink_failed_at;
 		int64_t (*container_resize)(QF *qf, uint64_t nslots);
+		int64_t (*container_expand)(QF *qf);
+		int64_t (*container_shrink)(QF *qf);
+		/* Incremental resizing: the doubled CQF that is being filled, and
+		 * the first bucket of this CQF that has not been copied into it. */
+		QF *resize_dst;
+		uint64_t resize_frontier;
 		pc_t pc_nelts;
 		pc_t pc_ndistinct_elts;
 		pc_t pc_noccupied_slots;
+		uint32_t num_counters;			/* local counters of each pc, 0 for one per CPU */
+		int32_t counter_threshold;	/* 0 for QF_DEFAULT_COUNTER_THRESHOLD */
 		uint64_t num_locks;
+		uint64_t lock_region_bits;	/* a lock covers 2^lock_region_bits slots */
+		uint64_t lock_stride;				/* ints per lock, > 1 to pad locks */
 		volatile int metadata_lock;
 		volatile int *locks;
+		uint32_t lock_policy;
+		volatile int nparked;	/* threads sleeping on a lock */
 		wait_time_data *wait_times;
+		const qf_kernels *kernels;
+		uint32_t hugepages;					/* QF_HUGEPAGES_* the memory got */
+		uint32_t hugepages_wanted;	/* QF_HUGEPAGES_* to ask for when resizing */
+		uint64_t mapped_size;				/* length of the mmap of the memory, 0 if
+																	 it is from malloc or the caller */
+		uint64_t buffer_size;				/* bytes allocated for the memory by
+																	 qf_malloc*, 0 if it is from the caller */
+		uint64_t locks_size;				/* bytes of locks */
+		qf_allocator allocator;			/* all NULL for malloc and free */
 	} quotient_filter_runtime_data;
 
 	typedef quotient_filter_runtime_data qfruntime;
@@ -92,7 +149,7 @@ extern "C" {
 	typedef struct quotient_filter_metadata {
 		uint64_t magic_endian_number;
 		enum qf_hashmode hash_mode;
-		uint32_t reserved;
+		uint32_t layout;				/* QF_LAYOUT_* flags */
 		uint64_t total_size_in_bytes;
 		uint32_t seed;
 		uint64_t nslots;
@@ -118,19 +175,100 @@ extern "C" {
 
 	typedef quotient_filter QF;
 
+	/* Blocks are packed, so slots may be unaligned. */
+#if QF_BITS_PER_SLOT == 16
+	typedef uint16_t __attribute__ ((__aligned__(1))) qfslot;
+#elif QF_BITS_PER_SLOT == 32
+	typedef uint32_t __attribute__ ((__aligned__(1))) qfslot;
+#elif QF_BITS_PER_SLOT == 64
+	typedef uint64_t __attribute__ ((__aligned__(1))) qfslot;
+#else
+	typedef uint8_t qfslot;
+#endif
+
+	/* Bytes of the offset and metadata words at the start of a block. */
+#define QF_BLOCK_HEADER_SIZE offsetof(qfblock, slots)
+
+	/* Bytes of the slots of a block. */
+	static inline uint64_t qf_slots_size(uint64_t bits_per_slot)
+	{
 #if QF_BITS_PER_SLOT > 0
-  static inline qfblock * get_block(const QF *qf, uint64_t block_index)
-  {
-    return &qf->blocks[block_index];
-  }
+		return sizeof(qfblock) - QF_BLOCK_HEADER_SIZE;
 #else
+		return QF_SLOTS_PER_BLOCK * bits_per_slot / 8;
+#endif
+	}
+
+	/* Bytes from the start of one block to the start of the next.  In the
+	 * split layout, blocks are only their headers. */
+	static inline uint64_t qf_block_size(uint64_t bits_per_slot, uint32_t
+																			 layout)
+	{
+		uint64_t size = QF_BLOCK_HEADER_SIZE + qf_slots_size(bits_per_slot);
+		if (layout & QF_LAYOUT_SPLIT)
+			return QF_BLOCK_HEADER_SIZE;
+		if (layout & QF_LAYOUT_ALIGNED)
+			size = (size + 63) & ~63ULL;
+		return size;
+	}
+
+	/* Bytes of the block headers of the split layout, up to the first slot
+	 * array, which starts on a cache line. */
+	static inline uint64_t qf_split_headers_size(uint64_t nblocks)
+	{
+		return (nblocks * QF_BLOCK_HEADER_SIZE + 63) & ~63ULL;
+	}
+
+	/* Bytes of nblocks blocks, not counting the wide offsets. */
+	static inline uint64_t qf_blocks_size(uint64_t nblocks, uint64_t
+																				bits_per_slot, uint32_t layout)
+	{
+		if (layout & QF_LAYOUT_SPLIT)
+			return qf_split_headers_size(nblocks) + nblocks *
+				qf_slots_size(bits_per_slot);
+		return nblocks * qf_block_size(bits_per_slot, layout);
+	}
+
+	/* Bytes of the blocks and, with QF_LAYOUT_WIDE_OFFSETS, of the table of
+	 * wide offsets after them. */
+	static inline uint64_t qf_total_blocks_size(uint64_t nblocks, uint64_t
+																							bits_per_slot, uint32_t layout)
+	{
+		uint64_t size = qf_blocks_size(nblocks, bits_per_slot, layout);
+		if (layout & QF_LAYOUT_WIDE_OFFSETS)
+			size += nblocks * sizeof(uint16_t);
+		return size;
+	}
+
   static inline qfblock * get_block(const QF *qf, uint64_t block_index)
   {
     return (qfblock *)(((char *)qf->blocks)
-                       + block_index * (sizeof(qfblock) + QF_SLOTS_PER_BLOCK *
-                                        qf->metadata->bits_per_slot / 8));
+                       + block_index * qf_block_size(qf->metadata->bits_per_slot,
+                                                     qf->metadata->layout));
   }
-#endif
+
+	/* The slots of a block.  Use this rather than get_block()->slots, which
+	 * is only right outside the split layout. */
+	static inline qfslot * get_slots(const QF *qf, uint64_t block_index)
+	{
+		bool split = qf->metadata->layout & QF_LAYOUT_SPLIT;
+		uint64_t start = split ? qf_split_headers_size(qf->metadata->nblocks) :
+			QF_BLOCK_HEADER_SIZE;
+		uint64_t stride = split ? qf_slots_size(qf->metadata->bits_per_slot) :
+			qf_block_size(qf->metadata->bits_per_slot, qf->metadata->layout);
+		return (qfslot *)((char *)qf->blocks + start + block_index * stride);
+	}
+
+	/* The 16-bit offsets of QF_LAYOUT_WIDE_OFFSETS, one per block.  The
+	 * entry of a block is only meaningful when its 8-bit offset is
+	 * saturated. */
+	static inline uint16_t * get_wide_offsets(const QF *qf)
+	{
+		return (uint16_t *)((char *)qf->blocks +
+												qf_blocks_size(qf->metadata->nblocks,
+																			 qf->metadata->bits_per_slot,
+																			 qf->metadata->layout));
+	}
 
 	// The below struct is used to instrument the code.
 	// It is not used in normal operations of the CQF.
@@ -149,6 +287,63 @@ extern "C" {
 		cluster_data *c_info;
 	} quotient_filter_iterator;
 
+	typedef struct quotient_filter_insert_buffer {
+		QF *qf;
+		uint8_t flags;
+		uint64_t nitems;
+		uint64_t capacity;
+		/* Room for 2 * capacity (hash, count) pairs; the second half is
+		 * scratch space for sorting. */
+		struct hash_count *items;
+	} quotient_filter_insert_buffer;
+
+	/* (Re)allocate the locks of qf for its size and lock granularity.
+	 * Returns false, keeping the old locks, if the new ones can't be
+	 * allocated. */
+	bool qf_init_locks(QF *qf);
+
+	/* Optimistic reads, for lookups outside of gqf.c.  qf_read_start waits
+	 * (as the lock policy of qf says) for the writers of the regions that a
+	 * lookup of hash_bucket_index reads, and returns their sequence numbers.
+	 * qf_read_changed tells if a writer got in since, in which case the
+	 * lookup must be done again. */
+	uint64_t qf_read_start(const QF *qf, uint64_t hash_bucket_index);
+	bool qf_read_changed(const QF *qf, uint64_t hash_bucket_index, uint64_t
+											 seq);
+
+	/* Whether select on machine words can use pdep.  Set at startup from
+	 * cpuid: the CPU must have BMI2 and run pdep in hardware. */
+	extern bool qf_use_pdep;
+
+	/* Point qf at the kernels for its slot width. */
+	void qf_init_kernels(QF *qf);
+
+	/* Set up the partitioned counters of the item counts of qf.  Returns
+	 * false if their local counters can't be allocated. */
+	bool qf_init_counters(QF *qf);
+
+	/* Carry the runtime settings of src (resizing, shrinking, locking) over
+	 * to dst, which is going to replace it.  Returns false if the locks or
+	 * counters of dst can't be reallocated for them. */
+	bool qf_copy_settings(QF *dst, const QF *src);
+
+	/* Whether qf can be resized to nslots (a power of 2) and still keep the
+	 * 2 remainder bits that a CQF needs.  The containers' resize functions
+	 * fail rather than go below that. */
+	bool qf_can_resize(const QF *qf, uint64_t nslots);
+
+	/* In-place resizing, shared by the malloc and file-backed containers.
+	 * qf_relayout_geometry computes in md the metadata of qf resized to
+	 * nslots, which must be twice or half the current nslots, and returns
+	 * false if the items of qf can't be laid out that way.  qf_relayout
+	 * then lays out the items of qf for md in the buffer of qf, which must
+	 * already have room for both the old and the new blocks.  It returns
+	 * the number of items moved, or QF_NO_SPACE, leaving qf as it was, if
+	 * it can't allocate what it needs. */
+	bool qf_relayout_geometry(const QF *qf, uint64_t nslots, qfmetadata *md);
+
+	int64_t qf_relayout(QF *qf, const qfmetadata *md);
+
 #ifdef __cplusplus
 }
 #endif
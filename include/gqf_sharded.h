@@ -0,0 +1,94 @@
+/*
+ * ============================================================================
+ *
+ *        Authors:  Prashant Pandey <ppandey@cs.stonybrook.edu>
+ *                  Rob Johnson <robj@vmware.com>
+ *
+ * ============================================================================
+ */
+
+#ifndef _GQF_SHARDED_H_
+#define _GQF_SHARDED_H_
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "gqf.h"
+#include "gqf_int.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	/* A sharded CQF splits the hash range across independent CQFs (shards),
+		 sending each key to the shard picked by the top bits of its hash.
+		 The memory of each shard can be bound to a NUMA node, so that threads
+		 running on that node only touch local memory. */
+	typedef struct quotient_filter_sharded {
+		enum qf_hashmode hash_mode;
+		uint32_t seed;
+		uint64_t key_bits;
+		uint64_t shard_bits;		/* log2 of the number of shards */
+		uint32_t nshards;
+		QF *shards;
+		int *nodes;							/* node of each shard, -1 if not bound */
+		uint64_t *sizes;				/* size of the memory of each shard */
+	} QFsharded;
+
+	typedef struct quotient_filter_sharded_iterator {
+		const QFsharded *qfs;
+		uint32_t shard;
+		QFi qfi;
+	} QFsi;
+
+	/* Create a sharded CQF of nshards (a power of 2) shards with nslots
+		 slots in total.  key_bits, value_bits, hash and seed are as for
+		 qf_malloc.  The memory of shard i is bound to NUMA node nodes[i], or,
+		 if nodes is NULL, to the online nodes in turn.  A shard whose memory
+		 can't be bound (e.g. the kernel has no NUMA support) is created
+		 anyway, and its node is -1.  Shards don't resize. */
+	bool qf_sharded_malloc(QFsharded *qfs, uint32_t nshards, const int *nodes,
+												 uint64_t nslots, uint64_t key_bits, uint64_t
+												 value_bits, enum qf_hashmode hash, uint32_t seed);
+
+	bool qf_sharded_free(QFsharded *qfs);
+
+	/* Hash key as the shards expect it (key itself with QF_KEY_IS_HASH). */
+	uint64_t qf_sharded_hash(const QFsharded *qfs, uint64_t key, uint8_t flags);
+
+	/* The shard of a hashed key, and the node of a shard (-1 if its memory
+		 isn't bound to a node).  Together they let an application hand each
+		 key to a thread on the node that holds it. */
+	uint32_t qf_sharded_shard(const QFsharded *qfs, uint64_t hash);
+	int qf_sharded_node(const QFsharded *qfs, uint32_t shard);
+
+	/* Run the calling thread on the CPUs of node, and allocate its memory
+		 there.  Returns false if the node doesn't exist or the thread can't be
+		 moved. */
+	bool qf_sharded_bind_thread(int node);
+
+	/* Like qf_insert, qf_count_key_value and qf_query, on the shard of key.
+		 Pass QF_KEY_IS_HASH with a key from qf_sharded_hash to avoid hashing
+		 it a second time. */
+	int qf_sharded_insert(QFsharded *qfs, uint64_t key, uint64_t value, uint64_t
+												count, uint8_t flags);
+	uint64_t qf_sharded_count_key_value(const QFsharded *qfs, uint64_t key,
+																			uint64_t value, uint8_t flags);
+	uint64_t qf_sharded_query(const QFsharded *qfs, uint64_t key, uint64_t
+														*value, uint8_t flags);
+
+	/* Iterate over all the shards, in the global order of the hashes.
+		 Return values are as for the QF iterator functions. */
+	int64_t qf_sharded_iterator(const QFsharded *qfs, QFsi *qfsi);
+	int qfsi_get_key(const QFsi *qfsi, uint64_t *key, uint64_t *value, uint64_t
+									 *count);
+	int qfsi_get_hash(const QFsi *qfsi, uint64_t *hash, uint64_t *value,
+										uint64_t *count);
+	int qfsi_next(QFsi *qfsi);
+	bool qfsi_end(const QFsi *qfsi);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _GQF_SHARDED_H_
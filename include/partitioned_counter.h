@@ -17,9 +17,14 @@
 extern "C" {
 #endif
 
+/* Counters of a group of partitioned counters that share a cache line.
+ * Each thread updates the line of its own, so counters of a group that
+ * are updated together, such as the item counts of a CQF, cost one cache
+ * line per thread. */
+#define PC_GROUP_SIZE 8
+
 typedef struct local_counter {
-	int64_t counter;
-	int64_t padding[7];
+	int64_t counter[PC_GROUP_SIZE];
 } local_counter;
 
 typedef struct local_counter lctr_t;
@@ -29,6 +34,9 @@ typedef struct partitioned_counter {
 	int64_t *global_counter;
 	uint32_t num_counters;
 	int32_t threshold;
+	uint32_t index;				/* counter in each local_counter of this pc */
+	bool shared;					/* local_counters belong to another pc or to the
+												 caller */
 } partitioned_counter;
 
 typedef struct partitioned_counter pc_t;
@@ -40,13 +48,50 @@ typedef struct partitioned_counter pc_t;
  */
 int pc_init(pc_t *pc, int64_t *global_counter, uint32_t num_counters,
 						int32_t threshold);
+
+/* Initialize npcs (at most PC_GROUP_SIZE) partitioned counters, *pcs[i]
+ * adding up into *global_counters[i], which share their local counters.
+ * *pcs[0] owns them; destroy the group with pc_destroy_group.
+ * On success returns 0.
+ * If allocation fails returns PC_ERROR
+ */
+int pc_init_group(pc_t **pcs, int64_t **global_counters, uint32_t npcs,
+									uint32_t num_counters, int32_t threshold);
+
+/* The number of local counters that pc_init_group would allocate for
+ * num_counters, or 0 on error. */
+uint32_t pc_num_counters(uint32_t num_counters);
+
+/* Like pc_init_group, with local counters that the caller allocated:
+ * pc_num_counters(num_counters) of them, zeroed and aligned to
+ * sizeof(lctr_t).  The caller frees them after destroying the pcs. */
+int pc_init_group_in(pc_t **pcs, int64_t **global_counters, uint32_t npcs,
+										 lctr_t *local_counters, uint32_t num_counters,
+										 int32_t threshold);
 	
+/* Destroy a pc from pc_init.  A member of a group can only be destroyed
+ * on its own if it is not *pcs[0], which owns the local counters. */
 void pc_destructor(pc_t *pc);
+
+/* Destroy a group of npcs partitioned counters, pcs listing them in the
+ * order they were initialized in. */
+void pc_destroy_group(pc_t **pcs, uint32_t npcs);
 	
 void pc_add(pc_t *pc, int64_t count);
 
 void pc_sync(pc_t *pc);
 
+/* The exact value: the global counter plus the local counters, read
+ * without writing to any of them.  Updates that are in flight may be
+ * missed. */
+int64_t pc_read(const pc_t *pc);
+
+/* Just the global counter.  It's off from pc_read by at most
+ * pc_error(pc), the most that the local counters can hold back. */
+int64_t pc_read_approx(const pc_t *pc);
+
+int64_t pc_error(const pc_t *pc);
+
 #ifdef __cplusplus
 }
 #endif
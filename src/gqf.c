@@ -18,6 +18,12 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <immintrin.h>
+#include <cpuid.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "hashutil.h"
 #include "gqf.h"
@@ -31,8 +37,21 @@
 #define MAX_VALUE(nbits) ((1ULL << (nbits)) - 1)
 #define BITMASK(nbits)                                    \
   ((nbits) == 64 ? 0xffffffffffffffff : MAX_VALUE(nbits))
-#define NUM_SLOTS_TO_LOCK (1ULL<<16)
-#define CLUSTER_SIZE (1ULL<<14)
+/* Updates of the item counts held back by each local counter. */
+#define QF_DEFAULT_COUNTER_THRESHOLD 100
+
+/* Each lock covers a region of 2^lock_region_bits slots (2^16 by
+ * default).  Inserts and removes may shift slots into the next region if
+ * they start within LOCK_CLUSTER_SIZE slots of its end. */
+#define QF_DEFAULT_LOCK_REGION_BITS 16
+#define QF_MIN_LOCK_REGION_BITS 13
+#define QF_LOCK_REGIONS_PER_THREAD 64
+#define LOCK_REGION_SLOTS(qf) (1ULL << (qf)->runtimedata->lock_region_bits)
+#define LOCK_CLUSTER_SIZE(qf) (LOCK_REGION_SLOTS(qf) / 4)
+#define LOCK_REGION(qf, index) ((index) >> (qf)->runtimedata->lock_region_bits)
+#define LOCK_OFFSET(qf, index) ((index) & (LOCK_REGION_SLOTS(qf) - 1))
+#define LOCK_WORD(qf, region)                                          \
+	(&(qf)->runtimedata->locks[(region) * (qf)->runtimedata->lock_stride])
 #define METADATA_WORD(qf,field,slot_index)                              \
   (get_block((qf), (slot_index) /                                       \
              QF_SLOTS_PER_BLOCK)->field[((slot_index)  % QF_SLOTS_PER_BLOCK) / 64])
@@ -43,6 +62,14 @@
 #define GET_KEY_HASH(flag) (flag & QF_KEY_IS_HASH)
 
 #define DISTANCE_FROM_HOME_SLOT_CUTOFF 1000
+/* How many keys ahead of the current one the batched operations prefetch. */
+#define QF_PREFETCH_DISTANCE 16
+/* Longest backoff, in pause instructions, before parking a thread. */
+#define QF_LOCK_MAX_BACKOFF 1024
+/* How many runs an incremental resize copies on each insert.  The old CQF
+ * has fewer runs than 95% of its slots, so the copy is done long before the
+ * doubled CQF fills up. */
+#define QF_RESIZE_STEP_RUNS 8
 #define BILLION 1000000000L
 
 #ifdef DEBUG
@@ -64,6 +91,42 @@ static __inline__ unsigned long long rdtsc(void)
 	return ( (unsigned long long)lo)|( ((unsigned long long)hi)<<32 );
 }
 
+/* Every lock doubles as a sequence number for the readers, which don't
+ * take it: it is odd while a writer holds it and is bumped again when the
+ * writer releases it. */
+static inline bool qf_try_lock(volatile int *lock)
+{
+	int seq = *lock;
+	return !(seq & 1) && __sync_bool_compare_and_swap(lock, seq, seq + 1);
+}
+
+/* Wait until lock is not held, as the lock policy of qf says. */
+static void qf_wait_for_lock(const QF *qf, volatile int *lock)
+{
+	uint32_t policy = qf->runtimedata->lock_policy;
+	uint64_t backoff = 1;
+	uint64_t i;
+	int seq;
+
+	while ((seq = *lock) & 1) {
+		if (policy == QF_LOCK_SPIN)
+			continue;
+		if (policy == QF_LOCK_PARK && backoff == QF_LOCK_MAX_BACKOFF) {
+			/* The holder wakes up the parked threads when it releases the
+			 * lock if it sees them; if it released the lock before we are
+			 * counted, the futex doesn't sleep as the lock has changed. */
+			__sync_fetch_and_add(&qf->runtimedata->nparked, 1);
+			syscall(SYS_futex, lock, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+			__sync_fetch_and_sub(&qf->runtimedata->nparked, 1);
+			continue;
+		}
+		for (i = 0; i < backoff; i++)
+			_mm_pause();
+		if (backoff < QF_LOCK_MAX_BACKOFF)
+			backoff *= 2;
+	}
+}
+
 #ifdef LOG_WAIT_TIME
 static inline bool qf_spin_lock(QF *qf, volatile int *lock, uint64_t idx,
 																uint8_t flag)
@@ -73,22 +136,22 @@ static inline bool qf_spin_lock(QF *qf, volatile int *lock, uint64_t idx,
 
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
 	if (GET_WAIT_FOR_LOCK(flag) != QF_WAIT_FOR_LOCK) {
-		ret = !__sync_lock_test_and_set(lock, 1);
+		ret = qf_try_lock(lock);
 		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
 		qf->runtimedata->wait_times[idx].locks_acquired_single_attempt++;
 		qf->runtimedata->wait_times[idx].total_time_single += BILLION * (end.tv_sec -
 																												start.tv_sec) +
 			end.tv_nsec - start.tv_nsec;
 	} else {
-		if (!__sync_lock_test_and_set(lock, 1)) {
+		if (qf_try_lock(lock)) {
 			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
 			qf->runtimedata->wait_times[idx].locks_acquired_single_attempt++;
 			qf->runtimedata->wait_times[idx].total_time_single += BILLION * (end.tv_sec -
 																													start.tv_sec) +
 			end.tv_nsec - start.tv_nsec;
 		} else {
-			while (__sync_lock_test_and_set(lock, 1))
-				while (*lock);
+			while (!qf_try_lock(lock))
+				qf_wait_for_lock(qf, lock);
 			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
 			qf->runtimedata->wait_times[idx].total_time_spinning += BILLION * (end.tv_sec -
 																														start.tv_sec) +
@@ -123,13 +186,14 @@ static inline bool qf_spin_lock(QF *qf, volatile int *lock, uint64_t idx,
  * Try to acquire a lock once and return even if the lock is busy.
  * If spin flag is set, then spin until the lock is available.
  */
-static inline bool qf_spin_lock(volatile int *lock, uint8_t flag)
+static inline bool qf_spin_lock(const QF *qf, volatile int *lock, uint8_t
+																flag)
 {
 	if (GET_WAIT_FOR_LOCK(flag) != QF_WAIT_FOR_LOCK) {
-		return !__sync_lock_test_and_set(lock, 1);
+		return qf_try_lock(lock);
 	} else {
-		while (__sync_lock_test_and_set(lock, 1))
-			while (*lock);
+		while (!qf_try_lock(lock))
+			qf_wait_for_lock(qf, lock);
 		return true;
 	}
 
@@ -137,88 +201,90 @@ static inline bool qf_spin_lock(volatile int *lock, uint8_t flag)
 }
 #endif
 
-static inline void qf_spin_unlock(volatile int *lock)
+static inline void qf_spin_unlock(const QF *qf, volatile int *lock)
 {
-	__sync_lock_release(lock);
+	__sync_fetch_and_add(lock, 1);
+	if (qf->runtimedata->nparked > 0)
+		syscall(SYS_futex, lock, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
 	return;
 }
 
 static bool qf_lock(QF *qf, uint64_t hash_bucket_index, bool small, uint8_t
 										runtime_lock)
 {
-	uint64_t hash_bucket_lock_offset  = hash_bucket_index % NUM_SLOTS_TO_LOCK;
+	uint64_t hash_bucket_lock_offset  = LOCK_OFFSET(qf, hash_bucket_index);
 	if (small) {
 #ifdef LOG_WAIT_TIME
-		if (!qf_spin_lock(qf, &qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK],
-											hash_bucket_index/NUM_SLOTS_TO_LOCK,
+		if (!qf_spin_lock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)),
+											LOCK_REGION(qf, hash_bucket_index),
 											runtime_lock))
 			return false;
-		if (NUM_SLOTS_TO_LOCK - hash_bucket_lock_offset <= CLUSTER_SIZE) {
-			if (!qf_spin_lock(qf, &qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1],
-												hash_bucket_index/NUM_SLOTS_TO_LOCK+1,
+		if (LOCK_REGION_SLOTS(qf) - hash_bucket_lock_offset <= LOCK_CLUSTER_SIZE(qf)) {
+			if (!qf_spin_lock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)+1),
+												LOCK_REGION(qf, hash_bucket_index)+1,
 												runtime_lock)) {
-				qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
+				qf_spin_unlock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)));
 				return false;
 			}
 		}
 #else
-		if (!qf_spin_lock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK],
+		if (!qf_spin_lock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)),
 											runtime_lock))
 			return false;
-		if (NUM_SLOTS_TO_LOCK - hash_bucket_lock_offset <= CLUSTER_SIZE) {
-			if (!qf_spin_lock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1],
+		if (LOCK_REGION_SLOTS(qf) - hash_bucket_lock_offset <= LOCK_CLUSTER_SIZE(qf)) {
+			if (!qf_spin_lock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)+1),
 												runtime_lock)) {
-				qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
+				qf_spin_unlock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)));
 				return false;
 			}
 		}
 #endif
 	} else {
 #ifdef LOG_WAIT_TIME
-		if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-				CLUSTER_SIZE) {
+		if (hash_bucket_index >= LOCK_REGION_SLOTS(qf) && hash_bucket_lock_offset <=
+				LOCK_CLUSTER_SIZE(qf)) {
 			if (!qf_spin_lock(qf,
-												&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1],
+												LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)-1),
 												runtime_lock))
 				return false;
 		}
 		if (!qf_spin_lock(qf,
-											&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK],
+											LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)),
 											runtime_lock)) {
-			if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-					CLUSTER_SIZE)
-				qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1]);
+			if (hash_bucket_index >= LOCK_REGION_SLOTS(qf) && hash_bucket_lock_offset <=
+					LOCK_CLUSTER_SIZE(qf))
+				qf_spin_unlock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)-1));
 			return false;
 		}
-		if (!qf_spin_lock(qf, &qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1],
+		if (!qf_spin_lock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)+1),
 											runtime_lock)) {
-			qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
-			if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-					CLUSTER_SIZE)
-				qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1]);
+			qf_spin_unlock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)));
+			if (hash_bucket_index >= LOCK_REGION_SLOTS(qf) && hash_bucket_lock_offset <=
+					LOCK_CLUSTER_SIZE(qf))
+				qf_spin_unlock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)-1));
 			return false;
 		}
 #else
-		if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-				CLUSTER_SIZE) {
+		if (hash_bucket_index >= LOCK_REGION_SLOTS(qf) && hash_bucket_lock_offset <=
+				LOCK_CLUSTER_SIZE(qf)) {
 			if
-				(!qf_spin_lock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1],
+				(!qf_spin_lock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)-1),
 											 runtime_lock))
 				return false;
 		}
-		if (!qf_spin_lock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK],
+		if (!qf_spin_lock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)),
 											runtime_lock)) {
-			if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-					CLUSTER_SIZE)
-				qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1]);
+			if (hash_bucket_index >= LOCK_REGION_SLOTS(qf) && hash_bucket_lock_offset <=
+					LOCK_CLUSTER_SIZE(qf))
+				qf_spin_unlock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)-1));
 			return false;
 		}
-		if (!qf_spin_lock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1],
+		if (!qf_spin_lock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)+1),
 											runtime_lock)) {
-			qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
-			if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-					CLUSTER_SIZE)
-				qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1]);
+			qf_spin_unlock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)));
+			if (hash_bucket_index >= LOCK_REGION_SLOTS(qf) && hash_bucket_lock_offset <=
+					LOCK_CLUSTER_SIZE(qf))
+				qf_spin_unlock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)-1));
 			return false;
 		}
 #endif
@@ -228,19 +294,60 @@ static bool qf_lock(QF *qf, uint64_t hash_bucket_index, bool small, uint8_t
 
 static void qf_unlock(QF *qf, uint64_t hash_bucket_index, bool small)
 {
-	uint64_t hash_bucket_lock_offset  = hash_bucket_index % NUM_SLOTS_TO_LOCK;
+	uint64_t hash_bucket_lock_offset  = LOCK_OFFSET(qf, hash_bucket_index);
 	if (small) {
-		if (NUM_SLOTS_TO_LOCK - hash_bucket_lock_offset <= CLUSTER_SIZE) {
-			qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1]);
+		if (LOCK_REGION_SLOTS(qf) - hash_bucket_lock_offset <= LOCK_CLUSTER_SIZE(qf)) {
+			qf_spin_unlock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)+1));
 		}
-		qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
+		qf_spin_unlock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)));
 	} else {
-		qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1]);
-		qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
-		if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-				CLUSTER_SIZE)
-			qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1]);
+		qf_spin_unlock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)+1));
+		qf_spin_unlock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)));
+		if (hash_bucket_index >= LOCK_REGION_SLOTS(qf) && hash_bucket_lock_offset <=
+				LOCK_CLUSTER_SIZE(qf))
+			qf_spin_unlock(qf, LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)-1));
+	}
+}
+
+/* Lookups run without locks.  A reader notes the sequence numbers of the
+ * regions that the lookup of hash_bucket_index may read (those a small
+ * lock would take), waiting for writers holding them to finish, and the
+ * lookup is retried if they changed by the time it is done. */
+static inline uint64_t qf_read_begin(const QF *qf, uint64_t hash_bucket_index)
+{
+	volatile int *lock = LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index));
+	volatile int *next_lock = LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)
+																			+ 1);
+	bool next = LOCK_REGION_SLOTS(qf) - LOCK_OFFSET(qf, hash_bucket_index) <=
+		LOCK_CLUSTER_SIZE(qf);
+	uint32_t seq, next_seq;
+
+	for (;;) {
+		seq = *lock;
+		next_seq = next ? *next_lock : 0;
+		if (seq & 1)
+			qf_wait_for_lock(qf, lock);
+		else if (next_seq & 1)
+			qf_wait_for_lock(qf, next_lock);
+		else
+			break;
 	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (uint64_t)seq << 32 | next_seq;
+}
+
+static inline bool qf_read_retry(const QF *qf, uint64_t hash_bucket_index,
+																 uint64_t seq)
+{
+	volatile int *lock = LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index));
+	volatile int *next_lock = LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index)
+																			+ 1);
+	bool next = LOCK_REGION_SLOTS(qf) - LOCK_OFFSET(qf, hash_bucket_index) <=
+		LOCK_CLUSTER_SIZE(qf);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return ((uint64_t)(uint32_t)*lock << 32 |
+					(next ? (uint32_t)*next_lock : 0)) != seq;
 }
 
 /*static void modify_metadata(QF *qf, uint64_t *metadata, int cnt)*/
@@ -256,7 +363,7 @@ static void qf_unlock(QF *qf, uint64_t hash_bucket_index, bool small)
 	/*return;*/
 /*}*/
 
-static void modify_metadata(pc_t *metadata, int cnt)
+static void modify_metadata(pc_t *metadata, int64_t cnt)
 {
 	pc_add(metadata, cnt);
 	return;
@@ -320,7 +427,7 @@ static inline int bitrank(uint64_t val, int pos) {
  * The following code is taken from
  * https://github.com/facebook/folly/blob/b28186247104f8b90cfbe094d289c91f9e413317/folly/experimental/Select64.h
  */
-const uint8_t kSelectInByte[2048] = {
+static const uint8_t kSelectInByte[2048] = {
 	8, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0, 2, 0, 1, 0, 3, 0,
 	1, 0, 2, 0, 1, 0, 5, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4, 0, 1, 0,
 	2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 6, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0,
@@ -423,20 +530,45 @@ static inline uint64_t _select64(uint64_t x, int k)
 	return place + kSelectInByte[((x >> place) & 0xFF) | (byteRank << 8)];
 }
 
+#ifndef QF_KERNELS_ONLY
+bool qf_use_pdep;
+
+/* Use pdep only where it is fast: AMD CPUs before Zen 3 (family 0x19) have
+ * BMI2, but run pdep in microcode, far slower than _select64. */
+__attribute__((constructor)) static void qf_detect_cpu(void)
+{
+	unsigned int eax, ebx, ecx, edx, family;
+	bool amd;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || (ebx & bit_BMI) ==
+			0 || (ebx & bit_BMI2) == 0)
+		return;
+	__get_cpuid(0, &eax, &ebx, &ecx, &edx);
+	/* "AuthenticAMD", or "HygonGenuine" for Hygon's Zen 1 parts. */
+	amd = (ebx == 0x68747541 && edx == 0x69746e65 && ecx == 0x444d4163) ||
+		(ebx == 0x6f677948 && edx == 0x6e65476e && ecx == 0x656e6975);
+	__get_cpuid(1, &eax, &ebx, &ecx, &edx);
+	family = (eax >> 8) & 0xf;
+	if (family == 0xf)
+		family += (eax >> 20) & 0xff;
+	qf_use_pdep = !amd || family >= 0x19;
+}
+#endif
+
 // Returns the position of the rank'th 1.  (rank = 0 returns the 1st 1)
 // Returns 64 if there are fewer than rank+1 1s.
 static inline uint64_t bitselect(uint64_t val, int rank) {
-#ifdef __SSE4_2_
-	uint64_t i = 1ULL << rank;
-	asm("pdep %[val], %[mask], %[val]"
-			: [val] "+r" (val)
-			: [mask] "r" (i));
-	asm("tzcnt %[bit], %[index]"
-			: [index] "=r" (i)
-			: [bit] "g" (val)
-			: "cc");
-	return i;
-#endif
+	if (qf_use_pdep) {
+		uint64_t i = 1ULL << rank;
+		asm("pdep %[val], %[mask], %[val]"
+				: [val] "+r" (val)
+				: [mask] "r" (i));
+		asm("tzcnt %[bit], %[index]"
+				: [index] "=r" (i)
+				: [bit] "g" (val)
+				: "cc");
+		return i;
+	}
 	return _select64(val, rank);
 }
 
@@ -462,13 +594,13 @@ static inline int is_occupied(const QF *qf, uint64_t index)
 static inline uint64_t get_slot(const QF *qf, uint64_t index)
 {
 	assert(index < qf->metadata->xnslots);
-	return get_block(qf, index / QF_SLOTS_PER_BLOCK)->slots[index % QF_SLOTS_PER_BLOCK];
+	return get_slots(qf, index / QF_SLOTS_PER_BLOCK)[index % QF_SLOTS_PER_BLOCK];
 }
 
 static inline void set_slot(const QF *qf, uint64_t index, uint64_t value)
 {
 	assert(index < qf->metadata->xnslots);
-	get_block(qf, index / QF_SLOTS_PER_BLOCK)->slots[index % QF_SLOTS_PER_BLOCK] =
+	get_slots(qf, index / QF_SLOTS_PER_BLOCK)[index % QF_SLOTS_PER_BLOCK] =
 		value & BITMASK(qf->metadata->bits_per_slot);
 }
 
@@ -481,9 +613,9 @@ static inline uint64_t get_slot(const QF *qf, uint64_t index)
 	/* Should use __uint128_t to support up to 64-bit remainders, but gcc seems
 	 * to generate buggy code.  :/  */
 	assert(index < qf->metadata->xnslots);
-	uint64_t *p = (uint64_t *)&get_block(qf, index /
-																			 QF_SLOTS_PER_BLOCK)->slots[(index %
-																																QF_SLOTS_PER_BLOCK)
+	uint64_t *p = (uint64_t *)&get_slots(qf, index /
+																			 QF_SLOTS_PER_BLOCK)[(index %
+																														QF_SLOTS_PER_BLOCK)
 																			 * QF_BITS_PER_SLOT / 8];
 	return (uint64_t)(((*p) >> (((index % QF_SLOTS_PER_BLOCK) * QF_BITS_PER_SLOT) %
 															8)) & BITMASK(QF_BITS_PER_SLOT));
@@ -494,9 +626,9 @@ static inline void set_slot(const QF *qf, uint64_t index, uint64_t value)
 	/* Should use __uint128_t to support up to 64-bit remainders, but gcc seems
 	 * to generate buggy code.  :/  */
 	assert(index < qf->metadata->xnslots);
-	uint64_t *p = (uint64_t *)&get_block(qf, index /
-																			 QF_SLOTS_PER_BLOCK)->slots[(index %
-																																QF_SLOTS_PER_BLOCK)
+	uint64_t *p = (uint64_t *)&get_slots(qf, index /
+																			 QF_SLOTS_PER_BLOCK)[(index %
+																														QF_SLOTS_PER_BLOCK)
 																			 * QF_BITS_PER_SLOT / 8];
 	uint64_t t = *p;
 	uint64_t mask = BITMASK(QF_BITS_PER_SLOT);
@@ -518,9 +650,9 @@ static inline uint64_t get_slot(const QF *qf, uint64_t index)
 	assert(index < qf->metadata->xnslots);
 	/* Should use __uint128_t to support up to 64-bit remainders, but gcc seems
 	 * to generate buggy code.  :/  */
-	uint64_t *p = (uint64_t *)&get_block(qf, index /
-																			 QF_SLOTS_PER_BLOCK)->slots[(index %
-																																QF_SLOTS_PER_BLOCK)
+	uint64_t *p = (uint64_t *)&get_slots(qf, index /
+																			 QF_SLOTS_PER_BLOCK)[(index %
+																														QF_SLOTS_PER_BLOCK)
 																			 * qf->metadata->bits_per_slot / 8];
 	return (uint64_t)(((*p) >> (((index % QF_SLOTS_PER_BLOCK) *
 															 qf->metadata->bits_per_slot) % 8)) &
@@ -532,9 +664,9 @@ static inline void set_slot(const QF *qf, uint64_t index, uint64_t value)
 	assert(index < qf->metadata->xnslots);
 	/* Should use __uint128_t to support up to 64-bit remainders, but gcc seems
 	 * to generate buggy code.  :/  */
-	uint64_t *p = (uint64_t *)&get_block(qf, index /
-																			 QF_SLOTS_PER_BLOCK)->slots[(index %
-																																QF_SLOTS_PER_BLOCK)
+	uint64_t *p = (uint64_t *)&get_slots(qf, index /
+																			 QF_SLOTS_PER_BLOCK)[(index %
+																														QF_SLOTS_PER_BLOCK)
 																			 * qf->metadata->bits_per_slot / 8];
 	uint64_t t = *p;
 	uint64_t mask = BITMASK(qf->metadata->bits_per_slot);
@@ -551,14 +683,42 @@ static inline void set_slot(const QF *qf, uint64_t index, uint64_t value)
 
 static inline uint64_t run_end(const QF *qf, uint64_t hash_bucket_index);
 
+/* The largest offset that get_offset can return.  An offset that big is
+ * saturated: the real offset is at least that, and has to be computed. */
+static inline uint64_t offset_limit(const QF *qf)
+{
+	if (qf->metadata->layout & QF_LAYOUT_WIDE_OFFSETS)
+		return BITMASK(8*sizeof(uint16_t));
+	return BITMASK(8*sizeof(qf->blocks[0].offset));
+}
+
+static inline uint64_t get_offset(const QF *qf, uint64_t blockidx)
+{
+	uint64_t offset = get_block(qf, blockidx)->offset;
+	if (offset == BITMASK(8*sizeof(qf->blocks[0].offset)) &&
+			(qf->metadata->layout & QF_LAYOUT_WIDE_OFFSETS))
+		return get_wide_offsets(qf)[blockidx];
+	return offset;
+}
+
+/* Set the offset of a block, saturating it at offset_limit.  The wide
+ * offset is only written when the block's own offset saturates. */
+static inline void set_offset(const QF *qf, uint64_t blockidx, uint64_t
+															offset)
+{
+	uint64_t narrow = BITMASK(8*sizeof(qf->blocks[0].offset));
+	if (offset > offset_limit(qf))
+		offset = offset_limit(qf);
+	if (offset >= narrow && (qf->metadata->layout & QF_LAYOUT_WIDE_OFFSETS))
+		get_wide_offsets(qf)[blockidx] = offset;
+	get_block(qf, blockidx)->offset = offset < narrow ? offset : narrow;
+}
+
 static inline uint64_t block_offset(const QF *qf, uint64_t blockidx)
 {
-	/* If we have extended counters and a 16-bit (or larger) offset
-		 field, then we can safely ignore the possibility of overflowing
-		 that field. */
-	if (sizeof(qf->blocks[0].offset) > 1 || 
-			get_block(qf, blockidx)->offset < BITMASK(8*sizeof(qf->blocks[0].offset)))
-		return get_block(qf, blockidx)->offset;
+	uint64_t offset = get_offset(qf, blockidx);
+	if (offset < offset_limit(qf))
+		return offset;
 
 	return run_end(qf, QF_SLOTS_PER_BLOCK * blockidx - 1) - QF_SLOTS_PER_BLOCK *
 		blockidx + 1;
@@ -585,6 +745,11 @@ static inline uint64_t run_end(const QF *qf, uint64_t hash_bucket_index)
 		QF_SLOTS_PER_BLOCK;
 	uint64_t runend_ignore_bits  = bucket_blocks_offset % QF_SLOTS_PER_BLOCK;
 	uint64_t runend_rank         = bucket_intrablock_rank - 1;
+	/* Optimistic lookups may see an offset or runends that a writer is
+	 * changing, so the walk stops at the last block instead of trusting
+	 * them.  Such lookups are retried. */
+	if (runend_block_index >= qf->metadata->nblocks)
+		return qf->metadata->xnslots - 1;
 	uint64_t runend_block_offset = bitselectv(get_block(qf,
 																						runend_block_index)->runends[0],
 																						runend_ignore_bits, runend_rank);
@@ -595,6 +760,8 @@ static inline uint64_t run_end(const QF *qf, uint64_t hash_bucket_index)
 			return hash_bucket_index;
 		} else {
 			do {
+				if (runend_block_index + 1 >= qf->metadata->nblocks)
+					return qf->metadata->xnslots - 1;
 				runend_rank        -= popcntv(get_block(qf,
 																								runend_block_index)->runends[0],
 																			runend_ignore_bits);
@@ -647,15 +814,16 @@ static inline int probably_is_empty(const QF *qf, uint64_t slot_index)
 		&& !is_runend(qf, slot_index);
 }
 
+/* Returns xnslots or more if there is no empty slot from from on. */
 static inline uint64_t find_first_empty_slot(QF *qf, uint64_t from)
 {
-	do {
+	while (from < qf->metadata->xnslots) {
 		int t = offset_lower_bound(qf, from);
 		assert(t>=0);
 		if (t == 0)
 			break;
 		from = from + t;
-	} while(1);
+	}
 	return from;
 }
 
@@ -683,23 +851,23 @@ static inline void shift_remainders(QF *qf, uint64_t start_index, uint64_t
 	assert (start_index <= empty_index && empty_index < qf->metadata->xnslots);
 
 	while (start_block < empty_block) {
-		memmove(&get_block(qf, empty_block)->slots[1], 
-						&get_block(qf, empty_block)->slots[0],
-						empty_offset * sizeof(qf->blocks[0].slots[0]));
-		get_block(qf, empty_block)->slots[0] = get_block(qf,
-																			empty_block-1)->slots[QF_SLOTS_PER_BLOCK-1];
+		memmove(&get_slots(qf, empty_block)[1], 
+						&get_slots(qf, empty_block)[0],
+						empty_offset * sizeof(qfslot));
+		get_slots(qf, empty_block)[0] = get_slots(qf,
+																			empty_block-1)[QF_SLOTS_PER_BLOCK-1];
 		empty_block--;
 		empty_offset = QF_SLOTS_PER_BLOCK-1;
 	}
 
-	memmove(&get_block(qf, empty_block)->slots[start_offset+1], 
-					&get_block(qf, empty_block)->slots[start_offset],
-					(empty_offset - start_offset) * sizeof(qf->blocks[0].slots[0]));
+	memmove(&get_slots(qf, empty_block)[start_offset+1], 
+					&get_slots(qf, empty_block)[start_offset],
+					(empty_offset - start_offset) * sizeof(qfslot));
 }
 
 #else
 
-#define REMAINDER_WORD(qf, i) ((uint64_t *)&(get_block(qf, (i)/qf->metadata->bits_per_slot)->slots[8 * ((i) % qf->metadata->bits_per_slot)]))
+#define REMAINDER_WORD(qf, i) ((uint64_t *)&(get_slots(qf, (i)/qf->metadata->bits_per_slot)[8 * ((i) % qf->metadata->bits_per_slot)]))
 
 static inline void shift_remainders(QF *qf, const uint64_t start_index, const
 																		uint64_t empty_index)
@@ -728,7 +896,7 @@ static inline void qf_dump_block(const QF *qf, uint64_t i)
 {
 	uint64_t j;
 
-	printf("%-192d", get_block(qf, i)->offset);
+	printf("%-192lu", get_offset(qf, i));
 	printf("\n");
 
 	for (j = 0; j < QF_SLOTS_PER_BLOCK; j++)
@@ -745,13 +913,13 @@ static inline void qf_dump_block(const QF *qf, uint64_t i)
 
 #if QF_BITS_PER_SLOT == 8 || QF_BITS_PER_SLOT == 16 || QF_BITS_PER_SLOT == 32
 	for (j = 0; j < QF_SLOTS_PER_BLOCK; j++)
-		printf("%02x ", get_block(qf, i)->slots[j]);
+		printf("%02x ", get_slots(qf, i)[j]);
 #elif QF_BITS_PER_SLOT == 64
 	for (j = 0; j < QF_SLOTS_PER_BLOCK; j++)
-		printf("%02lx ", get_block(qf, i)->slots[j]);
+		printf("%02lx ", get_slots(qf, i)[j]);
 #else
 	for (j = 0; j < QF_SLOTS_PER_BLOCK * qf->metadata->bits_per_slot / 8; j++)
-		printf("%02x ", get_block(qf, i)->slots[j]);
+		printf("%02x ", get_slots(qf, i)[j]);
 #endif
 
 	printf("\n");
@@ -759,6 +927,7 @@ static inline void qf_dump_block(const QF *qf, uint64_t i)
 	printf("\n");
 }
 
+#ifndef QF_KERNELS_ONLY
 void qf_dump_metadata(const QF *qf) {
 	printf("Slots: %lu Occupied: %lu Elements: %lu Distinct: %lu\n",
 				 qf->metadata->nslots,
@@ -786,6 +955,7 @@ void qf_dump(const QF *qf)
 	}
 
 }
+#endif
 
 static inline void find_next_n_empty_slots(QF *qf, uint64_t from, uint64_t n,
 																					 uint64_t *indices)
@@ -902,10 +1072,9 @@ static inline bool insert_replace_slots_and_shift_remainders_and_runends_and_off
 						 empties[ninserts - 1 - npreceding_empties]  / QF_SLOTS_PER_BLOCK < i)
 				npreceding_empties++;
 
-			if (get_block(qf, i)->offset + ninserts - npreceding_empties < BITMASK(8*sizeof(qf->blocks[0].offset)))
-				get_block(qf, i)->offset += ninserts - npreceding_empties;
-			else
-				get_block(qf, i)->offset = (uint8_t) BITMASK(8*sizeof(qf->blocks[0].offset));
+			uint64_t offset = get_offset(qf, i);
+			if (offset < offset_limit(qf))
+				set_offset(qf, i, offset + ninserts - npreceding_empties);
 		}
 	}
 
@@ -1000,11 +1169,17 @@ static inline int remove_replace_slots_and_shift_remainders_and_runends_and_offs
 			if (runend_index / QF_SLOTS_PER_BLOCK == original_block) { // if the run ends in the same block
 				if (get_block(qf, original_block + 1)->offset == 0)
 					break;
-				get_block(qf, original_block + 1)->offset = 0;
+				set_offset(qf, original_block + 1, 0);
 			} else { // if the last run spans across the block
-				if (get_block(qf, original_block + 1)->offset == (runend_index - last_occupieds_hash_index))
+				// A saturated offset doesn't tell whether the blocks after it are
+				// up to date, so keep going until an exact offset is unchanged.
+				uint64_t offset = runend_index - last_occupieds_hash_index;
+				if (offset > offset_limit(qf))
+					offset = offset_limit(qf);
+				if (get_offset(qf, original_block + 1) == offset &&
+						offset < offset_limit(qf))
 					break;
-				get_block(qf, original_block + 1)->offset = (runend_index - last_occupieds_hash_index);
+				set_offset(qf, original_block + 1, offset);
 			}
 			original_block++;
 		}
@@ -1093,10 +1268,13 @@ static inline uint64_t *encode_counter(QF *qf, uint64_t remainder, uint64_t
 }
 
 /* Returns the length of the encoding. 
-REQUIRES: index points to first slot of a counter. */
+REQUIRES: index points to first slot of a counter.
+The last slot of the CQF ends a counter: in a consistent CQF it is a
+runend, and optimistic lookups must not read past it on a torn one. */
 static inline uint64_t decode_counter(const QF *qf, uint64_t index, uint64_t
 																			*remainder, uint64_t *count)
 {
+	uint64_t last = qf->metadata->xnslots - 1;
 	uint64_t base;
 	uint64_t rem;
 	uint64_t cnt;
@@ -1105,14 +1283,14 @@ static inline uint64_t decode_counter(const QF *qf, uint64_t index, uint64_t
 
 	*remainder = rem = get_slot(qf, index);
 
-	if (is_runend(qf, index)) { /* Entire run is "0" */
+	if (is_runend(qf, index) || index >= last) { /* Entire run is "0" */
 		*count = 1; 
 		return index;
 	}
 
 	digit = get_slot(qf, index + 1);
 
-	if (is_runend(qf, index + 1)) {
+	if (is_runend(qf, index + 1) || index + 1 >= last) {
 		*count = digit == rem ? 2 : 1;
 		return index + (digit == rem ? 1 : 0);
 	}
@@ -1141,7 +1319,7 @@ static inline uint64_t decode_counter(const QF *qf, uint64_t index, uint64_t
 	base = (1ULL << qf->metadata->bits_per_slot) - (rem ? 2 : 1);
 
 	end = index + 1;
-	while (digit != rem && !is_runend(qf, end)) {
+	while (digit != rem && !is_runend(qf, end) && end < last) {
 		if (digit > rem)
 			digit--;
 		if (digit && rem)
@@ -1157,7 +1335,7 @@ static inline uint64_t decode_counter(const QF *qf, uint64_t index, uint64_t
 		return end;
 	}
 
-	if (is_runend(qf, end) || get_slot(qf, end + 1) != 0) {
+	if (is_runend(qf, end) || end >= last || get_slot(qf, end + 1) != 0) {
 		*count = 1;
 		return index;
 	}
@@ -1180,6 +1358,23 @@ static inline uint64_t next_slot(QF *qf, uint64_t current)
 	return current;
 }
 
+/* Put a new run of one remainder into the empty home slot. */
+static inline void insert1_into_empty(QF *qf, uint64_t hash_bucket_index,
+																			uint64_t hash_remainder)
+{
+	uint64_t hash_bucket_block_offset = hash_bucket_index % QF_SLOTS_PER_BLOCK;
+
+	METADATA_WORD(qf, runends, hash_bucket_index) |= 1ULL <<
+		(hash_bucket_block_offset % 64);
+	set_slot(qf, hash_bucket_index, hash_remainder);
+	METADATA_WORD(qf, occupieds, hash_bucket_index) |= 1ULL <<
+		(hash_bucket_block_offset % 64);
+
+	modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
+	modify_metadata(&qf->runtimedata->pc_noccupied_slots, 1);
+	modify_metadata(&qf->runtimedata->pc_nelts, 1);
+}
+
 static inline int insert1(QF *qf, __uint128_t hash, uint8_t runtime_lock)
 {
 	int ret_distance = 0;
@@ -1188,20 +1383,31 @@ static inline int insert1(QF *qf, __uint128_t hash, uint8_t runtime_lock)
 	uint64_t hash_bucket_block_offset = hash_bucket_index % QF_SLOTS_PER_BLOCK;
 
 	if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK) {
+		/* Fast path for an empty home slot: nothing gets shifted, so only the
+		 * home region is written to.  Check the slot against the region's
+		 * sequence number and claim the region with a single CAS from that
+		 * number, which fails if any writer got in between.  There's no
+		 * waiting.  Writing a slot may touch the bytes after it, up to the
+		 * header of the next block, which near the end of the region belongs
+		 * to the next region: there the locked path below takes both locks,
+		 * as it does otherwise. */
+		volatile int *lock = LOCK_WORD(qf, LOCK_REGION(qf, hash_bucket_index));
+		bool near_end = LOCK_REGION_SLOTS(qf) - LOCK_OFFSET(qf, hash_bucket_index)
+			<= LOCK_CLUSTER_SIZE(qf);
+		int seq = *lock;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (!near_end && !(seq & 1) && is_empty(qf, hash_bucket_index) &&
+				__sync_bool_compare_and_swap(lock, seq, seq + 1)) {
+			insert1_into_empty(qf, hash_bucket_index, hash_remainder);
+			qf_spin_unlock(qf, lock);
+			return 0;
+		}
 		if (!qf_lock(qf, hash_bucket_index, /*small*/ true, runtime_lock))
 			return QF_COULDNT_LOCK;
 	}
 	if (is_empty(qf, hash_bucket_index) /* might_be_empty(qf, hash_bucket_index) && runend_index == hash_bucket_index */) {
-		METADATA_WORD(qf, runends, hash_bucket_index) |= 1ULL <<
-			(hash_bucket_block_offset % 64);
-		set_slot(qf, hash_bucket_index, hash_remainder);
-		METADATA_WORD(qf, occupieds, hash_bucket_index) |= 1ULL <<
-			(hash_bucket_block_offset % 64);
-		
+		insert1_into_empty(qf, hash_bucket_index, hash_remainder);
 		ret_distance = 0;
-		modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
-		modify_metadata(&qf->runtimedata->pc_noccupied_slots, 1);
-		modify_metadata(&qf->runtimedata->pc_nelts, 1);
 	} else {
 		uint64_t runend_index              = run_end(qf, hash_bucket_index);
 		int operation = 0; /* Insert into empty bucket */
@@ -1232,11 +1438,13 @@ static inline int insert1(QF *qf, __uint128_t hash, uint8_t runtime_lock)
 					zero_terminator = runstart_index + 1; /* Exactly two 0s */
 				/* Otherwise, exactly one 0 (i.e. zero_terminator == runstart_index) */
 
-				/* May read past end of run, but that's OK because loop below
-					 can handle that */
+				/* May step past end of run, but that's OK because loop below
+					 can handle that.  Past the run, the slot may be past the end
+					 of the CQF, so it isn't read. */
 				if (hash_remainder != 0) {
 					runstart_index = zero_terminator + 1;
-					current_remainder = get_slot(qf, runstart_index);
+					if (runstart_index <= runend_index)
+						current_remainder = get_slot(qf, runstart_index);
 				}
 			}
 
@@ -1257,10 +1465,11 @@ static inline int insert1(QF *qf, __uint128_t hash, uint8_t runtime_lock)
 					runstart_index++;
 				}
 
-				/* This may read past the end of the run, but the while loop
-					 condition will prevent us from using the invalid result in
-					 that case. */
-				current_remainder = get_slot(qf, runstart_index);
+				/* At the end of the run, the while loop condition stops us
+					 before the next slot, which may be past the end of the CQF,
+					 is used. */
+				if (runstart_index <= runend_index)
+					current_remainder = get_slot(qf, runstart_index);
 			}
 
 			/* If this is the first time we've inserted the new remainder,
@@ -1370,6 +1579,8 @@ static inline int insert1(QF *qf, __uint128_t hash, uint8_t runtime_lock)
 		if (operation >= 0) {
 			uint64_t empty_slot_index = find_first_empty_slot(qf, runend_index+1);
 			if (empty_slot_index >= qf->metadata->xnslots) {
+				if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK)
+					qf_unlock(qf, hash_bucket_index, /*small*/ true);
 				return QF_NO_SPACE;
 			}
 			shift_remainders(qf, insert_index, empty_slot_index);
@@ -1412,8 +1623,9 @@ static inline int insert1(QF *qf, __uint128_t hash, uint8_t runtime_lock)
 			uint64_t i;
 			for (i = hash_bucket_index / QF_SLOTS_PER_BLOCK + 1; i <=
 					 empty_slot_index/QF_SLOTS_PER_BLOCK; i++) {
-				if (get_block(qf, i)->offset < BITMASK(8*sizeof(qf->blocks[0].offset)))
-					get_block(qf, i)->offset++;
+				uint64_t offset = get_offset(qf, i);
+				if (offset < offset_limit(qf))
+					set_offset(qf, i, offset + 1);
 				assert(get_block(qf, i)->offset != 0);
 			}
 			modify_metadata(&qf->runtimedata->pc_noccupied_slots, 1);
@@ -1478,8 +1690,11 @@ static inline int insert(QF *qf, __uint128_t hash, uint64_t count, uint8_t
 																																							p, 
 																																							&new_values[67] - p, 
 																																							0);
-			if (!ret)
+			if (!ret) {
+				if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK)
+					qf_unlock(qf, hash_bucket_index, /*small*/ false);
 				return QF_NO_SPACE;
+			}
 			modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
 			ret_distance = runstart_index - hash_bucket_index;
 		} else { /* Non-empty bucket */
@@ -1506,8 +1721,11 @@ static inline int insert(QF *qf, __uint128_t hash, uint64_t count, uint8_t
 																																								p, 
 																																								&new_values[67] - p, 
 																																								0);
-				if (!ret)
+				if (!ret) {
+					if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK)
+						qf_unlock(qf, hash_bucket_index, /*small*/ false);
 					return QF_NO_SPACE;
+				}
 				modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
 				ret_distance = (current_end + 1) - hash_bucket_index;
 				/* Found a counter for this remainder.  Add in the new count. */
@@ -1520,8 +1738,11 @@ static inline int insert(QF *qf, __uint128_t hash, uint64_t count, uint8_t
 																																					p, 
 																																					&new_values[67] - p, 
 																																					current_end - runstart_index + 1);
-			if (!ret)
+			if (!ret) {
+				if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK)
+					qf_unlock(qf, hash_bucket_index, /*small*/ false);
 				return QF_NO_SPACE;
+			}
 			ret_distance = runstart_index - hash_bucket_index;
 				/* No counter for this remainder, but there are larger
 					 remainders, so we're not appending to the bucket. */
@@ -1534,8 +1755,11 @@ static inline int insert(QF *qf, __uint128_t hash, uint64_t count, uint8_t
 																																								p, 
 																																								&new_values[67] - p, 
 																																								0);
-				if (!ret)
+				if (!ret) {
+					if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK)
+						qf_unlock(qf, hash_bucket_index, /*small*/ false);
 					return QF_NO_SPACE;
+				}
 				modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
 			ret_distance = runstart_index - hash_bucket_index;
 			}
@@ -1567,8 +1791,11 @@ inline static int _remove(QF *qf, __uint128_t hash, uint64_t count, uint8_t
 	}
 
 	/* Empty bucket */
-	if (!is_occupied(qf, hash_bucket_index))
+	if (!is_occupied(qf, hash_bucket_index)) {
+		if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK)
+			qf_unlock(qf, hash_bucket_index, /*small*/ false);
 		return -1;
+	}
 
 	uint64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf, hash_bucket_index - 1) + 1;
 	uint64_t original_runstart_index = runstart_index;
@@ -1581,8 +1808,11 @@ inline static int _remove(QF *qf, __uint128_t hash, uint64_t count, uint8_t
 		current_end = decode_counter(qf, runstart_index, &current_remainder, &current_count);
 	}
 	/* remainder not found in the given run */
-	if (current_remainder != hash_remainder)
+	if (current_remainder != hash_remainder) {
+		if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK)
+			qf_unlock(qf, hash_bucket_index, /*small*/ false);
 		return -1;
+	}
 	
 	if (original_runstart_index == runstart_index && is_runend(qf, current_end))
 		only_item_in_the_run = 1;
@@ -1610,227 +1840,1050 @@ inline static int _remove(QF *qf, __uint128_t hash, uint64_t count, uint8_t
 	return ret_numfreedslots;
 }
 
-/***********************************************************************
- * Code that uses the above to implement key-value-counter operations. *
- ***********************************************************************/
+#if (QF_BITS_PER_SLOT == 8 || QF_BITS_PER_SLOT == 16) && \
+	defined(__SSE4_1__) && QF_SLOTS_PER_BLOCK == 64
+#define QF_SIMD_SCAN 1
+#if QF_BITS_PER_SLOT == 8
+#define SIMD_LANES 16
+#define simd_set1(x) _mm_set1_epi8((char)(x))
+#define simd_max(a, b) _mm_max_epu8(a, b)
+#define simd_cmpeq(a, b) _mm_cmpeq_epi8(a, b)
+#define simd_movemask(v) ((uint64_t)_mm_movemask_epi8(v))
+#define simd_shift_in(cur, last) _mm_alignr_epi8(cur, last, 15)
+#else
+#define SIMD_LANES 8
+#define simd_set1(x) _mm_set1_epi16((short)(x))
+#define simd_max(a, b) _mm_max_epu16(a, b)
+#define simd_cmpeq(a, b) _mm_cmpeq_epi16(a, b)
+#define simd_movemask(v) ((uint64_t)_mm_movemask_epi8(_mm_packs_epi16(v, v)) \
+													& 0xff)
+#define simd_shift_in(cur, last) _mm_alignr_epi8(cur, last, 14)
+#endif
 
-uint64_t qf_init(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t value_bits,
-								 enum qf_hashmode hash, uint32_t seed, void* buffer, uint64_t
-								 buffer_len)
+/* Find the first counter in the run starting at runstart whose remainder
+ * is >= target by comparing a vector of slots at a time.  Slots are
+ * sorted within a run except for the digits of counters of 3 or more,
+ * which start with a slot smaller than the remainder before them (or
+ * follow a remainder of 0), so as long as there is no such slot before
+ * it, the first slot >= target starts a counter.  Returns 1 and its index
+ * in *index, 0 if the run has no remainder >= target, and -1 if a long
+ * counter is in the way and the run has to be decoded one counter at a
+ * time. */
+static inline int find_remainder_simd(const QF *qf, uint64_t runstart,
+																			uint64_t target, uint64_t *index)
 {
-	uint64_t num_slots, xnslots, nblocks;
-	uint64_t key_remainder_bits, bits_per_slot;
-	uint64_t size;
-	uint64_t total_num_bytes;
-
-	assert(popcnt(nslots) == 1); /* nslots must be a power of 2 */
-	num_slots = nslots;
-	xnslots = nslots + 10*sqrt((double)nslots);
-	nblocks = (xnslots + QF_SLOTS_PER_BLOCK - 1) / QF_SLOTS_PER_BLOCK;
-	key_remainder_bits = key_bits;
-	while (nslots > 1 && key_remainder_bits > 0) {
-		key_remainder_bits--;
-		nslots >>= 1;
+	uint64_t block_index = runstart / QF_SLOTS_PER_BLOCK;
+	uint64_t start = runstart % QF_SLOTS_PER_BLOCK;
+	const __m128i t = simd_set1(target);
+	/* The first slot of the run can be smaller than the one before it. */
+	uint64_t skip = 1ULL << start;
+	__m128i last = _mm_setzero_si128();
+
+	if (target > 0 && get_slot(qf, runstart) == 0)
+		return -1;
+	while (true) {
+		const qfblock *b = get_block(qf, block_index);
+		const qfslot *slots = get_slots(qf, block_index);
+		uint64_t ge = 0, desc = 0, range, runends;
+		for (uint64_t i = 0; i < QF_SLOTS_PER_BLOCK; i += SIMD_LANES) {
+			__m128i cur = _mm_loadu_si128((const __m128i *)&slots[i]);
+			__m128i prev = simd_shift_in(cur, last);
+			ge |= simd_movemask(simd_cmpeq(simd_max(cur, t), cur)) << i;
+			desc |= (~simd_movemask(simd_cmpeq(simd_max(cur, prev), cur)) &
+							 BITMASK(SIMD_LANES)) << i;
+			last = cur;
+		}
+		/* Slots from start up to the end of the run. */
+		runends = b->runends[0] & ~BITMASK(start);
+		range = runends ? (runends ^ (runends - 1)) & ~BITMASK(start) :
+			~BITMASK(start);
+		desc &= range & ~skip;
+		if (ge & range) {
+			uint64_t first = __builtin_ctzll(ge & range);
+			if (desc & BITMASK(first + 1))
+				return -1;
+			*index = block_index * QF_SLOTS_PER_BLOCK + first;
+			return 1;
+		}
+		if (desc)
+			return -1;
+		if (runends)
+			return 0;
+		/* No runend up to the last block: a torn read.  Let the scalar scan
+		 * deal with it. */
+		if (block_index + 1 >= qf->metadata->nblocks)
+			return -1;
+		block_index++;
+		start = 0;
+		skip = 0;
 	}
-	assert(key_remainder_bits >= 2);
-
-	bits_per_slot = key_remainder_bits + value_bits;
-	assert (QF_BITS_PER_SLOT == 0 || QF_BITS_PER_SLOT == qf->metadata->bits_per_slot);
-	assert(bits_per_slot > 1);
-#if QF_BITS_PER_SLOT == 8 || QF_BITS_PER_SLOT == 16 || QF_BITS_PER_SLOT == 32 || QF_BITS_PER_SLOT == 64
-	size = nblocks * sizeof(qfblock);
-#else
-	size = nblocks * (sizeof(qfblock) + QF_SLOTS_PER_BLOCK * bits_per_slot / 8);
+}
 #endif
 
-	total_num_bytes = sizeof(qfmetadata) + size;
-	if (buffer == NULL || total_num_bytes > buffer_len)
-		return total_num_bytes;
-
-	// memset(buffer, 0, total_num_bytes);
-	qf->metadata = (qfmetadata *)(buffer);
-	qf->blocks = (qfblock *)(qf->metadata + 1);
+static inline uint64_t count_key_value(const QF *qf, uint64_t hash)
+{
+	uint64_t hash_remainder   = hash & BITMASK(qf->metadata->bits_per_slot);
+	int64_t hash_bucket_index = hash >> qf->metadata->bits_per_slot;
 
-	qf->metadata->magic_endian_number = MAGIC_NUMBER;
-	qf->metadata->reserved = 0;
-	qf->metadata->hash_mode = hash;
-	qf->metadata->total_size_in_bytes = size;
-	qf->metadata->seed = seed;
-	qf->metadata->nslots = num_slots;
-	qf->metadata->xnslots = xnslots;
-	qf->metadata->key_bits = key_bits;
-	qf->metadata->value_bits = value_bits;
-	qf->metadata->key_remainder_bits = key_remainder_bits;
-	qf->metadata->bits_per_slot = bits_per_slot;
+	if (!is_occupied(qf, hash_bucket_index))
+		return 0;
 
-	qf->metadata->range = qf->metadata->nslots;
-	qf->metadata->range <<= qf->metadata->key_remainder_bits;
-	qf->metadata->nblocks = (qf->metadata->xnslots + QF_SLOTS_PER_BLOCK - 1) /
-		QF_SLOTS_PER_BLOCK;
-	qf->metadata->nelts = 0;
-	qf->metadata->ndistinct_elts = 0;
-	qf->metadata->noccupied_slots = 0;
+	int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
+																																hash_bucket_index-1)
+		+ 1;
+	if (runstart_index < hash_bucket_index)
+		runstart_index = hash_bucket_index;
+	if ((uint64_t)runstart_index >= qf->metadata->xnslots)
+		return 0;
 
-	qf->runtimedata->num_locks = (qf->metadata->xnslots/NUM_SLOTS_TO_LOCK)+2;
+	/* printf("MC RUNSTART: %02lx RUNEND: %02lx\n", runstart_index, runend_index); */
 
-	pc_init(&qf->runtimedata->pc_nelts, (int64_t*)&qf->metadata->nelts, 8, 100);
-	pc_init(&qf->runtimedata->pc_ndistinct_elts, (int64_t*)&qf->metadata->ndistinct_elts, 8, 100);
-	pc_init(&qf->runtimedata->pc_noccupied_slots, (int64_t*)&qf->metadata->noccupied_slots, 8, 100);
-	/* initialize container resize */
-	qf->runtimedata->auto_resize = 0;
-	qf->runtimedata->container_resize = qf_resize_malloc;
-	/* initialize all the locks to 0 */
-	qf->runtimedata->metadata_lock = 0;
-	qf->runtimedata->locks = (volatile int *)calloc(qf->runtimedata->num_locks,
-																					sizeof(volatile int));
-	if (qf->runtimedata->locks == NULL) {
-		perror("Couldn't allocate memory for runtime locks.");
-		exit(EXIT_FAILURE);
-	}
-#ifdef LOG_WAIT_TIME
-	qf->runtimedata->wait_times = (wait_time_data*
-																 )calloc(qf->runtimedata->num_locks+1,
-																				 sizeof(wait_time_data));
-	if (qf->runtimedata->wait_times == NULL) {
-		perror("Couldn't allocate memory for runtime wait_times.");
-		exit(EXIT_FAILURE);
+	uint64_t current_remainder, current_count, current_end;
+#ifdef QF_SIMD_SCAN
+	uint64_t index;
+	switch (find_remainder_simd(qf, runstart_index, hash_remainder, &index)) {
+		case 0:
+			return 0;
+		case 1:
+			if (get_slot(qf, index) != hash_remainder)
+				return 0;
+			decode_counter(qf, index, &current_remainder, &current_count);
+			return current_count;
 	}
 #endif
+	do {
+		current_end = decode_counter(qf, runstart_index, &current_remainder,
+																 &current_count);
+		if (current_remainder == hash_remainder)
+			return current_count;
+		runstart_index = current_end + 1;
+	} while (!is_runend(qf, current_end) && current_end + 1 <
+					 qf->metadata->xnslots);
 
-	return total_num_bytes;
+	return 0;
 }
 
-uint64_t qf_use(QF* qf, void* buffer, uint64_t buffer_len)
+/* Same as count_key_value, but hash only contains the hashed key (no
+ * value bits), and the value of the first match is returned in value. */
+static inline uint64_t query(const QF *qf, uint64_t hash, uint64_t *value)
 {
-	qf->metadata = (qfmetadata *)(buffer);
-	if (qf->metadata->total_size_in_bytes + sizeof(qfmetadata) > buffer_len) {
-		return qf->metadata->total_size_in_bytes + sizeof(qfmetadata);
-	}
-	qf->blocks = (qfblock *)(qf->metadata + 1);
+	uint64_t hash_remainder   = hash & BITMASK(qf->metadata->key_remainder_bits);
+	int64_t hash_bucket_index = hash >> qf->metadata->key_remainder_bits;
 
-	qf->runtimedata = (qfruntime *)calloc(sizeof(qfruntime), 1);
-	if (qf->runtimedata == NULL) {
-		perror("Couldn't allocate memory for runtime data.");
-		exit(EXIT_FAILURE);
-	}
-	/* initialize all the locks to 0 */
-	qf->runtimedata->metadata_lock = 0;
-	qf->runtimedata->locks = (volatile int *)calloc(qf->runtimedata->num_locks,
-																					sizeof(volatile int));
-	if (qf->runtimedata->locks == NULL) {
-		perror("Couldn't allocate memory for runtime locks.");
-		exit(EXIT_FAILURE);
-	}
-#ifdef LOG_WAIT_TIME
-	qf->runtimedata->wait_times = (wait_time_data*
-																 )calloc(qf->runtimedata->num_locks+1,
-																				 sizeof(wait_time_data));
-	if (qf->runtimedata->wait_times == NULL) {
-		perror("Couldn't allocate memory for runtime wait_times.");
-		exit(EXIT_FAILURE);
+	if (!is_occupied(qf, hash_bucket_index))
+		return 0;
+
+	int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
+																																hash_bucket_index-1)
+		+ 1;
+	if (runstart_index < hash_bucket_index)
+		runstart_index = hash_bucket_index;
+	if ((uint64_t)runstart_index >= qf->metadata->xnslots)
+		return 0;
+
+	/* printf("MC RUNSTART: %02lx RUNEND: %02lx\n", runstart_index, runend_index); */
+
+	uint64_t current_remainder, current_count, current_end;
+#ifdef QF_SIMD_SCAN
+	uint64_t index;
+	switch (find_remainder_simd(qf, runstart_index, hash_remainder <<
+															qf->metadata->value_bits, &index)) {
+		case 0:
+			return 0;
+		case 1:
+			if (get_slot(qf, index) >> qf->metadata->value_bits != hash_remainder)
+				return 0;
+			decode_counter(qf, index, &current_remainder, &current_count);
+			*value = current_remainder & BITMASK(qf->metadata->value_bits);
+			return current_count;
 	}
 #endif
+	do {
+		current_end = decode_counter(qf, runstart_index, &current_remainder,
+																 &current_count);
+		*value = current_remainder & BITMASK(qf->metadata->value_bits);
+		current_remainder = current_remainder >> qf->metadata->value_bits;
+		if (current_remainder == hash_remainder) {
+			return current_count;
+		}
+		runstart_index = current_end + 1;
+	} while (!is_runend(qf, current_end) && current_end + 1 <
+					 qf->metadata->xnslots);
 
-	return sizeof(qfmetadata) + qf->metadata->total_size_in_bytes;
+	return 0;
 }
 
-void *qf_destroy(QF *qf)
-{
-	assert(qf->runtimedata != NULL);
-	if (qf->runtimedata->locks != NULL)
-		free((void*)qf->runtimedata->locks);
-	if (qf->runtimedata->wait_times != NULL)
-		free(qf->runtimedata->wait_times);
-	if (qf->runtimedata->f_info.filepath != NULL)
-		free(qf->runtimedata->f_info.filepath);
-	free(qf->runtimedata);
+#ifdef QF_KERNELS_ONLY
+#define QF_KERNELS_NAME(bits) qf_kernels_ ## bits
+#define QF_KERNELS_OF(bits) QF_KERNELS_NAME(bits)
+#define QF_KERNELS QF_KERNELS_OF(QF_BITS_PER_SLOT)
+#else
+#define QF_KERNELS qf_kernels_generic
+#endif
 
-	return (void*)qf->metadata;
+const qf_kernels QF_KERNELS = {
+	.bits_per_slot = QF_BITS_PER_SLOT,
+	.insert1 = insert1,
+	.insert = insert,
+	.remove = _remove,
+	.count_key_value = count_key_value,
+	.query = query,
+	.decode_counter = decode_counter,
+};
+
+/* The width-specific builds stop here: the rest of the library always
+ * uses the generic code, and calls the kernels through qf_kernel(). */
+#ifndef QF_KERNELS_ONLY
+
+/* An appender writes (hash, count) pairs, in increasing hash order, into
+ * an empty CQF.  Counters, occupieds, runends and block offsets are
+ * written directly in slot order, so building a CQF costs one linear
+ * pass instead of one insert (run_end + shift) per item.  Equal hashes
+ * passed in a row are combined into a single counter. */
+typedef struct appender {
+	QF *qf;
+	uint64_t run;         /* bucket of the open run, or UINT64_MAX */
+	uint64_t next;        /* first slot after the last written counter */
+	uint64_t hash;        /* pending pair, not written yet */
+	uint64_t count;
+	bool pending;
+	bool dry_run;         /* only compute the layout, don't write it */
+	int64_t nelts;
+	int64_t ndistinct_elts;
+	int64_t noccupied_slots;
+} appender;
+
+/* Start writing at slot start.  Everything before start must already be
+ * laid out; runs whose home bucket is before start are not allowed. */
+static inline void appender_init(appender *a, QF *qf, uint64_t start, bool
+																 dry_run)
+{
+	a->qf = qf;
+	a->run = UINT64_MAX;
+	a->next = start;
+	a->hash = 0;
+	a->count = 0;
+	a->pending = false;
+	a->dry_run = dry_run;
+	a->nelts = 0;
+	a->ndistinct_elts = 0;
+	a->noccupied_slots = 0;
 }
 
-bool qf_malloc(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
-							 value_bits, enum qf_hashmode hash, uint32_t seed)
+/* Set the runend of the open run and the offsets of the blocks it spills
+ * into.  An offset is only ever raised, so appenders writing adjacent
+ * ranges of the same CQF agree on the blocks they both cover. */
+static inline void appender_close_run(appender *a)
 {
-	uint64_t total_num_bytes = qf_init(qf, nslots, key_bits, value_bits,
-																		 hash, seed, NULL, 0);
+	QF *qf = a->qf;
+	uint64_t run_end_index = a->next - 1;
+	uint64_t i;
 
-	void *buffer = malloc(total_num_bytes);
-	if (buffer == NULL) {
-		perror("Couldn't allocate memory for the CQF.");
-		exit(EXIT_FAILURE);
+	if (a->run == UINT64_MAX || a->dry_run) {
+		a->run = UINT64_MAX;
+		return;
 	}
 
-	qf->runtimedata = (qfruntime *)calloc(sizeof(qfruntime), 1);
-	if (qf->runtimedata == NULL) {
-		perror("Couldn't allocate memory for runtime data.");
-		exit(EXIT_FAILURE);
+	METADATA_WORD(qf, runends, run_end_index) |= 1ULL << ((run_end_index %
+																												 QF_SLOTS_PER_BLOCK) %
+																												64);
+	for (i = a->run / QF_SLOTS_PER_BLOCK + 1; i <= run_end_index /
+			 QF_SLOTS_PER_BLOCK; i++) {
+		uint64_t offset = run_end_index - QF_SLOTS_PER_BLOCK * i + 1;
+		if (offset > offset_limit(qf))
+			offset = offset_limit(qf);
+		if (get_offset(qf, i) < offset)
+			set_offset(qf, i, offset);
 	}
-
-	uint64_t init_size = qf_init(qf, nslots, key_bits, value_bits, hash, seed,
-															 buffer, total_num_bytes);
-
-	if (init_size == total_num_bytes)
-		return true;
-	else
-		return false;
+	a->run = UINT64_MAX;
 }
 
-bool qf_free(QF *qf)
+static inline int appender_write(appender *a, uint64_t hash, uint64_t count)
 {
-	assert(qf->metadata != NULL);
-	void *buffer = qf_destroy(qf);
-	if (buffer != NULL) {
-		free(buffer);
-		return true;
+	QF *qf = a->qf;
+	uint64_t hash_remainder    = hash & BITMASK(qf->metadata->bits_per_slot);
+	uint64_t hash_bucket_index = hash >> qf->metadata->bits_per_slot;
+	uint64_t new_values[67];
+	uint64_t i;
+
+	if (hash_bucket_index != a->run) {
+		appender_close_run(a);
+		if (a->next < hash_bucket_index)
+			a->next = hash_bucket_index;
+		a->run = hash_bucket_index;
 	}
 
-	return false;
+	uint64_t *p = encode_counter(qf, hash_remainder, count, &new_values[67]);
+	uint64_t total_remainders = &new_values[67] - p;
+	if (!a->dry_run) {
+		if (a->next + total_remainders > qf->metadata->xnslots)
+			return QF_NO_SPACE;
+
+		METADATA_WORD(qf, occupieds, hash_bucket_index) |= 1ULL <<
+			((hash_bucket_index % QF_SLOTS_PER_BLOCK) % 64);
+		for (i = 0; i < total_remainders; i++)
+			set_slot(qf, a->next + i, p[i]);
+	}
+	a->next += total_remainders;
+
+	a->nelts += count;
+	a->ndistinct_elts++;
+	a->noccupied_slots += total_remainders;
+	return 0;
 }
 
-void qf_copy(QF *dest, const QF *src)
+/* Add count instances of hash.  hash must be >= the previous hash. */
+static inline int appender_add(appender *a, uint64_t hash, uint64_t count)
 {
-	DEBUG_CQF("%s\n","Source CQF");
-	DEBUG_DUMP(src);
-	memcpy(dest->runtimedata, src->runtimedata, sizeof(qfruntime));
-	memcpy(dest->metadata, src->metadata, sizeof(qfmetadata));
-	memcpy(dest->blocks, src->blocks, src->metadata->total_size_in_bytes);
-	DEBUG_CQF("%s\n","Destination CQF after copy.");
-	DEBUG_DUMP(dest);
+	if (count == 0)
+		return 0;
+	if (a->pending && hash == a->hash) {
+		a->count += count;
+		return 0;
+	}
+	if (a->pending) {
+		int ret = appender_write(a, a->hash, a->count);
+		if (ret < 0)
+			return ret;
+	}
+	a->hash = hash;
+	a->count = count;
+	a->pending = true;
+	return 0;
 }
 
-void qf_reset(QF *qf)
+/* Write the pending pair, close the last run and update the counters. */
+static inline int appender_finish(appender *a)
 {
-	qf->metadata->nelts = 0;
-	qf->metadata->ndistinct_elts = 0;
+	if (a->pending) {
+		int ret = appender_write(a, a->hash, a->count);
+		if (ret < 0)
+			return ret;
+		a->pending = false;
+	}
+	appender_close_run(a);
+	if (a->dry_run)
+		return 0;
+
+	modify_metadata(&a->qf->runtimedata->pc_nelts, a->nelts);
+	modify_metadata(&a->qf->runtimedata->pc_ndistinct_elts, a->ndistinct_elts);
+	modify_metadata(&a->qf->runtimedata->pc_noccupied_slots,
+									a->noccupied_slots);
+	return 0;
+}
+
+typedef struct hash_count {
+	uint64_t hash;
+	uint64_t count;
+} hash_count;
+
+/* LSD radix sort of the nbits-bit hashes in a, one byte per pass.  tmp must
+ * have room for n items.  Returns whichever of a and tmp holds the sorted
+ * items. */
+static hash_count *radix_sort_hash_counts(hash_count *a, hash_count *tmp,
+																					uint64_t n, uint64_t nbits)
+{
+	uint64_t shift, i;
+
+	for (shift = 0; shift < nbits; shift += 8) {
+		uint64_t hist[256] = {0};
+		for (i = 0; i < n; i++)
+			hist[(a[i].hash >> shift) & 0xff]++;
+		/* All items share this digit. */
+		if (hist[(a[0].hash >> shift) & 0xff] == n)
+			continue;
+
+		uint64_t sum = 0;
+		for (i = 0; i < 256; i++) {
+			uint64_t t = hist[i];
+			hist[i] = sum;
+			sum += t;
+		}
+		for (i = 0; i < n; i++)
+			tmp[hist[(a[i].hash >> shift) & 0xff]++] = a[i];
+
+		hash_count *t = a;
+		a = tmp;
+		tmp = t;
+	}
+
+	return a;
+}
+
+/***********************************************************************
+ * Code that uses the above to implement key-value-counter operations. *
+ ***********************************************************************/
+
+static void *qf_default_alloc(void *ctx, size_t size)
+{
+	(void)ctx;
+	return malloc(size);
+}
+
+static void *qf_default_aligned_alloc(void *ctx, size_t alignment, size_t
+																			size)
+{
+	void *ptr;
+	(void)ctx;
+	return posix_memalign(&ptr, alignment, size) == 0 ? ptr : NULL;
+}
+
+static void qf_default_free(void *ctx, void *ptr, size_t size)
+{
+	(void)ctx;
+	(void)size;
+	free(ptr);
+}
+
+static const qf_allocator qf_default_allocator = {
+	.alloc = qf_default_alloc,
+	.aligned_alloc = qf_default_aligned_alloc,
+	.free = qf_default_free,
+	.ctx = NULL,
+};
+
+/* The allocator of qf.  Runtime data that was calloc'ed has none set, and
+ * gets malloc and free. */
+static inline const qf_allocator *qf_get_allocator(const QF *qf)
+{
+	if (qf->runtimedata->allocator.alloc == NULL)
+		return &qf_default_allocator;
+	return &qf->runtimedata->allocator;
+}
+
+/* size zeroed bytes from allocator, aligned to alignment unless it is 0. */
+static void *qf_zalloc(const qf_allocator *allocator, size_t alignment,
+											 size_t size)
+{
+	void *ptr = alignment == 0 ? allocator->alloc(allocator->ctx, size) :
+		allocator->aligned_alloc(allocator->ctx, alignment, size);
+	if (ptr != NULL)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+bool qf_init_locks(QF *qf)
+{
+	qfruntime *runtime = qf->runtimedata;
+	const qf_allocator *allocator = qf_get_allocator(qf);
+	volatile int *locks;
+	wait_time_data *wait_times = NULL;
+
+	if (runtime->lock_region_bits == 0)
+		runtime->lock_region_bits = QF_DEFAULT_LOCK_REGION_BITS;
+	if (runtime->lock_stride == 0)
+		runtime->lock_stride = 1;
+
+	/* The old locks stay in place until the new ones are all there. */
+	uint64_t num_locks = LOCK_REGION(qf, qf->metadata->xnslots) + 2;
+	uint64_t locks_size = num_locks * runtime->lock_stride *
+		sizeof(volatile int);
+	locks = (volatile int *)qf_zalloc(allocator, 64, locks_size);
+	if (locks == NULL)
+		return false;
+#ifdef LOG_WAIT_TIME
+	wait_times = (wait_time_data* )qf_zalloc(allocator, 0, (num_locks+1) *
+																					 sizeof(wait_time_data));
+	if (wait_times == NULL) {
+		allocator->free(allocator->ctx, (void*)locks, locks_size);
+		return false;
+	}
+#endif
+
+	if (runtime->locks != NULL)
+		allocator->free(allocator->ctx, (void*)runtime->locks,
+										runtime->locks_size);
+	if (runtime->wait_times != NULL)
+		allocator->free(allocator->ctx, runtime->wait_times,
+										(runtime->num_locks+1) * sizeof(wait_time_data));
+	runtime->num_locks = num_locks;
+	runtime->locks_size = locks_size;
+	runtime->locks = locks;
+	runtime->wait_times = wait_times;
+	return true;
+}
+
+void qf_init_kernels(QF *qf)
+{
+#if QF_BITS_PER_SLOT == 0
+	switch (qf->metadata->bits_per_slot) {
+		case 8:
+			qf->runtimedata->kernels = &qf_kernels_8;
+			break;
+		case 16:
+			qf->runtimedata->kernels = &qf_kernels_16;
+			break;
+		case 32:
+			qf->runtimedata->kernels = &qf_kernels_32;
+			break;
+		case 64:
+			qf->runtimedata->kernels = &qf_kernels_64;
+			break;
+		default:
+			qf->runtimedata->kernels = &qf_kernels_generic;
+	}
+#else
+	/* The whole library is built for one slot width. */
+	qf->runtimedata->kernels = &qf_kernels_generic;
+#endif
+}
+
+/* The kernels of qf, which must match the slot width of its metadata. */
+static inline const qf_kernels *qf_kernel(const QF *qf)
+{
+	assert(qf->runtimedata->kernels->bits_per_slot == 0 ||
+				 qf->runtimedata->kernels->bits_per_slot ==
+				 qf->metadata->bits_per_slot);
+	return qf->runtimedata->kernels;
+}
+
+/* Zeroed local counters for the partitioned counters of qf, or NULL if
+ * they can't be allocated. */
+static lctr_t *qf_alloc_counters(const QF *qf)
+{
+	uint32_t num_counters = pc_num_counters(qf->runtimedata->num_counters);
+
+	if (num_counters == 0)
+		return NULL;
+	return (lctr_t *)qf_zalloc(qf_get_allocator(qf), sizeof(lctr_t),
+														 num_counters * sizeof(lctr_t));
+}
+
+/* Set up the partitioned counters of qf on local_counters. */
+static void qf_attach_counters(QF *qf, lctr_t *local_counters)
+{
+	pc_t *pcs[] = {&qf->runtimedata->pc_nelts,
+		&qf->runtimedata->pc_ndistinct_elts,
+		&qf->runtimedata->pc_noccupied_slots};
+	int64_t *counters[] = {(int64_t *)&qf->metadata->nelts,
+		(int64_t *)&qf->metadata->ndistinct_elts,
+		(int64_t *)&qf->metadata->noccupied_slots};
+
+	/* The three counts of an insert share a cache line per thread. */
+	pc_init_group_in(pcs, counters, 3, local_counters,
+									 qf->runtimedata->num_counters,
+									 qf->runtimedata->counter_threshold ?
+									 qf->runtimedata->counter_threshold :
+									 QF_DEFAULT_COUNTER_THRESHOLD);
+}
+
+bool qf_init_counters(QF *qf)
+{
+	lctr_t *local_counters = qf_alloc_counters(qf);
+
+	if (local_counters == NULL)
+		return false;
+	qf_attach_counters(qf, local_counters);
+	return true;
+}
+
+static void qf_destroy_counters(QF *qf)
+{
+	const qf_allocator *allocator = qf_get_allocator(qf);
+	lctr_t *local_counters = qf->runtimedata->pc_nelts.local_counters;
+	uint32_t num_counters = qf->runtimedata->pc_nelts.num_counters;
+	pc_t *pcs[] = {&qf->runtimedata->pc_nelts,
+		&qf->runtimedata->pc_ndistinct_elts,
+		&qf->runtimedata->pc_noccupied_slots};
+
+	pc_destroy_group(pcs, 3);
+	allocator->free(allocator->ctx, local_counters, num_counters *
+									sizeof(lctr_t));
+}
+
+bool qf_set_counters(QF *qf, uint32_t num_counters, int32_t threshold)
+{
+	uint32_t old_num_counters = qf->runtimedata->num_counters;
+	int32_t old_threshold = qf->runtimedata->counter_threshold;
+	lctr_t *local_counters;
+
+	if (threshold <= 0)
+		return false;
+	qf->runtimedata->num_counters = num_counters;
+	qf->runtimedata->counter_threshold = threshold;
+	/* The old counters stay in place until the new ones are there. */
+	local_counters = qf_alloc_counters(qf);
+	if (local_counters == NULL) {
+		qf->runtimedata->num_counters = old_num_counters;
+		qf->runtimedata->counter_threshold = old_threshold;
+		return false;
+	}
+	qf_destroy_counters(qf);
+	qf_attach_counters(qf, local_counters);
+	return true;
+}
+
+/* Whether qf has reached the 95% load factor at which inserts stop.  The
+ * global count of occupied slots is cheap to read, and only near the
+ * cutoff can the counts held back in the local counters matter. */
+static inline bool qf_is_full(const QF *qf)
+{
+	const pc_t *pc = &qf->runtimedata->pc_noccupied_slots;
+	double cutoff = qf->metadata->nslots * 0.95;
+
+	if (pc_read_approx(pc) + pc_error(pc) < cutoff)
+		return false;
+	return pc_read(pc) >= cutoff;
+}
+
+/* Whether qf is less than a quarter full, the load factor at which it is
+ * automatically shrunk, checked as cheaply as in qf_is_full. */
+static inline bool qf_is_sparse(const QF *qf)
+{
+	const pc_t *pc = &qf->runtimedata->pc_noccupied_slots;
+	double cutoff = qf->metadata->nslots / 4;
+
+	if (pc_read_approx(pc) - pc_error(pc) >= cutoff)
+		return false;
+	return pc_read(pc) < cutoff;
+}
+
+bool qf_can_resize(const QF *qf, uint64_t nslots)
+{
+	return popcnt(nslots) == 1 && (uint64_t)__builtin_ctzll(nslots) + 2 <=
+		qf->metadata->key_bits;
+}
+
+bool qf_copy_settings(QF *dst, const QF *src)
+{
+	dst->runtimedata->auto_resize = src->runtimedata->auto_resize;
+	dst->runtimedata->auto_shrink = src->runtimedata->auto_shrink;
+	dst->runtimedata->resize_mode = src->runtimedata->resize_mode;
+	dst->runtimedata->lock_policy = src->runtimedata->lock_policy;
+	if ((dst->runtimedata->num_counters != src->runtimedata->num_counters ||
+			 dst->runtimedata->counter_threshold !=
+			 src->runtimedata->counter_threshold) &&
+			!qf_set_counters(dst, src->runtimedata->num_counters,
+											 src->runtimedata->counter_threshold ?
+											 src->runtimedata->counter_threshold :
+											 QF_DEFAULT_COUNTER_THRESHOLD))
+		return false;
+	if (dst->runtimedata->lock_region_bits !=
+			src->runtimedata->lock_region_bits ||
+			dst->runtimedata->lock_stride != src->runtimedata->lock_stride)
+		return qf_set_lock_granularity(dst,
+																	 1ULL << src->runtimedata->lock_region_bits,
+																	 src->runtimedata->lock_stride > 1);
+	return true;
+}
+
+bool qf_set_lock_granularity(QF *qf, uint64_t slots_per_lock, bool padded)
+{
+	if (popcnt(slots_per_lock) != 1 || slots_per_lock < 1ULL <<
+			QF_MIN_LOCK_REGION_BITS)
+		return false;
+	uint64_t lock_region_bits = qf->runtimedata->lock_region_bits;
+	uint64_t lock_stride = qf->runtimedata->lock_stride;
+	qf->runtimedata->lock_region_bits = bitscanreverse(slots_per_lock);
+	qf->runtimedata->lock_stride = padded ? 64 / sizeof(volatile int) : 1;
+	if (!qf_init_locks(qf)) {
+		qf->runtimedata->lock_region_bits = lock_region_bits;
+		qf->runtimedata->lock_stride = lock_stride;
+		return false;
+	}
+	return true;
+}
+
+void qf_tune_lock_granularity(QF *qf, uint32_t nthreads, bool padded)
+{
+	uint64_t slots_per_lock = 1ULL << QF_MIN_LOCK_REGION_BITS;
+
+	/* Aim for QF_LOCK_REGIONS_PER_THREAD regions per thread, so two
+	 * threads rarely want the same lock, but no more. */
+	while (slots_per_lock * 2 * QF_LOCK_REGIONS_PER_THREAD * (nthreads ?
+																													 nthreads : 1) <=
+				 qf->metadata->nslots)
+		slots_per_lock *= 2;
+	qf_set_lock_granularity(qf, slots_per_lock, padded);
+}
+
+uint64_t qf_init(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t value_bits,
+								 enum qf_hashmode hash, uint32_t seed, void* buffer, uint64_t
+								 buffer_len)
+{
+	return qf_init_layout(qf, nslots, key_bits, value_bits, hash, seed,
+												QF_LAYOUT_PACKED, buffer, buffer_len);
+}
+
+uint64_t qf_init_layout(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
+												value_bits, enum qf_hashmode hash, uint32_t seed,
+												uint32_t layout, void* buffer, uint64_t buffer_len)
+{
+	uint64_t num_slots, xnslots, nblocks;
+	uint64_t key_remainder_bits, bits_per_slot;
+	uint64_t size;
+	uint64_t total_num_bytes;
+
+	assert(popcnt(nslots) == 1); /* nslots must be a power of 2 */
+	num_slots = nslots;
+	xnslots = nslots + 10*sqrt((double)nslots);
+	nblocks = (xnslots + QF_SLOTS_PER_BLOCK - 1) / QF_SLOTS_PER_BLOCK;
+	key_remainder_bits = key_bits;
+	while (nslots > 1 && key_remainder_bits > 0) {
+		key_remainder_bits--;
+		nslots >>= 1;
+	}
+	assert(key_remainder_bits >= 2);
+
+	bits_per_slot = key_remainder_bits + value_bits;
+	assert (QF_BITS_PER_SLOT == 0 || QF_BITS_PER_SLOT == bits_per_slot);
+	assert(bits_per_slot > 1);
+	size = qf_total_blocks_size(nblocks, bits_per_slot, layout);
+
+	total_num_bytes = sizeof(qfmetadata) + size;
+	if (buffer == NULL || total_num_bytes > buffer_len)
+		return total_num_bytes;
+
+	// memset(buffer, 0, total_num_bytes);
+	qf->metadata = (qfmetadata *)(buffer);
+	qf->blocks = (qfblock *)(qf->metadata + 1);
+
+	qf->metadata->magic_endian_number = MAGIC_NUMBER;
+	qf->metadata->layout = layout;
+	qf->metadata->hash_mode = hash;
+	qf->metadata->total_size_in_bytes = size;
+	qf->metadata->seed = seed;
+	qf->metadata->nslots = num_slots;
+	qf->metadata->xnslots = xnslots;
+	qf->metadata->key_bits = key_bits;
+	qf->metadata->value_bits = value_bits;
+	qf->metadata->key_remainder_bits = key_remainder_bits;
+	qf->metadata->bits_per_slot = bits_per_slot;
+
+	qf->metadata->range = qf->metadata->nslots;
+	qf->metadata->range <<= qf->metadata->key_remainder_bits;
+	qf->metadata->nblocks = (qf->metadata->xnslots + QF_SLOTS_PER_BLOCK - 1) /
+		QF_SLOTS_PER_BLOCK;
+	qf->metadata->nelts = 0;
+	qf->metadata->ndistinct_elts = 0;
+	qf->metadata->noccupied_slots = 0;
+
+	if (!qf_init_counters(qf))
+		return 0;
+	/* initialize container resize */
+	qf->runtimedata->auto_resize = 0;
+	qf->runtimedata->auto_shrink = 0;
+	qf->runtimedata->container_resize = qf_resize_malloc;
+	qf->runtimedata->container_expand = qf_expand_malloc;
+	qf->runtimedata->container_shrink = qf_shrink_malloc;
+	/* initialize all the locks to 0 */
+	qf->runtimedata->metadata_lock = 0;
+	if (!qf_init_locks(qf)) {
+		qf_destroy_counters(qf);
+		return 0;
+	}
+	qf_init_kernels(qf);
+
+	return total_num_bytes;
+}
+
+uint64_t qf_use(QF* qf, void* buffer, uint64_t buffer_len)
+{
+	qf->metadata = (qfmetadata *)(buffer);
+	if (qf->metadata->total_size_in_bytes + sizeof(qfmetadata) > buffer_len) {
+		return qf->metadata->total_size_in_bytes + sizeof(qfmetadata);
+	}
+	qf->blocks = (qfblock *)(qf->metadata + 1);
+
+	qf->runtimedata = (qfruntime *)qf_zalloc(&qf_default_allocator, 0,
+																					 sizeof(qfruntime));
+	if (qf->runtimedata == NULL)
+		return 0;
+	/* initialize all the locks to 0 */
+	qf->runtimedata->metadata_lock = 0;
+	if (!qf_init_locks(qf)) {
+		qf_default_allocator.free(NULL, qf->runtimedata, sizeof(qfruntime));
+		return 0;
+	}
+	if (!qf_init_counters(qf)) {
+		qf_destroy(qf);
+		return 0;
+	}
+	qf_init_kernels(qf);
+
+	return sizeof(qfmetadata) + qf->metadata->total_size_in_bytes;
+}
+
+void *qf_destroy(QF *qf)
+{
+	assert(qf->runtimedata != NULL);
+	const qf_allocator allocator = *qf_get_allocator(qf);
+	if (qf->runtimedata->resize_dst != NULL) {
+		qf_free(qf->runtimedata->resize_dst);
+		allocator.free(allocator.ctx, qf->runtimedata->resize_dst, sizeof(QF));
+	}
+	if (qf->runtimedata->pc_nelts.local_counters != NULL)
+		qf_destroy_counters(qf);
+	if (qf->runtimedata->locks != NULL)
+		allocator.free(allocator.ctx, (void*)qf->runtimedata->locks,
+									 qf->runtimedata->locks_size);
+	if (qf->runtimedata->wait_times != NULL)
+		allocator.free(allocator.ctx, qf->runtimedata->wait_times,
+									 (qf->runtimedata->num_locks+1) * sizeof(wait_time_data));
+	if (qf->runtimedata->f_info.filepath != NULL)
+		free(qf->runtimedata->f_info.filepath);
+	allocator.free(allocator.ctx, qf->runtimedata, sizeof(qfruntime));
+
+	return (void*)qf->metadata;
+}
+
+bool qf_malloc(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
+							 value_bits, enum qf_hashmode hash, uint32_t seed)
+{
+	return qf_malloc_layout(qf, nslots, key_bits, value_bits, hash, seed,
+													QF_LAYOUT_PACKED);
+}
+
+bool qf_malloc_layout(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
+											value_bits, enum qf_hashmode hash, uint32_t seed,
+											uint32_t layout)
+{
+	return qf_malloc_allocator(qf, nslots, key_bits, value_bits, hash, seed,
+														 layout, NULL);
+}
+
+bool qf_malloc_allocator(QF *qf, uint64_t nslots, uint64_t key_bits,
+												 uint64_t value_bits, enum qf_hashmode hash,
+												 uint32_t seed, uint32_t layout, const qf_allocator
+												 *allocator)
+{
+	uint64_t total_num_bytes = qf_init_layout(qf, nslots, key_bits,
+																						value_bits, hash, seed, layout,
+																						NULL, 0);
+
+	if (allocator == NULL)
+		allocator = &qf_default_allocator;
+
+	/* The metadata is 128 bytes, so the blocks are as aligned as buffer. */
+	void *buffer = qf_zalloc(allocator, 64, total_num_bytes);
+	if (buffer == NULL)
+		return false;
+
+	qf->runtimedata = (qfruntime *)qf_zalloc(allocator, 0, sizeof(qfruntime));
+	if (qf->runtimedata == NULL) {
+		allocator->free(allocator->ctx, buffer, total_num_bytes);
+		return false;
+	}
+	/* Set before qf_init_layout allocates the locks and counters.  The
+	 * default allocator is left unset, so that qf_realloc can use realloc. */
+	if (allocator->alloc != qf_default_alloc)
+		qf->runtimedata->allocator = *allocator;
+
+	uint64_t init_size = qf_init_layout(qf, nslots, key_bits, value_bits, hash,
+																			seed, layout, buffer, total_num_bytes);
+
+	if (init_size == total_num_bytes) {
+		qf->runtimedata->buffer_size = total_num_bytes;
+		return true;
+	}
+	allocator->free(allocator->ctx, qf->runtimedata, sizeof(qfruntime));
+	allocator->free(allocator->ctx, buffer, total_num_bytes);
+	return false;
+}
+
+/* Whether the kernel hands out transparent huge pages to madvised memory. */
+static bool qf_thp_enabled(void)
+{
+	char buf[64] = "";
+	FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+
+	if (f == NULL)
+		return false;
+	if (fgets(buf, sizeof(buf), f) == NULL)
+		buf[0] = '\0';
+	fclose(f);
+	return buf[0] != '\0' && strstr(buf, "[never]") == NULL;
+}
+
+/* mmap size bytes of zeroed memory with the biggest huge pages, up to
+ * hugepages, that the system has.  Sets *got to the kind of huge pages
+ * obtained and *mapped to the length of the mapping, which hugetlb pages
+ * round up.  Returns NULL if even small pages can't be mapped. */
+static void *qf_mmap(uint64_t size, uint32_t hugepages, uint32_t *got,
+										 uint64_t *mapped)
+{
+	void *buffer;
+
+	for (; hugepages >= QF_HUGEPAGES_2MB; hugepages--) {
+		int shift = hugepages == QF_HUGEPAGES_1GB ? 30 : 21;
+		uint64_t len = (size + (1ULL << shift) - 1) & ~((1ULL << shift) - 1);
+		buffer = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+									MAP_ANONYMOUS | MAP_HUGETLB | shift << MAP_HUGE_SHIFT, -1,
+									0);
+		if (buffer != MAP_FAILED) {
+			*got = hugepages;
+			*mapped = len;
+			return buffer;
+		}
+	}
+
+	*got = QF_HUGEPAGES_NONE;
+	if (hugepages == QF_HUGEPAGES_THP && qf_thp_enabled()) {
+		/* Only whole, aligned 2MB pages can be backed by transparent huge
+		 * pages, so map an extra 2MB and unmap the unaligned head and tail. */
+		uint64_t huge = 1ULL << 21;
+		uint64_t len = (size + huge - 1) & ~(huge - 1);
+		buffer = mmap(NULL, len + huge, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+									MAP_ANONYMOUS, -1, 0);
+		if (buffer != MAP_FAILED) {
+			char *start = (char *)(((uintptr_t)buffer + huge - 1) & ~(huge - 1));
+			uint64_t head = start - (char *)buffer;
+			if (head > 0)
+				munmap(buffer, head);
+			munmap(start + len, huge - head);
+			if (madvise(start, len, MADV_HUGEPAGE) == 0)
+				*got = QF_HUGEPAGES_THP;
+			*mapped = len;
+			return start;
+		}
+	}
+
+	buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+								MAP_ANONYMOUS, -1, 0);
+	if (buffer == MAP_FAILED)
+		return NULL;
+	*mapped = size;
+	return buffer;
+}
+
+bool qf_malloc_hugepages(QF *qf, uint64_t nslots, uint64_t key_bits,
+												 uint64_t value_bits, enum qf_hashmode hash,
+												 uint32_t seed, uint32_t layout, uint32_t hugepages)
+{
+	uint64_t total_num_bytes, mapped;
+	uint32_t got;
+	void *buffer;
+
+	if (hugepages == QF_HUGEPAGES_NONE)
+		return qf_malloc_layout(qf, nslots, key_bits, value_bits, hash, seed,
+														layout);
+	total_num_bytes = qf_init_layout(qf, nslots, key_bits, value_bits, hash,
+																	 seed, layout, NULL, 0);
+
+	/* mmap'ed memory is page aligned and already zeroed. */
+	buffer = qf_mmap(total_num_bytes, hugepages, &got, &mapped);
+	if (buffer == NULL)
+		return false;
+
+	/* The runtime data comes from the default allocator, which qf_destroy
+	 * gives it back to. */
+	qf->runtimedata = (qfruntime *)qf_zalloc(&qf_default_allocator, 0,
+																					 sizeof(qfruntime));
+	if (qf->runtimedata == NULL) {
+		munmap(buffer, mapped);
+		return false;
+	}
+
+	uint64_t init_size = qf_init_layout(qf, nslots, key_bits, value_bits, hash,
+																			seed, layout, buffer, total_num_bytes);
+	if (init_size != total_num_bytes) {
+		qf_default_allocator.free(NULL, qf->runtimedata, sizeof(qfruntime));
+		munmap(buffer, mapped);
+		return false;
+	}
+	qf->runtimedata->hugepages = got;
+	qf->runtimedata->hugepages_wanted = hugepages;
+	qf->runtimedata->mapped_size = mapped;
+
+	return true;
+}
+
+uint32_t qf_get_hugepages(const QF *qf)
+{
+	return qf->runtimedata->hugepages;
+}
+
+/* Bytes of the buffer of a CQF from qf_malloc*, which can be more than it
+ * uses after a resize. */
+static uint64_t qf_buffer_size(const QF *qf)
+{
+	if (qf->runtimedata->buffer_size > 0)
+		return qf->runtimedata->buffer_size;
+	return sizeof(qfmetadata) + qf->metadata->total_size_in_bytes;
+}
+
+bool qf_free(QF *qf)
+{
+	assert(qf->metadata != NULL);
+	const qf_allocator allocator = *qf_get_allocator(qf);
+	uint64_t size = qf_buffer_size(qf);
+	uint64_t mapped_size = qf->runtimedata->mapped_size;
+	void *buffer = qf_destroy(qf);
+	if (buffer != NULL) {
+		if (mapped_size > 0)
+			munmap(buffer, mapped_size);
+		else
+			allocator.free(allocator.ctx, buffer, size);
+		return true;
+	}
+
+	return false;
+}
+
+void qf_copy(QF *dest, const QF *src)
+{
+	DEBUG_CQF("%s\n","Source CQF");
+	DEBUG_DUMP(src);
+	memcpy(dest->runtimedata, src->runtimedata, sizeof(qfruntime));
+	memcpy(dest->metadata, src->metadata, sizeof(qfmetadata));
+	memcpy(dest->blocks, src->blocks, src->metadata->total_size_in_bytes);
+	DEBUG_CQF("%s\n","Destination CQF after copy.");
+	DEBUG_DUMP(dest);
+}
+
+void qf_reset(QF *qf)
+{
+	if (qf->runtimedata->resize_dst != NULL) {
+		const qf_allocator *allocator = qf_get_allocator(qf);
+		qf_free(qf->runtimedata->resize_dst);
+		allocator->free(allocator->ctx, qf->runtimedata->resize_dst, sizeof(QF));
+		qf->runtimedata->resize_dst = NULL;
+	}
+	qf->metadata->nelts = 0;
+	qf->metadata->ndistinct_elts = 0;
 	qf->metadata->noccupied_slots = 0;
 
 #ifdef LOG_WAIT_TIME
 	memset(qf->wait_times, 0,
 				 (qf->runtimedata->num_locks+1)*sizeof(wait_time_data));
 #endif
-#if QF_BITS_PER_SLOT == 8 || QF_BITS_PER_SLOT == 16 || QF_BITS_PER_SLOT == 32 || QF_BITS_PER_SLOT == 64
-	memset(qf->blocks, 0, qf->metadata->nblocks* sizeof(qfblock));
-#else
-	memset(qf->blocks, 0, qf->metadata->nblocks*(sizeof(qfblock) + QF_SLOTS_PER_BLOCK *
-																		 qf->metadata->bits_per_slot / 8));
-#endif
+	memset(qf->blocks, 0, qf->metadata->total_size_in_bytes);
+}
+
+/* Allocate an empty CQF of nslots slots like qf: with the same geometry,
+ * layout and memory. */
+static bool qf_malloc_like(QF *dst, const QF *qf, uint64_t nslots)
+{
+	if (qf->runtimedata->hugepages_wanted != QF_HUGEPAGES_NONE)
+		return qf_malloc_hugepages(dst, nslots, qf->metadata->key_bits,
+															 qf->metadata->value_bits,
+															 qf->metadata->hash_mode, qf->metadata->seed,
+															 qf->metadata->layout,
+															 qf->runtimedata->hugepages_wanted);
+	return qf_malloc_allocator(dst, nslots, qf->metadata->key_bits,
+														 qf->metadata->value_bits, qf->metadata->hash_mode,
+														 qf->metadata->seed, qf->metadata->layout,
+														 qf_get_allocator(qf));
 }
 
 int64_t qf_resize_malloc(QF *qf, uint64_t nslots)
 {
 	QF new_qf;
-	if (!qf_malloc(&new_qf, nslots, qf->metadata->key_bits,
-								 qf->metadata->value_bits, qf->metadata->hash_mode,
-								 qf->metadata->seed))
+	if (!qf_can_resize(qf, nslots))
 		return -1;
-	if (qf->runtimedata->auto_resize)
-		qf_set_auto_resize(&new_qf, true);
+	qf_resize_finish(qf);
+	if (!qf_malloc_like(&new_qf, qf, nslots))
+		return -1;
+	if (!qf_copy_settings(&new_qf, qf)) {
+		qf_free(&new_qf);
+		return -1;
+	}
 
 	// copy keys from qf into new_qf
 	QFi qfi;
 	qf_iterator_from_position(qf, &qfi, 0);
 	int64_t ret_numkeys = 0;
-	do {
+	while (!qfi_end(&qfi)) {
 		uint64_t key, value, count;
 		qfi_get_hash(&qfi, &key, &value, &count);
 		qfi_next(&qfi);
@@ -1840,7 +2893,7 @@ int64_t qf_resize_malloc(QF *qf, uint64_t nslots)
 			return ret;
 		}
 		ret_numkeys++;
-	} while(!qfi_end(&qfi));
+	}
 
 	qf_free(qf);
 	memcpy(qf, &new_qf, sizeof(QF));
@@ -1851,27 +2904,31 @@ int64_t qf_resize_malloc(QF *qf, uint64_t nslots)
 uint64_t qf_resize(QF* qf, uint64_t nslots, void* buffer, uint64_t buffer_len)
 {
 	QF new_qf;
-	new_qf.runtimedata = (qfruntime *)calloc(sizeof(qfruntime), 1);
-	if (new_qf.runtimedata == NULL) {
-		perror("Couldn't allocate memory for runtime data.\n");
-		exit(EXIT_FAILURE);
-	}
+	qf_resize_finish(qf);
+	new_qf.runtimedata = (qfruntime *)qf_zalloc(&qf_default_allocator, 0,
+																							sizeof(qfruntime));
+	if (new_qf.runtimedata == NULL)
+		return 0;
 
-	uint64_t init_size = qf_init(&new_qf, nslots, qf->metadata->key_bits,
-															 qf->metadata->value_bits,
-															 qf->metadata->hash_mode, qf->metadata->seed,
-															 buffer, buffer_len);
+	uint64_t init_size = qf_init_layout(&new_qf, nslots, qf->metadata->key_bits,
+																			qf->metadata->value_bits,
+																			qf->metadata->hash_mode,
+																			qf->metadata->seed, qf->metadata->layout,
+																			buffer, buffer_len);
 
-	if (init_size > buffer_len)
+	if (init_size == 0 || init_size > buffer_len) {
+		qf_default_allocator.free(NULL, new_qf.runtimedata, sizeof(qfruntime));
 		return init_size;
-
-	if (qf->runtimedata->auto_resize)
-		qf_set_auto_resize(&new_qf, true);
+	}
+	if (!qf_copy_settings(&new_qf, qf)) {
+		qf_destroy(&new_qf);
+		return 0;
+	}
 
 	// copy keys from qf into new_qf
 	QFi qfi;
 	qf_iterator_from_position(qf, &qfi, 0);
-	do {
+	while (!qfi_end(&qfi)) {
 		uint64_t key, value, count;
 		qfi_get_hash(&qfi, &key, &value, &count);
 		qfi_next(&qfi);
@@ -1880,7 +2937,7 @@ uint64_t qf_resize(QF* qf, uint64_t nslots, void* buffer, uint64_t buffer_len)
 			fprintf(stderr, "Failed to insert key: %ld into the new CQF.\n", key);
 			abort();
 		}
-	} while(!qfi_end(&qfi));
+	}
 
 	qf_free(qf);
 	memcpy(qf, &new_qf, sizeof(QF));
@@ -1888,6 +2945,348 @@ uint64_t qf_resize(QF* qf, uint64_t nslots, void* buffer, uint64_t buffer_len)
 	return init_size;
 }
 
+/* In-place resizing.  Doubling (halving) nslots moves the top bit of every
+ * remainder into the quotient (the low bit of every quotient into the
+ * remainder).  The hashes, and so the order of the items, don't change,
+ * so the resized CQF is laid out by an appender inside the buffer of the
+ * old one: the old blocks are read from the end of the buffer (doubling)
+ * or from its start (halving) while the new blocks are written from its
+ * start, with a queue of items read ahead to keep the writer behind the
+ * reader. */
+
+bool qf_relayout_geometry(const QF *qf, uint64_t nslots, qfmetadata *md)
+{
+	QF view;
+	QFi qfi;
+	appender a;
+
+#if QF_BITS_PER_SLOT != 0
+	return false;
+#endif
+	/* Relayout moves whole blocks, headers and slots together, and has
+	 * nowhere to keep the wide offsets while it does. */
+	if (qf->metadata->layout & (QF_LAYOUT_SPLIT | QF_LAYOUT_WIDE_OFFSETS))
+		return false;
+	*md = *qf->metadata;
+	if (nslots == qf->metadata->nslots * 2) {
+		if (md->key_remainder_bits <= 2)
+			return false;
+		md->key_remainder_bits--;
+		md->bits_per_slot--;
+	} else if (nslots * 2 == qf->metadata->nslots && nslots >=
+						 QF_SLOTS_PER_BLOCK) {
+		if (md->bits_per_slot >= 64 || md->key_remainder_bits >= md->key_bits)
+			return false;
+		md->key_remainder_bits++;
+		md->bits_per_slot++;
+	} else
+		return false;
+	md->nslots = nslots;
+	md->xnslots = nslots + 10*sqrt((double)nslots);
+	md->nblocks = (md->xnslots + QF_SLOTS_PER_BLOCK - 1) / QF_SLOTS_PER_BLOCK;
+	md->total_size_in_bytes = md->nblocks * qf_block_size(md->bits_per_slot,
+																												 md->layout);
+	/* Halving must not need a bigger buffer. */
+	if (nslots < qf->metadata->nslots && md->total_size_in_bytes >
+			qf->metadata->total_size_in_bytes)
+		return false;
+
+	/* Make sure the items fit the new layout before touching the old one. */
+	view.runtimedata = qf->runtimedata;
+	view.metadata = md;
+	view.blocks = NULL;
+	appender_init(&a, &view, 0, true);
+	qf_iterator_from_position(qf, &qfi, 0);
+	while (!qfi_end(&qfi)) {
+		uint64_t key, value, count;
+		qfi_get_hash(&qfi, &key, &value, &count);
+		appender_add(&a, key << qf->metadata->value_bits | value, count);
+		qfi_next(&qfi);
+	}
+	appender_finish(&a);
+	/* Don't leave the CQF too full to insert into. */
+	if (a.next > md->xnslots || a.noccupied_slots >= md->nslots * 0.95)
+		return false;
+
+	qf_sync_counters(qf);
+	return true;
+}
+
+/* The number of new blocks, counting from the first, that the next write of
+ * a can touch: it is at most one counter long, starts at the slot of the
+ * pending item, and set_slot may spill into the following block. */
+static inline uint64_t relayout_write_bound(const appender *a)
+{
+	const qfmetadata *md = a->qf->metadata;
+	uint64_t slot = a->next;
+	uint64_t nblocks;
+
+	if (a->pending && (a->hash >> md->bits_per_slot) > slot)
+		slot = a->hash >> md->bits_per_slot;
+	nblocks = (slot + 67) / QF_SLOTS_PER_BLOCK + 2;
+	return nblocks < md->nblocks ? nblocks : md->nblocks;
+}
+
+/* The most items that qf_relayout has to hold at once, having read them
+ * ahead of the new blocks that overwrite their old ones.  This is a dry
+ * run of its loop, in which a second iterator, behind the first, stands
+ * for the queue. */
+static uint64_t relayout_queue_length(const QF *qf, const qfmetadata *md)
+{
+	uint64_t old_block_size = qf_block_size(qf->metadata->bits_per_slot,
+																					qf->metadata->layout);
+	uint64_t block_size = qf_block_size(md->bits_per_slot, md->layout);
+	uint64_t moved = 0;	/* how far the old blocks are moved up */
+	uint64_t queued = 0, length = 0;
+	QF view;
+	QFi read, written;
+	appender a;
+
+	if (md->total_size_in_bytes > qf->metadata->total_size_in_bytes)
+		moved = md->total_size_in_bytes - qf->metadata->total_size_in_bytes;
+	view.runtimedata = qf->runtimedata;
+	view.metadata = (qfmetadata *)md;
+	view.blocks = NULL;
+	appender_init(&a, &view, 0, true);
+	qf_iterator_from_position(qf, &read, 0);
+	qf_iterator_from_position(qf, &written, 0);
+	while (queued > 0 || !qfi_end(&read)) {
+		uint64_t nblocks = relayout_write_bound(&a);
+		uint64_t key, value, count;
+
+		while (!qfi_end(&read) && (queued == 0 || nblocks * block_size > moved +
+															 read.run / QF_SLOTS_PER_BLOCK *
+															 old_block_size)) {
+			queued++;
+			qfi_next(&read);
+		}
+		if (length < queued)
+			length = queued;
+
+		qfi_get_hash(&written, &key, &value, &count);
+		appender_add(&a, key << qf->metadata->value_bits | value, count);
+		qfi_next(&written);
+		queued--;
+	}
+	return length;
+}
+
+int64_t qf_relayout(QF *qf, const qfmetadata *md)
+{
+	qfmetadata old_md = *qf->metadata;
+	char *base = (char *)qf->blocks;
+	uint64_t block_size = qf_block_size(md->bits_per_slot, md->layout);
+	uint64_t nzeroed = 0;	/* new blocks cleared so far */
+	const qf_allocator *allocator = qf_get_allocator(qf);
+	hash_count *queue;
+	uint64_t head = 0, tail = 0, capacity;
+	QF old_qf, view;
+	QFi qfi;
+	appender a;
+
+	/* Get the queue and the locks for the new size before touching the old
+	 * layout: past this point, the relayout can't fail. */
+	capacity = relayout_queue_length(qf, md);
+	if (capacity == 0)
+		capacity = 1;
+	queue = (hash_count *)allocator->alloc(allocator->ctx, capacity *
+																				 sizeof(hash_count));
+	if (queue == NULL)
+		return QF_NO_SPACE;
+	view.runtimedata = qf->runtimedata;
+	view.metadata = (qfmetadata *)md;
+	view.blocks = qf->blocks;
+	if (!qf_init_locks(&view)) {
+		allocator->free(allocator->ctx, queue, capacity * sizeof(hash_count));
+		return QF_NO_SPACE;
+	}
+
+	/* When growing, move the old blocks out of the way of the new ones. */
+	if (md->total_size_in_bytes > old_md.total_size_in_bytes) {
+		memmove(base + md->total_size_in_bytes - old_md.total_size_in_bytes,
+						base, old_md.total_size_in_bytes);
+		base += md->total_size_in_bytes - old_md.total_size_in_bytes;
+	}
+	old_qf.runtimedata = qf->runtimedata;
+	old_qf.metadata = &old_md;
+	old_qf.blocks = (qfblock *)base;
+	qf_iterator_from_position(&old_qf, &qfi, 0);
+
+	*qf->metadata = *md;
+	qf->metadata->nelts = 0;
+	qf->metadata->ndistinct_elts = 0;
+	qf->metadata->noccupied_slots = 0;
+	/* The metadata may have moved with the buffer. */
+	qf->runtimedata->pc_nelts.global_counter = (int64_t *)&qf->metadata->nelts;
+	qf->runtimedata->pc_ndistinct_elts.global_counter =
+		(int64_t *)&qf->metadata->ndistinct_elts;
+	qf->runtimedata->pc_noccupied_slots.global_counter =
+		(int64_t *)&qf->metadata->noccupied_slots;
+
+	appender_init(&a, qf, 0, false);
+	while (head < tail || !qfi_end(&qfi)) {
+		uint64_t nblocks = relayout_write_bound(&a);
+
+		/* Read ahead until the old blocks left to read start after the new
+		 * blocks about to be written. */
+		while (!qfi_end(&qfi) && (head == tail ||
+															(char *)get_block(qf, nblocks) >
+															(char *)get_block(&old_qf, qfi.run /
+																								QF_SLOTS_PER_BLOCK))) {
+			uint64_t key, value, count;
+			if (tail == capacity) {
+				assert(head > 0);
+				memmove(queue, queue + head, (tail - head) * sizeof(hash_count));
+				tail -= head;
+				head = 0;
+			}
+			qfi_get_hash(&qfi, &key, &value, &count);
+			queue[tail].hash = key << old_md.value_bits | value;
+			queue[tail].count = count;
+			tail++;
+			qfi_next(&qfi);
+		}
+
+		if (nzeroed < nblocks) {
+			memset(get_block(qf, nzeroed), 0, (nblocks - nzeroed) * block_size);
+			nzeroed = nblocks;
+		}
+		if (appender_add(&a, queue[head].hash, queue[head].count) < 0) {
+			fprintf(stderr, "Failed to lay out the resized CQF.\n");
+			abort();
+		}
+		head++;
+	}
+	allocator->free(allocator->ctx, queue, capacity * sizeof(hash_count));
+
+	/* All the old blocks have been read. */
+	memset(get_block(qf, nzeroed), 0, (md->nblocks - nzeroed) * block_size);
+	if (appender_finish(&a) < 0) {
+		fprintf(stderr, "Failed to lay out the resized CQF.\n");
+		abort();
+	}
+	qf_sync_counters(qf);
+	qf_init_kernels(qf);
+
+	return a.ndistinct_elts;
+}
+
+/* realloc the buffer of a CQF from qf_malloc, old_size bytes, to size
+ * bytes.  realloc only keeps malloc's alignment, so the aligned layout may
+ * need a copy.  The memory of qf_malloc_hugepages is moved to a new mapping
+ * of the same kind, and that of a custom allocator to a new allocation. */
+static void *qf_realloc(QF *qf, uint64_t old_size, uint64_t size)
+{
+	const qf_allocator *allocator = qf_get_allocator(qf);
+	uint32_t layout = qf->metadata->layout;
+	uint64_t used = old_size < size ? old_size : size;
+	void *buffer;
+	void *aligned;
+
+	if (qf->runtimedata->mapped_size > 0) {
+		uint64_t mapped;
+		uint32_t got;
+		buffer = qf_mmap(size, qf->runtimedata->hugepages_wanted, &got, &mapped);
+		if (buffer == NULL)
+			return NULL;
+		memcpy(buffer, qf->metadata, used);
+		munmap(qf->metadata, qf->runtimedata->mapped_size);
+		qf->runtimedata->hugepages = got;
+		qf->runtimedata->mapped_size = mapped;
+		return buffer;
+	}
+
+	if (qf->runtimedata->allocator.alloc != NULL) {
+		buffer = allocator->aligned_alloc(allocator->ctx, 64, size);
+		if (buffer == NULL)
+			return NULL;
+		memcpy(buffer, qf->metadata, used);
+		allocator->free(allocator->ctx, qf->metadata, old_size);
+		return buffer;
+	}
+
+	buffer = realloc(qf->metadata, size);
+
+	if (buffer == NULL || (layout & QF_LAYOUT_ALIGNED) == 0 ||
+			((uintptr_t)buffer & 63) == 0)
+		return buffer;
+	if (posix_memalign(&aligned, 64, size) != 0)
+		return buffer;
+	memcpy(aligned, buffer, used);
+	free(buffer);
+	return aligned;
+}
+
+/* Point qf at buffer, size bytes, that its memory was moved to. */
+static void qf_move_buffer(QF *qf, void *buffer, uint64_t size)
+{
+	qf->metadata = (qfmetadata *)buffer;
+	qf->blocks = (qfblock *)(qf->metadata + 1);
+	qf->runtimedata->buffer_size = size;
+	qf->runtimedata->pc_nelts.global_counter = (int64_t *)&qf->metadata->nelts;
+	qf->runtimedata->pc_ndistinct_elts.global_counter =
+		(int64_t *)&qf->metadata->ndistinct_elts;
+	qf->runtimedata->pc_noccupied_slots.global_counter =
+		(int64_t *)&qf->metadata->noccupied_slots;
+}
+
+/* Give back the end of the buffer of qf that a relayout left unused.  The
+ * old buffer is kept if it can't be reallocated. */
+static void qf_trim_malloc(QF *qf)
+{
+	uint64_t old_size = qf_buffer_size(qf);
+	uint64_t size = sizeof(qfmetadata) + qf->metadata->total_size_in_bytes;
+	void *buffer;
+
+	if (size >= old_size)
+		return;
+	buffer = qf_realloc(qf, old_size, size);
+	if (buffer != NULL)
+		qf_move_buffer(qf, buffer, size);
+}
+
+/* Doubling usually needs a bigger buffer, but not always: with the
+ * aligned layout, dropping a bit from the slots can halve the size of the
+ * blocks.  The old blocks are read during the relayout, so the buffer
+ * only shrinks after it. */
+int64_t qf_expand_malloc(QF *qf)
+{
+	qfmetadata md;
+	uint64_t old_size, new_size;
+	int64_t ret;
+	void *buffer;
+
+	qf_resize_finish(qf);
+	if (!qf_relayout_geometry(qf, qf->metadata->nslots * 2, &md))
+		return QF_NO_SPACE;
+	old_size = qf_buffer_size(qf);
+	new_size = sizeof(qfmetadata) + md.total_size_in_bytes;
+	if (new_size > old_size) {
+		buffer = qf_realloc(qf, old_size, new_size);
+		if (buffer == NULL)
+			return QF_NO_SPACE;
+		qf_move_buffer(qf, buffer, new_size);
+	}
+
+	ret = qf_relayout(qf, &md);
+	qf_trim_malloc(qf);
+	return ret;
+}
+
+int64_t qf_shrink_malloc(QF *qf)
+{
+	qfmetadata md;
+	int64_t ret;
+
+	qf_resize_finish(qf);
+	if (!qf_relayout_geometry(qf, qf->metadata->nslots / 2, &md))
+		return QF_NO_SPACE;
+	ret = qf_relayout(qf, &md);
+	qf_trim_malloc(qf);
+
+	return ret;
+}
+
 void qf_set_auto_resize(QF* qf, bool enabled)
 {
 	if (enabled)
@@ -1896,67 +3295,521 @@ void qf_set_auto_resize(QF* qf, bool enabled)
 		qf->runtimedata->auto_resize = 0;
 }
 
-int qf_insert(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
-							flags)
+void qf_set_auto_shrink(QF* qf, bool enabled)
+{
+	if (enabled)
+		qf->runtimedata->auto_shrink = 1;
+	else
+		qf->runtimedata->auto_shrink = 0;
+}
+
+int64_t qf_shrink(QF *qf)
+{
+	if (qf->runtimedata->container_shrink == NULL)
+		return QF_NO_SPACE;
+	return qf->runtimedata->container_shrink(qf);
+}
+
+void qf_set_lock_policy(QF *qf, enum qf_lock_policy policy)
+{
+	qf->runtimedata->lock_policy = policy;
+}
+
+void qf_set_resize_mode(QF *qf, enum qf_resize_mode mode)
+{
+	qf->runtimedata->resize_mode = mode;
+}
+
+bool qf_is_resizing(const QF *qf)
+{
+	return qf->runtimedata->resize_dst != NULL;
+}
+
+static inline int insert_count(QF *qf, uint64_t hash, uint64_t count, uint8_t
+															 flags)
+{
+	if (count == 1)
+		return qf_kernel(qf)->insert1(qf, hash, flags);
+	else
+		return qf_kernel(qf)->insert(qf, hash, count, flags);
+}
+
+/* Start an incremental resize of qf into a new CQF of nslots slots. */
+static int64_t resize_start(QF *qf, uint64_t nslots)
+{
+	const qf_allocator *allocator = qf_get_allocator(qf);
+	if (!qf_can_resize(qf, nslots))
+		return -1;
+	QF *dst = (QF *)allocator->alloc(allocator->ctx, sizeof(QF));
+	if (dst == NULL)
+		return -1;
+	if (!qf_malloc_like(dst, qf, nslots)) {
+		allocator->free(allocator->ctx, dst, sizeof(QF));
+		return -1;
+	}
+	if (!qf_copy_settings(dst, qf)) {
+		qf_free(dst);
+		allocator->free(allocator->ctx, dst, sizeof(QF));
+		return -1;
+	}
+	qf->runtimedata->resize_frontier = 0;
+	qf->runtimedata->resize_dst = dst;
+	return 0;
+}
+
+/* The metadata lock serializes the steps of an incremental resize. */
+static inline bool qf_lock_metadata(QF *qf, uint8_t flags)
+{
+	if (GET_NO_LOCK(flags) == QF_NO_LOCK)
+		return true;
+#ifdef LOG_WAIT_TIME
+	return qf_spin_lock(qf, &qf->runtimedata->metadata_lock,
+											qf->runtimedata->num_locks, flags);
+#else
+	return qf_spin_lock(qf, &qf->runtimedata->metadata_lock, flags);
+#endif
+}
+
+static inline void qf_unlock_metadata(QF *qf, uint8_t flags)
+{
+	if (GET_NO_LOCK(flags) != QF_NO_LOCK)
+		qf_spin_unlock(qf, &qf->runtimedata->metadata_lock);
+}
+
+bool qf_resize_step(QF *qf, uint64_t nruns, uint8_t flags)
+{
+	QF *dst;
+	QFi qfi;
+	int ret;
+
+	if (qf->runtimedata->resize_dst == NULL)
+		return false;
+	if (!qf_lock_metadata(qf, flags))
+		return true;
+	/* Another step may have finished the resize while we waited. */
+	dst = qf->runtimedata->resize_dst;
+	if (dst == NULL) {
+		qf_unlock_metadata(qf, flags);
+		return false;
+	}
+
+	/* Copy whole runs, so every bucket is either entirely before or
+	 * entirely after the frontier. */
+	if (qf->runtimedata->resize_frontier < qf->metadata->nslots)
+		qf_iterator_from_position(qf, &qfi, qf->runtimedata->resize_frontier);
+	else
+		qfi.current = UINT64_MAX, qfi.qf = qf;
+	while (!qfi_end(&qfi) && nruns > 0) {
+		uint64_t key, value, count;
+		uint64_t run = qfi.run;
+		qfi_get_hash(&qfi, &key, &value, &count);
+		/* The doubled CQF has room for everything, so only a busy region
+		 * lock can hold up the copy. */
+		do
+			ret = insert_count(dst, key << qf->metadata->value_bits | value, count,
+												 flags);
+		while (ret == QF_COULDNT_LOCK);
+		if (ret < 0)
+			abort();
+		qfi_next(&qfi);
+		if (qfi_end(&qfi) || qfi.run != run)
+			nruns--;
+	}
+	if (!qfi_end(&qfi)) {
+		qf->runtimedata->resize_frontier = qfi.run;
+		qf_unlock_metadata(qf, flags);
+		return true;
+	}
+
+	/* Everything has been copied: switch over to the new CQF.  If its locks
+	 * can't be changed to settings made since the start, it keeps those of
+	 * the start.  The runtime data of qf stays where it is, with the
+	 * metadata lock in it, and dst takes the old CQF to be freed. */
+	qf_copy_settings(dst, qf);
+	qf->runtimedata->resize_dst = NULL;
+	qfruntime runtime = *qf->runtimedata;
+	QF old = *qf;
+	*qf->runtimedata = *dst->runtimedata;
+	qf->runtimedata->metadata_lock = runtime.metadata_lock;
+	qf->runtimedata->nparked = runtime.nparked;
+	*dst->runtimedata = runtime;
+	qf->metadata = dst->metadata;
+	qf->blocks = dst->blocks;
+	dst->metadata = old.metadata;
+	dst->blocks = old.blocks;
+	qf_free(dst);
+	qf_get_allocator(qf)->free(qf_get_allocator(qf)->ctx, dst, sizeof(QF));
+	qf_unlock_metadata(qf, flags);
+	return false;
+}
+
+void qf_resize_finish(QF *qf)
+{
+	while (qf_resize_step(qf, UINT64_MAX, QF_WAIT_FOR_LOCK))
+		;
+}
+
+/* Returns true if the items of hash_bucket_index have not been copied into
+ * the doubled CQF of an incremental resize yet. */
+static inline bool resize_pending(const QF *qf, uint64_t hash_bucket_index)
+{
+	return hash_bucket_index >= qf->runtimedata->resize_frontier;
+}
+
+/* Double the size of qf, at once through container_resize or, in
+ * incremental mode, by starting an incremental resize.  Other threads
+ * can't use the CQF while it is being resized, so only inserts with
+ * QF_NO_LOCK start one; inserts that take locks resize at once.  In
+ * in-place mode, fall back to container_resize when the CQF can't be
+ * expanded. */
+static int64_t resize_double(QF *qf, uint8_t flags)
+{
+	if (qf->runtimedata->resize_mode == QF_RESIZE_IN_PLACE &&
+			qf->runtimedata->container_expand != NULL &&
+			qf->runtimedata->container_expand(qf) >= 0)
+		return 0;
+	if (qf->runtimedata->resize_mode == QF_RESIZE_INCREMENTAL &&
+			GET_NO_LOCK(flags) == QF_NO_LOCK &&
+			qf->runtimedata->container_resize == qf_resize_malloc)
+		return resize_start(qf, qf->metadata->nslots * 2);
+	if (qf->runtimedata->container_resize == NULL)
+		return QF_NO_SPACE;
+	return qf->runtimedata->container_resize(qf, qf->metadata->nslots * 2);
+}
+
+/* Compute the hash under which a key/value pair is stored in the CQF. */
+static inline uint64_t key_value_hash(const QF *qf, uint64_t key, uint64_t
+																			value, uint8_t flags)
+{
+	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
+		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
+			key = MurmurHash64A(((void *)&key), sizeof(key),
+													qf->metadata->seed) % qf->metadata->range;
+		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
+			key = hash_64(key, BITMASK(qf->metadata->key_bits));
+	}
+	return (key << qf->metadata->value_bits) | (value &
+																							BITMASK(qf->metadata->value_bits));
+}
+
+/* Issue prefetches for the memory that an insert or a query of hash is
+ * going to touch first: the metadata and the home slot of the home block,
+ * and the metadata of the next block, into which the run may spill. */
+static inline void prefetch_home_block(const QF *qf, uint64_t hash, int rw)
+{
+	uint64_t hash_bucket_index = hash >> qf->metadata->bits_per_slot;
+	uint64_t block_index = hash_bucket_index / QF_SLOTS_PER_BLOCK;
+	const char *b = (const char *)get_block(qf, block_index);
+	const char *slot = (const char *)get_slots(qf, block_index) +
+		(hash_bucket_index % QF_SLOTS_PER_BLOCK) * qf->metadata->bits_per_slot / 8;
+	const char *next = (const char *)get_block(qf, block_index + 1);
+	/* The rw argument of __builtin_prefetch must be a compile-time constant,
+	 * which rw is not in unoptimized builds. */
+	if (rw) {
+		__builtin_prefetch(b, 1, 3);
+		__builtin_prefetch(slot, 1, 3);
+		__builtin_prefetch(next, 1, 3);
+	} else {
+		__builtin_prefetch(b, 0, 3);
+		__builtin_prefetch(slot, 0, 3);
+		__builtin_prefetch(next, 0, 3);
+	}
+}
+
+/* The hashes of the next QF_PREFETCH_DISTANCE keys of a batch, whose home
+ * blocks have been prefetched but not used yet. */
+typedef struct prefetch_ring {
+	const QF *qf;
+	const uint64_t *keys;
+	const uint64_t *values;
+	uint64_t nkeys;
+	uint8_t flags;
+	int rw;
+	uint64_t hashes[QF_PREFETCH_DISTANCE];
+} prefetch_ring;
+
+static inline void prefetch_ring_hash(prefetch_ring *ring, uint64_t i)
+{
+	uint64_t *hash = &ring->hashes[i % QF_PREFETCH_DISTANCE];
+	*hash = key_value_hash(ring->qf, ring->keys[i], ring->values ?
+												 ring->values[i] : 0, ring->flags);
+	prefetch_home_block(ring->qf, *hash, ring->rw);
+}
+
+/* Start a batch of nkeys keys (and values, unless it is NULL). */
+static inline void prefetch_ring_init(prefetch_ring *ring, const QF *qf,
+																			const uint64_t *keys, const uint64_t
+																			*values, uint64_t nkeys, uint8_t flags,
+																			int rw)
+{
+	ring->qf = qf;
+	ring->keys = keys;
+	ring->values = values;
+	ring->nkeys = nkeys;
+	ring->flags = flags;
+	ring->rw = rw;
+	for (uint64_t i = 0; i < nkeys && i < QF_PREFETCH_DISTANCE; i++)
+		prefetch_ring_hash(ring, i);
+}
+
+/* The hash of key i, the keys before it having been taken in order.  Also
+ * prefetches the home block of key i + QF_PREFETCH_DISTANCE. */
+static inline uint64_t prefetch_ring_next(prefetch_ring *ring, uint64_t i)
+{
+	uint64_t hash = ring->hashes[i % QF_PREFETCH_DISTANCE];
+	if (i + QF_PREFETCH_DISTANCE < ring->nkeys)
+		prefetch_ring_hash(ring, i + QF_PREFETCH_DISTANCE);
+	return hash;
+}
+
+static int insert_hash(QF *qf, uint64_t hash, uint64_t count, uint8_t flags)
+{
+	// During an incremental resize, new items go into the doubled CQF.
+	if (qf->runtimedata->resize_dst != NULL &&
+			qf_resize_step(qf, QF_RESIZE_STEP_RUNS, flags)) {
+		QF *dst = qf->runtimedata->resize_dst;
+		if (!qf_is_full(dst))
+			return insert_hash(dst, hash, count, flags);
+		qf_resize_finish(qf);
+	}
+
+	// We fill up the CQF up to 95% load factor.
+	// This is a very conservative check.
+	if (qf_is_full(qf)) {
+		if (qf->runtimedata->auto_resize) {
+			if (resize_double(qf, flags) < 0)
+				return QF_NO_SPACE;
+			if (qf->runtimedata->resize_dst != NULL)
+				return insert_hash(qf->runtimedata->resize_dst, hash, count, flags);
+		} else
+			return QF_NO_SPACE;
+	}
+	if (count == 0)
+		return 0;
+
+	int ret = insert_count(qf, hash, count, flags);
+
+	// check for fullness based on the distance from the home slot to the slot
+	// in which the key is inserted
+	if (ret == QF_NO_SPACE || ret > DISTANCE_FROM_HOME_SLOT_CUTOFF) {
+		if (qf->runtimedata->auto_resize) {
+			if (resize_double(qf, flags) >= 0) {
+				if (ret == QF_NO_SPACE)
+					ret = insert_count(qf->runtimedata->resize_dst != NULL ?
+														 qf->runtimedata->resize_dst : qf, hash, count,
+														 flags);
+			} else
+				ret = QF_NO_SPACE;
+		} else
+			ret = QF_NO_SPACE;
+	}
+	return ret;
+}
+
+int qf_insert(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
+							flags)
+{
+	return insert_hash(qf, key_value_hash(qf, key, value, flags), count, flags);
+}
+
+int64_t qf_insert_batch(QF *qf, const uint64_t *keys, const uint64_t *values,
+												const uint64_t *counts, uint64_t nkeys, uint8_t flags,
+												int *rets)
+{
+	prefetch_ring ring;
+	int64_t ninserted = 0;
+
+	prefetch_ring_init(&ring, qf, keys, values, nkeys, flags, 1);
+	for (uint64_t i = 0; i < nkeys; i++) {
+		int ret = insert_hash(qf, prefetch_ring_next(&ring, i), counts ?
+													counts[i] : 1, flags);
+		if (ret >= 0)
+			ninserted++;
+		if (rets)
+			rets[i] = ret;
+	}
+
+	return ninserted;
+}
+
+/* Write nkeys pairs out into the empty qf.  Returns 0 or, if they don't
+ * fit under the load factor of insert_hash or the scratch space for the
+ * sort can't be allocated, QF_NO_SPACE. */
+static int bulk_append(QF *qf, const uint64_t *keys, const uint64_t *values,
+											 const uint64_t *counts, uint64_t nkeys, uint8_t flags)
+{
+	appender a;
+	uint64_t prev_hash = 0;
+	uint64_t i;
+	int ret = 0;
+
+	/* A dump of another CQF (e.g. from qfi_get_hash) is already in hash
+	 * order and can be written out without sorting. */
+	for (i = 0; i < nkeys; i++) {
+		uint64_t hash = key_value_hash(qf, keys[i], values ? values[i] : 0,
+																	 flags);
+		if (hash < prev_hash)
+			break;
+		prev_hash = hash;
+	}
+
+	appender_init(&a, qf, 0, false);
+	if (i == nkeys) {
+		for (i = 0; i < nkeys && ret == 0; i++)
+			ret = appender_add(&a, key_value_hash(qf, keys[i], values ? values[i] :
+																						0, flags), counts ? counts[i] : 1);
+	} else {
+		const qf_allocator *allocator = qf_get_allocator(qf);
+		hash_count *items = (hash_count *)allocator->alloc(allocator->ctx, 2 *
+																											 nkeys *
+																											 sizeof(hash_count));
+		if (items == NULL)
+			return QF_NO_SPACE;
+		for (i = 0; i < nkeys; i++) {
+			items[i].hash = key_value_hash(qf, keys[i], values ? values[i] : 0,
+																		 flags);
+			items[i].count = counts ? counts[i] : 1;
+		}
+		hash_count *sorted = radix_sort_hash_counts(items, items + nkeys, nkeys,
+																								qf->metadata->key_bits +
+																								qf->metadata->value_bits);
+		for (i = 0; i < nkeys && ret == 0; i++)
+			ret = appender_add(&a, sorted[i].hash, sorted[i].count);
+		allocator->free(allocator->ctx, items, 2 * nkeys * sizeof(hash_count));
+	}
+	if (ret == 0)
+		ret = appender_finish(&a);
+	if (ret == 0 && qf_is_full(qf))
+		ret = QF_NO_SPACE;
+	return ret;
+}
+
+int64_t qf_bulk_load(QF *qf, const uint64_t *keys, const uint64_t *values,
+										 const uint64_t *counts, uint64_t nkeys, uint8_t flags)
+{
+	int ret;
+
+	if (nkeys == 0)
+		return 0;
+
+	if (qf_get_num_occupied_slots(qf) > 0)
+		return qf_insert_batch(qf, keys, values, counts, nkeys, flags, NULL);
+
+	/* If the pairs don't fit, grow the CQF (when auto resizing) and start
+	 * over, as qf_multi_merge does. */
+	while ((ret = bulk_append(qf, keys, values, counts, nkeys, flags)) < 0) {
+		qf_reset(qf);
+		if (ret != QF_NO_SPACE || !qf->runtimedata->auto_resize ||
+				qf->runtimedata->container_resize == NULL ||
+				qf->runtimedata->container_resize(qf, qf->metadata->nslots * 2) < 0)
+			return ret;
+	}
+	return nkeys;
+}
+
+bool qf_buffer_init(QFbuffer *buf, QF *qf, uint64_t capacity, uint8_t flags)
+{
+	if (capacity == 0)
+		return false;
+	buf->qf = qf;
+	buf->flags = flags;
+	buf->nitems = 0;
+	buf->capacity = capacity;
+	const qf_allocator *allocator = qf_get_allocator(qf);
+	buf->items = (hash_count *)allocator->alloc(allocator->ctx, 2 * capacity *
+																							sizeof(hash_count));
+	return buf->items != NULL;
+}
+
+int qf_buffer_insert(QFbuffer *buf, uint64_t key, uint64_t value, uint64_t
+										 count, uint8_t flags)
 {
-	// We fill up the CQF up to 95% load factor.
-	// This is a very conservative check.
-	if (qf_get_num_occupied_slots(qf) >= qf->metadata->nslots * 0.95) {
-		if (qf->runtimedata->auto_resize) {
-			/*fprintf(stdout, "Resizing the CQF.\n");*/
-			if (qf->runtimedata->container_resize(qf, qf->metadata->nslots * 2) < 0)
-			{
-				fprintf(stderr, "Resizing the failed.\n");
-				return QF_NO_SPACE;
-			}
-		} else
-			return QF_NO_SPACE;
-	}
 	if (count == 0)
 		return 0;
+	if (buf->nitems == buf->capacity) {
+		int ret = qf_buffer_flush(buf);
+		if (ret < 0)
+			return ret;
+	}
+	buf->items[buf->nitems].hash = key_value_hash(buf->qf, key, value, flags);
+	buf->items[buf->nitems].count = count;
+	buf->nitems++;
+	return 0;
+}
+
+int qf_buffer_flush(QFbuffer *buf)
+{
+	QF *qf = buf->qf;
+	hash_count *items;
+	uint64_t i = 0, n = 0;
+	int ret = 0;
+
+	if (buf->nitems == 0)
+		return 0;
 
-	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
-			key = MurmurHash64A(((void *)&key), sizeof(key),
-													qf->metadata->seed) % qf->metadata->range;
-		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
-			key = hash_64(key, BITMASK(qf->metadata->key_bits));
+	/* Sort by hash, which groups the items by lock region, and combine
+	 * the counts of equal hashes. */
+	items = radix_sort_hash_counts(buf->items, buf->items + buf->capacity,
+																 buf->nitems, qf->metadata->key_bits +
+																 qf->metadata->value_bits);
+	for (i = 1; i < buf->nitems; i++) {
+		if (items[i].hash == items[n].hash)
+			items[n].count += items[i].count;
+		else
+			items[++n] = items[i];
 	}
-	uint64_t hash = (key << qf->metadata->value_bits) | (value &
-																											 BITMASK(qf->metadata->value_bits));
-	int ret;
-	if (count == 1)
-		ret = insert1(qf, hash, flags);
-	else
-		ret = insert(qf, hash, count, flags);
+	n++;
+
+	/* Insert each region's items under a single lock acquisition.  A big
+	 * lock at the start of the region covers the locks that the insert of
+	 * any of its items would take.  Items that can't go in that way (the
+	 * CQF is filling up or being resized) take the regular insert path. */
+	for (i = 0; i < n && ret >= 0; ) {
+		uint64_t region = LOCK_REGION(qf, items[i].hash >>
+																	qf->metadata->bits_per_slot);
+		uint64_t end = i;
+		while (end < n && LOCK_REGION(qf, items[end].hash >>
+																	qf->metadata->bits_per_slot) == region)
+			end++;
+
+		if (qf->runtimedata->resize_dst != NULL ||
+				qf_is_full(qf)) {
+			for (; i < end && ret >= 0; i++)
+				ret = insert_hash(qf, items[i].hash, items[i].count, buf->flags);
+			if (ret >= 0)
+				continue;
+			i--;
+			break;
+		}
 
-	// check for fullness based on the distance from the home slot to the slot
-	// in which the key is inserted
-	if (ret == QF_NO_SPACE || ret > DISTANCE_FROM_HOME_SLOT_CUTOFF) {
-		float load_factor = qf_get_num_occupied_slots(qf) /
-			(float)qf->metadata->nslots;
-		fprintf(stdout, "Load factor: %lf\n", load_factor);
-		if (qf->runtimedata->auto_resize) {
-			fprintf(stdout, "Resizing the CQF.\n");
-			if (qf->runtimedata->container_resize(qf, qf->metadata->nslots * 2) > 0)
-			{
-				if (ret == QF_NO_SPACE) {
-					if (count == 1)
-						ret = insert1(qf, hash, flags);
-					else
-						ret = insert(qf, hash, count, flags);
-				}
-				fprintf(stderr, "Resize finished.\n");
-			} else {
-				fprintf(stderr, "Resize failed\n");
-				ret = QF_NO_SPACE;
-			}
-		} else {
-			fprintf(stderr, "The CQF is filling up.\n");
-			ret = QF_NO_SPACE;
+		if (GET_NO_LOCK(buf->flags) != QF_NO_LOCK &&
+				!qf_lock(qf, region * LOCK_REGION_SLOTS(qf), /*small*/ false,
+								 buf->flags)) {
+			ret = QF_COULDNT_LOCK;
+			break;
+		}
+		for (; i < end; i++) {
+			ret = insert_count(qf, items[i].hash, items[i].count, QF_NO_LOCK);
+			if (ret < 0)
+				break;
 		}
+		if (GET_NO_LOCK(buf->flags) != QF_NO_LOCK)
+			qf_unlock(qf, region * LOCK_REGION_SLOTS(qf), /*small*/ false);
 	}
-	return ret;
+
+	/* Keep whatever didn't go in for the next flush. */
+	buf->nitems = n - i;
+	memmove(buf->items, items + i, buf->nitems * sizeof(hash_count));
+	return ret < 0 ? ret : 0;
+}
+
+void qf_buffer_free(QFbuffer *buf)
+{
+	const qf_allocator *allocator = qf_get_allocator(buf->qf);
+	allocator->free(allocator->ctx, buf->items, 2 * buf->capacity *
+									sizeof(hash_count));
+	buf->items = NULL;
+	buf->nitems = buf->capacity = 0;
 }
 
 int qf_set_count(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
@@ -1979,6 +3832,57 @@ int qf_set_count(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
 	return ret;
 }
 
+/* Shrink qf, unless a shrink of the same CQF failed with not many more
+ * items in it, which is remembered to back off from. */
+static void auto_shrink(QF *qf)
+{
+	qfruntime *runtime = qf->runtimedata;
+	uint64_t noccupied = qf_get_num_occupied_slots(qf);
+
+	if (runtime->shrink_failed_nslots == qf->metadata->nslots &&
+			noccupied > runtime->shrink_failed_at / 2)
+		return;
+	if (qf_shrink(qf) >= 0)
+		runtime->shrink_failed_nslots = 0;
+	else {
+		runtime->shrink_failed_nslots = qf->metadata->nslots;
+		runtime->shrink_failed_at = noccupied;
+	}
+}
+
+/* During an incremental resize, instances that have not been copied yet are
+ * removed from the old CQF first. */
+static int remove_hash(QF *qf, uint64_t hash, uint64_t count, uint8_t flags)
+{
+	QF *dst = qf->runtimedata->resize_dst;
+	int ret_numfreedslots = 0;
+
+	if (dst == NULL) {
+		int ret = qf_kernel(qf)->remove(qf, hash, count, flags);
+		// Halve the CQF once it is less than a quarter full, leaving it
+		// less than half full.
+		if (ret > 0 && qf->runtimedata->auto_shrink && qf_is_sparse(qf))
+			auto_shrink(qf);
+		return ret;
+	}
+
+	if (resize_pending(qf, hash >> qf->metadata->bits_per_slot)) {
+		uint64_t old_count = qf_kernel(qf)->count_key_value(qf, hash);
+		if (old_count > 0) {
+			ret_numfreedslots = qf_kernel(qf)->remove(qf, hash, count < old_count ?
+																								count : old_count, flags);
+			if (ret_numfreedslots < 0 || count <= old_count)
+				return ret_numfreedslots;
+			count -= old_count;
+			if (qf_kernel(dst)->count_key_value(dst, hash) == 0)
+				return ret_numfreedslots;
+		}
+	}
+
+	int ret = qf_kernel(dst)->remove(dst, hash, count, flags);
+	return ret < 0 ? ret : ret_numfreedslots + ret;
+}
+
 int qf_remove(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
 							flags)
 {
@@ -1994,7 +3898,7 @@ int qf_remove(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
 	}
 	uint64_t hash = (key << qf->metadata->value_bits) | (value &
 																											 BITMASK(qf->metadata->value_bits));
-	return _remove(qf, hash, count, flags);
+	return remove_hash(qf, hash, count, flags);
 }
 
 int qf_delete_key_value(QF *qf, uint64_t key, uint64_t value, uint8_t flags)
@@ -2012,84 +3916,125 @@ int qf_delete_key_value(QF *qf, uint64_t key, uint64_t value, uint8_t flags)
 	}
 	uint64_t hash = (key << qf->metadata->value_bits) | (value &
 																											 BITMASK(qf->metadata->value_bits));
-	return _remove(qf, hash, count, flags);
+	return remove_hash(qf, hash, count, flags);
 }
 
-uint64_t qf_count_key_value(const QF *qf, uint64_t key, uint64_t value,
-														uint8_t flags)
+/* Unless called with QF_NO_LOCK, lookups run optimistically and retry if
+ * a writer modified the regions they read. */
+static inline uint64_t read_count_key_value(const QF *qf, uint64_t hash,
+																						uint8_t flags)
 {
-	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
-			key = MurmurHash64A(((void *)&key), sizeof(key),
-													qf->metadata->seed) % qf->metadata->range;
-		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
-			key = hash_64(key, BITMASK(qf->metadata->key_bits));
-	}
-	uint64_t hash = (key << qf->metadata->value_bits) | (value &
-																											 BITMASK(qf->metadata->value_bits));
-	uint64_t hash_remainder   = hash & BITMASK(qf->metadata->bits_per_slot);
-	int64_t hash_bucket_index = hash >> qf->metadata->bits_per_slot;
-
-	if (!is_occupied(qf, hash_bucket_index))
-		return 0;
+	uint64_t hash_bucket_index = hash >> qf->metadata->bits_per_slot;
+	uint64_t seq, count;
 
-	int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
-																																hash_bucket_index-1)
-		+ 1;
-	if (runstart_index < hash_bucket_index)
-		runstart_index = hash_bucket_index;
+	if (GET_NO_LOCK(flags) == QF_NO_LOCK)
+		return qf_kernel(qf)->count_key_value(qf, hash);
+	do {
+		seq = qf_read_begin(qf, hash_bucket_index);
+		count = qf_kernel(qf)->count_key_value(qf, hash);
+	} while (qf_read_retry(qf, hash_bucket_index, seq));
+	return count;
+}
 
-	/* printf("MC RUNSTART: %02lx RUNEND: %02lx\n", runstart_index, runend_index); */
+static inline uint64_t read_query(const QF *qf, uint64_t hash, uint64_t
+																	*value, uint8_t flags)
+{
+	uint64_t hash_bucket_index = hash >> qf->metadata->key_remainder_bits;
+	uint64_t seq, count;
 
-	uint64_t current_remainder, current_count, current_end;
+	if (GET_NO_LOCK(flags) == QF_NO_LOCK)
+		return qf_kernel(qf)->query(qf, hash, value);
 	do {
-		current_end = decode_counter(qf, runstart_index, &current_remainder,
-																 &current_count);
-		if (current_remainder == hash_remainder)
-			return current_count;
-		runstart_index = current_end + 1;
-	} while (!is_runend(qf, current_end));
+		seq = qf_read_begin(qf, hash_bucket_index);
+		count = qf_kernel(qf)->query(qf, hash, value);
+	} while (qf_read_retry(qf, hash_bucket_index, seq));
+	return count;
+}
 
-	return 0;
+uint64_t qf_read_start(const QF *qf, uint64_t hash_bucket_index)
+{
+	return qf_read_begin(qf, hash_bucket_index);
 }
 
-uint64_t qf_query(const QF *qf, uint64_t key, uint64_t *value, uint8_t flags)
+bool qf_read_changed(const QF *qf, uint64_t hash_bucket_index, uint64_t seq)
 {
-	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
-			key = MurmurHash64A(((void *)&key), sizeof(key),
-													qf->metadata->seed) % qf->metadata->range;
-		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
-			key = hash_64(key, BITMASK(qf->metadata->key_bits));
-	}
-	uint64_t hash = key;
-	uint64_t hash_remainder   = hash & BITMASK(qf->metadata->key_remainder_bits);
-	int64_t hash_bucket_index = hash >> qf->metadata->key_remainder_bits;
+	return qf_read_retry(qf, hash_bucket_index, seq);
+}
 
-	if (!is_occupied(qf, hash_bucket_index))
-		return 0;
+/* Lookups during an incremental resize consult the doubled CQF, and the
+ * old CQF if the hash has not been copied yet. */
+static inline uint64_t count_hash(const QF *qf, uint64_t hash, uint8_t flags)
+{
+	const QF *dst = qf->runtimedata->resize_dst;
+	if (dst == NULL)
+		return read_count_key_value(qf, hash, flags);
+
+	uint64_t count = read_count_key_value(dst, hash, flags);
+	if (resize_pending(qf, hash >> qf->metadata->bits_per_slot))
+		count += read_count_key_value(qf, hash, flags);
+	return count;
+}
 
-	int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
-																																hash_bucket_index-1)
-		+ 1;
-	if (runstart_index < hash_bucket_index)
-		runstart_index = hash_bucket_index;
+static inline uint64_t query_hash(const QF *qf, uint64_t hash, uint64_t
+																	*value, uint8_t flags)
+{
+	const QF *dst = qf->runtimedata->resize_dst;
+	if (dst == NULL)
+		return read_query(qf, hash, value, flags);
+
+	uint64_t count = read_query(dst, hash, value, flags);
+	if (count == 0 && resize_pending(qf, hash >>
+																	 qf->metadata->key_remainder_bits))
+		count = read_query(qf, hash, value, flags);
+	return count;
+}
 
-	/* printf("MC RUNSTART: %02lx RUNEND: %02lx\n", runstart_index, runend_index); */
+uint64_t qf_count_key_value(const QF *qf, uint64_t key, uint64_t value,
+														uint8_t flags)
+{
+	return count_hash(qf, key_value_hash(qf, key, value, flags), flags);
+}
 
-	uint64_t current_remainder, current_count, current_end;
-	do {
-		current_end = decode_counter(qf, runstart_index, &current_remainder,
-																 &current_count);
-		*value = current_remainder & BITMASK(qf->metadata->value_bits);
-		current_remainder = current_remainder >> qf->metadata->value_bits;
-		if (current_remainder == hash_remainder) {
-			return current_count;
-		}
-		runstart_index = current_end + 1;
-	} while (!is_runend(qf, current_end));
+uint64_t qf_query(const QF *qf, uint64_t key, uint64_t *value, uint8_t flags)
+{
+	return query_hash(qf, key_value_hash(qf, key, 0, flags) >>
+										qf->metadata->value_bits, value, flags);
+}
 
-	return 0;
+uint64_t qf_count_key_value_batch(const QF *qf, const uint64_t *keys, const
+																	uint64_t *values, uint64_t nkeys, uint64_t
+																	*counts, uint8_t flags)
+{
+	prefetch_ring ring;
+	uint64_t nfound = 0;
+
+	prefetch_ring_init(&ring, qf, keys, values, nkeys, flags, 0);
+	for (uint64_t i = 0; i < nkeys; i++) {
+		counts[i] = count_hash(qf, prefetch_ring_next(&ring, i), flags);
+		if (counts[i] > 0)
+			nfound++;
+	}
+
+	return nfound;
+}
+
+uint64_t qf_query_batch(const QF *qf, const uint64_t *keys, uint64_t nkeys,
+												uint64_t *values, uint64_t *counts, uint8_t flags)
+{
+	prefetch_ring ring;
+	uint64_t nfound = 0;
+
+	prefetch_ring_init(&ring, qf, keys, NULL, nkeys, flags, 0);
+	for (uint64_t i = 0; i < nkeys; i++) {
+		uint64_t hash = prefetch_ring_next(&ring, i);
+		values[i] = 0;
+		counts[i] = query_hash(qf, hash >> qf->metadata->value_bits, &values[i],
+													 flags);
+		if (counts[i] > 0)
+			nfound++;
+	}
+
+	return nfound;
 }
 
 int64_t qf_get_unique_index(const QF *qf, uint64_t key, uint64_t value,
@@ -2146,6 +4091,12 @@ bool qf_is_auto_resize_enabled(const QF *qf) {
 		return true;
 	return false;
 }
+
+bool qf_is_auto_shrink_enabled(const QF *qf) {
+	if (qf->runtimedata->auto_shrink == 1)
+		return true;
+	return false;
+}
 uint64_t qf_get_total_size_in_bytes(const QF *qf) {
 	return qf->metadata->total_size_in_bytes;
 }
@@ -2153,8 +4104,10 @@ uint64_t qf_get_nslots(const QF *qf) {
 	return qf->metadata->nslots;
 }
 uint64_t qf_get_num_occupied_slots(const QF *qf) {
-	pc_sync(&qf->runtimedata->pc_noccupied_slots);
-	return qf->metadata->noccupied_slots;
+	return pc_read(&qf->runtimedata->pc_noccupied_slots);
+}
+uint64_t qf_get_num_occupied_slots_approx(const QF *qf) {
+	return pc_read_approx(&qf->runtimedata->pc_noccupied_slots);
 }
 
 uint64_t qf_get_num_key_bits(const QF *qf) {
@@ -2171,12 +4124,10 @@ uint64_t qf_get_bits_per_slot(const QF *qf) {
 }
 
 uint64_t qf_get_sum_of_counts(const QF *qf) {
-	pc_sync(&qf->runtimedata->pc_nelts);
-	return qf->metadata->nelts;
+	return pc_read(&qf->runtimedata->pc_nelts);
 }
 uint64_t qf_get_num_distinct_key_value_pairs(const QF *qf) {
-	pc_sync(&qf->runtimedata->pc_ndistinct_elts);
-	return qf->metadata->ndistinct_elts;
+	return pc_read(&qf->runtimedata->pc_ndistinct_elts);
 }
 
 void qf_sync_counters(const QF *qf) {
@@ -2185,6 +4136,23 @@ void qf_sync_counters(const QF *qf) {
 	pc_sync(&qf->runtimedata->pc_noccupied_slots);
 }
 
+/* Returns the first occupied bucket >= from, or nslots if there is none. */
+static inline uint64_t next_occupied(const QF *qf, uint64_t from)
+{
+	uint64_t block_index = from / QF_SLOTS_PER_BLOCK;
+	uint64_t idx;
+
+	if (from >= qf->metadata->nslots)
+		return qf->metadata->nslots;
+	idx = bitselect(get_block(qf, block_index)->occupieds[0] &
+									~BITMASK(from % QF_SLOTS_PER_BLOCK), 0);
+	while (idx == QF_SLOTS_PER_BLOCK && ++block_index < qf->metadata->nblocks)
+		idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
+	if (block_index >= qf->metadata->nblocks)
+		return qf->metadata->nslots;
+	return block_index * QF_SLOTS_PER_BLOCK + idx;
+}
+
 /* initialize the iterator at the run corresponding
  * to the position index
  */
@@ -2196,20 +4164,16 @@ int64_t qf_iterator_from_position(const QF *qf, QFi *qfi, uint64_t position)
 		return QFI_INVALID;
 	}
 	assert(position < qf->metadata->nslots);
+	qfi->qf = qf;
+	qfi->num_clusters = 0;
 	if (!is_occupied(qf, position)) {
-		uint64_t block_index = position;
-		uint64_t idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
-		if (idx == 64) {
-			while(idx == 64 && block_index < qf->metadata->nblocks) {
-				block_index++;
-				idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
-			}
+		position = next_occupied(qf, position);
+		if (position >= qf->metadata->nslots) {
+			qfi->run = qfi->current = qf->metadata->xnslots;
+			return QFI_INVALID;
 		}
-		position = block_index * QF_SLOTS_PER_BLOCK + idx;
 	}
 
-	qfi->qf = qf;
-	qfi->num_clusters = 0;
 	qfi->run = position;
 	qfi->current = position == 0 ? 0 : run_end(qfi->qf, position-1) + 1;
 	if (qfi->current < position)
@@ -2287,15 +4251,12 @@ int64_t qf_iterator_from_key_value(const QF *qf, QFi *qfi, uint64_t key,
 	if (!is_occupied(qf, hash_bucket_index) || !flag) {
 		uint64_t position = hash_bucket_index;
 		assert(position < qf->metadata->nslots);
-		uint64_t block_index = position / QF_SLOTS_PER_BLOCK;
-		uint64_t idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
-		if (idx == 64) {
-			while(idx == 64 && block_index < qf->metadata->nblocks) {
-				block_index++;
-				idx = bitselect(get_block(qf, block_index)->occupieds[0], 0);
-			}
+		position = next_occupied(qf, is_occupied(qf, position) ? position + 1 :
+														 position);
+		if (position >= qf->metadata->nslots) {
+			qfi->run = qfi->current = qf->metadata->xnslots;
+			return QFI_INVALID;
 		}
-		position = block_index * QF_SLOTS_PER_BLOCK + idx;
 		qfi->run = position;
 		qfi->current = position == 0 ? 0 : run_end(qfi->qf, position-1) + 1;
 		if (qfi->current < position)
@@ -2314,7 +4275,8 @@ static int qfi_get(const QFi *qfi, uint64_t *key, uint64_t *value, uint64_t
 		return QFI_INVALID;
 
 	uint64_t current_remainder, current_count;
-	decode_counter(qfi->qf, qfi->current, &current_remainder, &current_count);
+	qf_kernel(qfi->qf)->decode_counter(qfi->qf, qfi->current, &current_remainder,
+																		 &current_count);
 
 	*value = current_remainder & BITMASK(qfi->qf->metadata->value_bits);
 	current_remainder = current_remainder >> qfi->qf->metadata->value_bits;
@@ -2354,8 +4316,9 @@ int qfi_next(QFi *qfi)
 	else {
 		/* move to the end of the current counter*/
 		uint64_t current_remainder, current_count;
-		qfi->current = decode_counter(qfi->qf, qfi->current, &current_remainder,
-																	&current_count);
+		qfi->current = qf_kernel(qfi->qf)->decode_counter(qfi->qf, qfi->current,
+																											&current_remainder,
+																											&current_count);
 		
 		if (!is_runend(qfi->qf, qfi->current)) {
 			qfi->current++;
@@ -2378,11 +4341,9 @@ int qfi_next(QFi *qfi)
 																		rank);
 			if (next_run == 64) {
 				rank = 0;
-				while (next_run == 64 && block_index < qfi->qf->metadata->nblocks) {
-					block_index++;
+				while (next_run == 64 && ++block_index < qfi->qf->metadata->nblocks)
 					next_run = bitselect(get_block(qfi->qf, block_index)->occupieds[0],
 															 rank);
-				}
 			}
 			if (block_index == qfi->qf->metadata->nblocks) {
 				/* set the index values to max. */
@@ -2418,22 +4379,116 @@ bool qfi_end(const QFi *qfi)
 	return false;
 }
 
+/* Sift heap[i] down the min-heap of iterator indexes keyed by hashes. */
+static inline void merge_heap_sift_down(int *heap, int n, int i, const
+																				uint64_t *hashes)
+{
+	while (1) {
+		int smallest = i;
+		int l = 2 * i + 1, r = 2 * i + 2;
+		if (l < n && hashes[heap[l]] < hashes[heap[smallest]])
+			smallest = l;
+		if (r < n && hashes[heap[r]] < hashes[heap[smallest]])
+			smallest = r;
+		if (smallest == i)
+			return;
+		int t = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = t;
+		i = smallest;
+	}
+}
+
+static inline uint64_t qfi_current_hash(const QFi *qfi, const QF *qfr,
+																				uint64_t *count)
+{
+	uint64_t key, value;
+	qfi_get_hash(qfi, &key, &value, count);
+	return (key << qfr->metadata->value_bits) | (value &
+																							 BITMASK(qfr->metadata->value_bits));
+}
+
 /*
- * Merge qfa and qfb into qfc 
+ * Iterate over the items of all the qfs whose bucket in qfr is in
+ * [start_bucket, end_bucket), simultaneously and in hash order, picking
+ * the smallest hash from a min-heap of the iterators and summing the
+ * counts of equal hashes.  If a is not NULL, the items are written into
+ * qfr sequentially by the appender, otherwise they are inserted.  The
+ * range is turned into hashes up front, as inserts may resize qfr, which
+ * moves the hashes to other buckets.
  */
+/* Add a merged item to qfr, through a if there is one. */
+static inline int merge_add(QF *qfr, appender *a, uint64_t hash, uint64_t
+														count)
+{
+	int ret;
+
+	if (a)
+		return appender_add(a, hash, count);
+	ret = insert_hash(qfr, hash, count, QF_NO_LOCK | QF_KEY_IS_HASH);
+	return ret < 0 ? ret : 0;
+}
+
+static int merge_hash_order(const QF *qf_arr[], int nqf, QF *qfr, appender
+														*a, uint64_t start_bucket, uint64_t end_bucket)
+{
+	QFi qfi_arr[nqf];
+	uint64_t hashes[nqf];
+	uint64_t counts[nqf];
+	int heap[nqf];
+	int nheap = 0;
+	int i, ret = 0;
+	uint64_t start_hash = start_bucket << qfr->metadata->bits_per_slot;
+	uint64_t last_hash = end_bucket < qfr->metadata->nslots ?
+		(end_bucket << qfr->metadata->bits_per_slot) - 1 : UINT64_MAX;
+	uint64_t hash = 0, count = 0;
+
+	for (i = 0; i < nqf; i++) {
+		qf_iterator_from_key_value(qf_arr[i], &qfi_arr[i], start_hash >>
+															 qfr->metadata->value_bits, start_hash &
+															 BITMASK(qfr->metadata->value_bits),
+															 QF_KEY_IS_HASH);
+		if (!qfi_end(&qfi_arr[i])) {
+			hashes[i] = qfi_current_hash(&qfi_arr[i], qfr, &counts[i]);
+			if (hashes[i] <= last_hash)
+				heap[nheap++] = i;
+		}
+	}
+	for (i = nheap / 2 - 1; i >= 0; i--)
+		merge_heap_sift_down(heap, nheap, i, hashes);
+
+	while (nheap > 0) {
+		i = heap[0];
+		if (count > 0 && hashes[i] != hash) {
+			ret = merge_add(qfr, a, hash, count);
+			if (ret < 0)
+				return ret;
+			count = 0;
+		}
+		hash = hashes[i];
+		count += counts[i];
+
+		qfi_next(&qfi_arr[i]);
+		if (!qfi_end(&qfi_arr[i]))
+			hashes[i] = qfi_current_hash(&qfi_arr[i], qfr, &counts[i]);
+		if (qfi_end(&qfi_arr[i]) || hashes[i] > last_hash)
+			heap[0] = heap[--nheap];
+		merge_heap_sift_down(heap, nheap, 0, hashes);
+	}
+	if (count > 0)
+		ret = merge_add(qfr, a, hash, count);
+	if (a && ret == 0)
+		ret = appender_finish(a);
+
+	return ret;
+}
+
 /*
- * iterate over both qf (qfa and qfb)
- * simultaneously 
- * for each index i 
- * min(get_value(qfa, ia) < get_value(qfb, ib))
- * insert(min, ic) 
- * increment either ia or ib, whichever is minimum.
+ * Merge qfa and qfb into qfc 
  */
-void qf_merge(const QF *qfa, const QF *qfb, QF *qfc)
+int qf_merge(const QF *qfa, const QF *qfb, QF *qfc)
 {
-	QFi qfia, qfib;
-	qf_iterator_from_position(qfa, &qfia, 0);
-	qf_iterator_from_position(qfb, &qfib, 0);
+	const QF *qf_arr[] = {qfa, qfb};
 
 	if (qfa->metadata->hash_mode != qfc->metadata->hash_mode &&
 			qfa->metadata->seed != qfc->metadata->seed &&
@@ -2443,52 +4498,21 @@ void qf_merge(const QF *qfa, const QF *qfb, QF *qfc)
 		exit(1);
 	}
 
-	uint64_t keya, valuea, counta, keyb, valueb, countb;
-	qfi_get_hash(&qfia, &keya, &valuea, &counta);
-	qfi_get_hash(&qfib, &keyb, &valueb, &countb);
-	do {
-		if (keya < keyb) {
-			qf_insert(qfc, keya, valuea, counta, QF_NO_LOCK | QF_KEY_IS_HASH);
-			qfi_next(&qfia);
-			qfi_get_hash(&qfia, &keya, &valuea, &counta);
-		}
-		else {
-			qf_insert(qfc, keyb, valueb, countb, QF_NO_LOCK | QF_KEY_IS_HASH);
-			qfi_next(&qfib);
-			qfi_get_hash(&qfib, &keyb, &valueb, &countb);
-		}
-	} while(!qfi_end(&qfia) && !qfi_end(&qfib));
-
-	if (!qfi_end(&qfia)) {
-		do {
-			qfi_get_hash(&qfia, &keya, &valuea, &counta);
-			qf_insert(qfc, keya, valuea, counta, QF_NO_LOCK | QF_KEY_IS_HASH);
-		} while(!qfi_next(&qfia));
-	}
-	if (!qfi_end(&qfib)) {
-		do {
-			qfi_get_hash(&qfib, &keyb, &valueb, &countb);
-			qf_insert(qfc, keyb, valueb, countb, QF_NO_LOCK | QF_KEY_IS_HASH);
-		} while(!qfi_next(&qfib));
-	}
+	return qf_multi_merge(qf_arr, 2, qfc);
 }
 
 /*
  * Merge an array of qfs into the resultant QF
  */
-void qf_multi_merge(const QF *qf_arr[], int nqf, QF *qfr)
+int qf_multi_merge(const QF *qf_arr[], int nqf, QF *qfr)
 {
-	int i;
-	QFi qfi_arr[nqf];
-	int smallest_idx = 0;
-	uint64_t smallest_key = UINT64_MAX;
+	int i, ret = 0;
 	for (i=0; i<nqf; i++) {
 		if (qf_arr[i]->metadata->hash_mode != qfr->metadata->hash_mode &&
 				qf_arr[i]->metadata->seed != qfr->metadata->seed) {
 			fprintf(stderr, "Output QF and input QFs do not have the same hash mode or seed.\n");
 			exit(1);
 		}
-		qf_iterator_from_position(qf_arr[i], &qfi_arr[i], 0);
 	}
 
 	DEBUG_CQF("Merging %d CQFs\n", nqf);
@@ -2497,50 +4521,164 @@ void qf_multi_merge(const QF *qf_arr[], int nqf, QF *qfr)
 		DEBUG_DUMP(qf_arr[i]);
 	}
 
-	while (nqf > 1) {
-		uint64_t keys[nqf];
-		uint64_t values[nqf];
-		uint64_t counts[nqf];
-		for (i=0; i<nqf; i++)
-			qfi_get_hash(&qfi_arr[i], &keys[i], &values[i], &counts[i]);
-		
-		do {
-			smallest_key = UINT64_MAX;
-			for (i=0; i<nqf; i++) {
-				if (keys[i] < smallest_key) {
-					smallest_key = keys[i]; smallest_idx = i;
-				}
-			}
-			qf_insert(qfr, keys[smallest_idx], values[smallest_idx],
-								counts[smallest_idx], QF_NO_LOCK | QF_KEY_IS_HASH);
-			qfi_next(&qfi_arr[smallest_idx]);
-			qfi_get_hash(&qfi_arr[smallest_idx], &keys[smallest_idx],
-									 &values[smallest_idx],
-							&counts[smallest_idx]);
-		} while(!qfi_end(&qfi_arr[smallest_idx]));
-
-		/* remove the qf that is exhausted from the array */
-		if (smallest_idx < nqf-1)
-			memmove(&qfi_arr[smallest_idx], &qfi_arr[smallest_idx+1],
-							(nqf-smallest_idx-1)*sizeof(qfi_arr[0]));
-		nqf--;
-	}
-	if (!qfi_end(&qfi_arr[0])) {
-		uint64_t iters = 0;
-		do {
-			uint64_t key, value, count;
-			qfi_get_hash(&qfi_arr[0], &key, &value, &count);
-			qf_insert(qfr, key, value, count, QF_NO_LOCK | QF_KEY_IS_HASH);
-			qfi_next(&qfi_arr[0]);
-			iters++;
-		} while(!qfi_end(&qfi_arr[0]));
-		DEBUG_CQF("Num of iterations: %lu\n", iters);
+	/* An empty output is written sequentially.  If it runs out of space,
+	 * grow it (when auto resizing) and start over, otherwise insert as many
+	 * items as fit. */
+	bool append = qf_get_num_occupied_slots(qfr) == 0;
+	while (append) {
+		appender a;
+		appender_init(&a, qfr, 0, false);
+		ret = merge_hash_order(qf_arr, nqf, qfr, &a, 0, qfr->metadata->nslots);
+		if (ret != QF_NO_SPACE)
+			break;
+		qf_reset(qfr);
+		if (!qfr->runtimedata->auto_resize ||
+				qfr->runtimedata->container_resize(qfr, qfr->metadata->nslots * 2)
+				< 0)
+			append = false;
 	}
+	if (!append)
+		ret = merge_hash_order(qf_arr, nqf, qfr, NULL, 0, qfr->metadata->nslots);
 
 	DEBUG_CQF("%s", "Final CQF after merging.\n");
 	DEBUG_DUMP(qfr);
 
-	return;
+	return ret;
+}
+
+/* One bucket range of a parallel merge. */
+typedef struct merge_range {
+	const QF **qf_arr;
+	int nqf;
+	QF *qfr;
+	uint64_t start_bucket;
+	uint64_t end_bucket;
+	uint64_t start_slot;   /* first slot the range writes */
+	bool dry_run;
+	uint64_t nslots_used;  /* out: number of slots written */
+	uint64_t end_slot;     /* out: slot after the last written counter */
+	int ret;
+} merge_range;
+
+static void *merge_range_thread(void *arg)
+{
+	merge_range *r = (merge_range *)arg;
+	appender a;
+
+	appender_init(&a, r->qfr, r->start_slot, r->dry_run);
+	r->ret = merge_hash_order(r->qf_arr, r->nqf, r->qfr, &a, r->start_bucket,
+														r->end_bucket);
+	r->nslots_used = a.noccupied_slots;
+	r->end_slot = a.next;
+	return NULL;
+}
+
+/* Run the ranges first, first + 2, first + 4, ... concurrently. */
+static void merge_ranges(merge_range *ranges, int nranges, int first)
+{
+	pthread_t threads[nranges];
+	int i;
+
+	for (i = first; i < nranges; i += 2)
+		if (pthread_create(&threads[i], NULL, merge_range_thread, &ranges[i])) {
+			perror("Couldn't create a merge thread.");
+			exit(EXIT_FAILURE);
+		}
+	for (i = first; i < nranges; i += 2)
+		pthread_join(threads[i], NULL);
+}
+
+/*
+ * The buckets of qfr are split into 2 * nthreads block-aligned ranges that
+ * are merged independently.  A range starting at slot s ends at
+ * max(s + L, E), where L is the number of slots it uses and E is where it
+ * ends if nothing spills into it.  So a parallel dry run of every range
+ * from its first bucket gives L and E, from which the actual start slot
+ * of each range is computed sequentially.  A range may then spill into the
+ * blocks of the next range (runends, block offsets and the bytes shared by
+ * neighbouring slots), but not further, so the even ranges are written
+ * concurrently, followed by the odd ranges.
+ */
+static int multi_merge_parallel(const QF *qf_arr[], int nqf, QF *qfr, int
+																nthreads)
+{
+	int nranges = 2 * nthreads;
+	uint64_t nblocks = qfr->metadata->nslots / QF_SLOTS_PER_BLOCK;
+	merge_range ranges[nranges];
+	uint64_t next = 0;
+	int i;
+
+	if ((uint64_t)nranges > nblocks)
+		nranges = nblocks;
+	if (nranges < 2)
+		return QF_INVALID;
+
+	for (i = 0; i < nranges; i++) {
+		ranges[i].qf_arr = qf_arr;
+		ranges[i].nqf = nqf;
+		ranges[i].qfr = qfr;
+		ranges[i].start_bucket = nblocks * i / nranges * QF_SLOTS_PER_BLOCK;
+		ranges[i].end_bucket = nblocks * (i + 1) / nranges * QF_SLOTS_PER_BLOCK;
+		ranges[i].start_slot = ranges[i].start_bucket;
+		ranges[i].dry_run = true;
+	}
+	merge_ranges(ranges, nranges, 0);
+	merge_ranges(ranges, nranges, 1);
+
+	for (i = 0; i < nranges; i++) {
+		merge_range *r = &ranges[i];
+		if (next < r->start_bucket)
+			next = r->start_bucket;
+		r->start_slot = next;
+		if (r->end_slot < next + r->nslots_used)
+			r->end_slot = next + r->nslots_used;
+		next = r->end_slot;
+		if (next > qfr->metadata->xnslots)
+			return QF_NO_SPACE;
+		/* The spill must stay clear of the blocks of range i + 2. */
+		if (i + 2 < nranges && next + QF_SLOTS_PER_BLOCK >
+				ranges[i + 2].start_bucket)
+			return QF_INVALID;
+		r->dry_run = false;
+	}
+
+	merge_ranges(ranges, nranges, 0);
+	merge_ranges(ranges, nranges, 1);
+	for (i = 0; i < nranges; i++)
+		if (ranges[i].ret < 0)
+			return ranges[i].ret;
+
+	return 0;
+}
+
+int qf_multi_merge_parallel(const QF *qf_arr[], int nqf, QF *qfr, int
+														nthreads)
+{
+	int i, ret = QF_NO_SPACE;
+	for (i=0; i<nqf; i++) {
+		if (qf_arr[i]->metadata->hash_mode != qfr->metadata->hash_mode &&
+				qf_arr[i]->metadata->seed != qfr->metadata->seed) {
+			fprintf(stderr, "Output QF and input QFs do not have the same hash mode or seed.\n");
+			exit(1);
+		}
+	}
+
+	if (nthreads <= 1 || qf_get_num_occupied_slots(qfr) > 0)
+		return qf_multi_merge(qf_arr, nqf, qfr);
+
+	while ((ret = multi_merge_parallel(qf_arr, nqf, qfr, nthreads)) ==
+				 QF_NO_SPACE && qfr->runtimedata->auto_resize) {
+		if (qfr->runtimedata->container_resize(qfr, qfr->metadata->nslots * 2)
+				< 0)
+			break;
+	}
+	/* Too few blocks for the threads, ranges overflowing into each other (a
+	 * very full qfr) or no space: merge sequentially. */
+	if (ret < 0) {
+		qf_reset(qfr);
+		return qf_multi_merge(qf_arr, nqf, qfr);
+	}
+	return 0;
 }
 
 /* find cosine similarity between two QFs. */
@@ -2618,3 +4756,4 @@ uint64_t qf_magnitude(const QF *qf)
 	return sqrt(qf_inner_product(qf, qf));
 }
 
+#endif /* QF_KERNELS_ONLY */
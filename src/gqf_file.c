@@ -7,6 +7,7 @@
  * ============================================================================
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #if 0
 # include <assert.h>
@@ -21,21 +22,56 @@
 #include <time.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
 #include <fcntl.h>
+#include <linux/magic.h>
 
 #include "hashutil.h"
 #include "gqf.h"
 #include "gqf_int.h"
 #include "gqf_file.h"
 
-#define NUM_SLOTS_TO_LOCK (1ULL<<16)
+/* The huge pages of the file system of fd, if it is hugetlbfs, and their
+ * size.  Mappings of such files are whole pages, and can't be resized in
+ * place with mremap and ftruncate. */
+static uint32_t file_hugepages(int fd, uint64_t *page_size)
+{
+	struct statfs sfs;
+
+	if (fstatfs(fd, &sfs) != 0 || sfs.f_type != HUGETLBFS_MAGIC)
+		return QF_HUGEPAGES_NONE;
+	*page_size = sfs.f_bsize;
+	return sfs.f_bsize >= 1L << 30 ? QF_HUGEPAGES_1GB : QF_HUGEPAGES_2MB;
+}
+
+/* Record the huge pages of a file-backed CQF mapped with length size. */
+static void file_set_hugepages(QF *qf, uint32_t hugepages, uint64_t size)
+{
+	if (hugepages == QF_HUGEPAGES_NONE)
+		return;
+	qf->runtimedata->hugepages = hugepages;
+	qf->runtimedata->mapped_size = size;
+	qf->runtimedata->container_expand = NULL;
+	qf->runtimedata->container_shrink = NULL;
+}
 
 bool qf_initfile(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
 								 value_bits, enum qf_hashmode hash, uint32_t seed, const char*
 								 filename)
 {
-	uint64_t total_num_bytes = qf_init(qf, nslots, key_bits, value_bits, hash,
-																		 seed, NULL, 0);
+	return qf_initfile_layout(qf, nslots, key_bits, value_bits, hash, seed,
+														QF_LAYOUT_PACKED, filename);
+}
+
+bool qf_initfile_layout(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
+												value_bits, enum qf_hashmode hash, uint32_t seed,
+												uint32_t layout, const char* filename)
+{
+	uint64_t total_num_bytes = qf_init_layout(qf, nslots, key_bits, value_bits,
+																						hash, seed, layout, NULL, 0);
+	uint64_t map_size = total_num_bytes;
+	uint64_t page_size = 0;
+	uint32_t hugepages;
 
 	int ret;
 	qf->runtimedata = (qfruntime *)calloc(sizeof(qfruntime), 1);
@@ -49,27 +85,35 @@ bool qf_initfile(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
 		perror("Couldn't open file.");
 		exit(EXIT_FAILURE);
 	}
-	ret = posix_fallocate(qf->runtimedata->f_info.fd, 0, total_num_bytes);
+	/* Files on hugetlbfs are mapped in whole huge pages. */
+	hugepages = file_hugepages(qf->runtimedata->f_info.fd, &page_size);
+	if (hugepages != QF_HUGEPAGES_NONE)
+		map_size = (total_num_bytes + page_size - 1) / page_size * page_size;
+	ret = posix_fallocate(qf->runtimedata->f_info.fd, 0, map_size);
 	if (ret < 0) {
 		perror("Couldn't fallocate file:\n");
 		exit(EXIT_FAILURE);
 	}
-	qf->metadata = (qfmetadata *)mmap(NULL, total_num_bytes, PROT_READ |
+	qf->metadata = (qfmetadata *)mmap(NULL, map_size, PROT_READ |
 																		PROT_WRITE, MAP_SHARED,
 																		qf->runtimedata->f_info.fd, 0);
 	if (qf->metadata == MAP_FAILED) {
 		perror("Couldn't mmap metadata.");
 		exit(EXIT_FAILURE);
 	}
-	ret = madvise(qf->metadata, total_num_bytes, MADV_RANDOM);
-	if (ret < 0) {
-		perror("Couldn't fallocate file.");
-		exit(EXIT_FAILURE);
+	/* hugetlbfs doesn't read ahead. */
+	if (hugepages == QF_HUGEPAGES_NONE) {
+		ret = madvise(qf->metadata, total_num_bytes, MADV_RANDOM);
+		if (ret < 0) {
+			perror("Couldn't fallocate file.");
+			exit(EXIT_FAILURE);
+		}
 	}
 	qf->blocks = (qfblock *)(qf->metadata + 1);
 
-	uint64_t init_size = qf_init(qf, nslots, key_bits, value_bits, hash, seed,
-															 qf->metadata, total_num_bytes);
+	uint64_t init_size = qf_init_layout(qf, nslots, key_bits, value_bits, hash,
+																			seed, layout, qf->metadata,
+																			total_num_bytes);
 	qf->runtimedata->f_info.filepath = (char *)malloc(strlen(filename) + 1);
 	if (qf->runtimedata->f_info.filepath == NULL) {
 		perror("Couldn't allocate memory for runtime f_info filepath.");
@@ -78,6 +122,9 @@ bool qf_initfile(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
 	strcpy(qf->runtimedata->f_info.filepath, filename);
 	/* initialize container resize */
 	qf->runtimedata->container_resize = qf_resize_file;
+	qf->runtimedata->container_expand = qf_expand_file;
+	qf->runtimedata->container_shrink = qf_shrink_file;
+	file_set_hugepages(qf, hugepages, map_size);
 
 	if (init_size == total_num_bytes)
 		return true;
@@ -132,43 +179,43 @@ uint64_t qf_usefile(QF* qf, const char* filename, int flag)
 	strcpy(qf->runtimedata->f_info.filepath, filename);
 	/* initialize container resize */
 	qf->runtimedata->container_resize = qf_resize_file;
-	/* initialize all the locks to 0 */
-	qf->runtimedata->metadata_lock = 0;
-	qf->runtimedata->locks = (volatile int *)calloc(qf->runtimedata->num_locks,
-																					sizeof(volatile int));
-	if (qf->runtimedata->locks == NULL) {
-		perror("Couldn't allocate memory for runtime locks.");
-		exit(EXIT_FAILURE);
-	}
-#ifdef LOG_WAIT_TIME
-	qf->runtimedata->wait_times = (wait_time_data* )calloc(qf->runtimedata->num_locks+1,
-																								 sizeof(wait_time_data));
-	if (qf->runtimedata->wait_times == NULL) {
-		perror("Couldn't allocate memory for runtime wait_times.");
-		exit(EXIT_FAILURE);
-	}
-#endif
+	qf->runtimedata->container_expand = qf_expand_file;
+	qf->runtimedata->container_shrink = qf_shrink_file;
 	qf->metadata = (qfmetadata *)mmap(NULL, sb.st_size, mmap_flag, MAP_SHARED,
 																		qf->runtimedata->f_info.fd, 0);
 	if (qf->metadata == MAP_FAILED) {
 		perror("Couldn't mmap metadata.");
 		exit(EXIT_FAILURE);
 	}
+	uint64_t page_size;
+	file_set_hugepages(qf, file_hugepages(qf->runtimedata->f_info.fd,
+																				&page_size), sb.st_size);
 	if (qf->metadata->magic_endian_number != MAGIC_NUMBER) {
 		fprintf(stderr, "Can't read the CQF. It was written on a different endian machine.");
 		exit(EXIT_FAILURE);
 	}
 	qf->blocks = (qfblock *)(qf->metadata + 1);
+	/* initialize all the locks to 0 */
+	qf->runtimedata->metadata_lock = 0;
+	if (!qf_init_locks(qf)) {
+		perror("Couldn't allocate memory for runtime locks.");
+		exit(EXIT_FAILURE);
+	}
 
-	pc_init(&qf->runtimedata->pc_nelts, (int64_t*)&qf->metadata->nelts, 8, 100);
-	pc_init(&qf->runtimedata->pc_ndistinct_elts, (int64_t*)&qf->metadata->ndistinct_elts, 8, 100);
-	pc_init(&qf->runtimedata->pc_noccupied_slots, (int64_t*)&qf->metadata->noccupied_slots, 8, 100);
+	if (!qf_init_counters(qf)) {
+		perror("Couldn't allocate memory for local counters.");
+		exit(EXIT_FAILURE);
+	}
+	qf_init_kernels(qf);
 
 	return sizeof(qfmetadata) + qf->metadata->total_size_in_bytes;
 }
 
 int64_t qf_resize_file(QF *qf, uint64_t nslots)
 {
+	if (!qf_can_resize(qf, nslots))
+		return -1;
+
 	// calculate the new filename length
 	int new_filename_len = strlen(qf->runtimedata->f_info.filepath) + 1;
 	new_filename_len += 13; // To have an underscore and the nslots.
@@ -186,18 +233,18 @@ int64_t qf_resize_file(QF *qf, uint64_t nslots)
 	}
 
 	QF new_qf;
-	if (!qf_initfile(&new_qf, nslots, qf->metadata->key_bits,
-								 qf->metadata->value_bits, qf->metadata->hash_mode,
-								 qf->metadata->seed, new_filename))
+	if (!qf_initfile_layout(&new_qf, nslots, qf->metadata->key_bits,
+													qf->metadata->value_bits, qf->metadata->hash_mode,
+													qf->metadata->seed, qf->metadata->layout,
+													new_filename))
 		return false;
-	if (qf->runtimedata->auto_resize)
-		qf_set_auto_resize(&new_qf, true);
+	qf_copy_settings(&new_qf, qf);
 
 	// copy keys from qf into new_qf
 	QFi qfi;
 	qf_iterator_from_position(qf, &qfi, 0);
 	int64_t ret_numkeys = 0;
-	do {
+	while (!qfi_end(&qfi)) {
 		uint64_t key, value, count;
 		qfi_get_hash(&qfi, &key, &value, &count);
 		qfi_next(&qfi);
@@ -207,7 +254,7 @@ int64_t qf_resize_file(QF *qf, uint64_t nslots)
 			return ret;
 		}
 		ret_numkeys++;
-	} while(!qfi_end(&qfi));
+	}
 
 	// Copy old QF path in temp.
 	char *path = (char *)malloc(strlen(qf->runtimedata->f_info.filepath) + 1);
@@ -227,12 +274,78 @@ int64_t qf_resize_file(QF *qf, uint64_t nslots)
 	return ret_numkeys;
 }
 
+/* Give back the end of the file and the mapping of qf, size bytes, that a
+ * relayout left unused. */
+static void qf_trim_file(QF *qf, uint64_t size)
+{
+	uint64_t new_size = sizeof(qfmetadata) + qf->metadata->total_size_in_bytes;
+
+	if (new_size >= size)
+		return;
+	if (mremap(qf->metadata, size, new_size, 0) == MAP_FAILED) {
+		perror("Couldn't mremap metadata.");
+		exit(EXIT_FAILURE);
+	}
+	if (ftruncate(qf->runtimedata->f_info.fd, new_size) < 0) {
+		perror("Couldn't truncate file.");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* As for qf_expand_malloc, the doubled CQF may be smaller, and the file
+ * then only shrinks after the relayout. */
+int64_t qf_expand_file(QF *qf)
+{
+	qfmetadata md;
+	int fd = qf->runtimedata->f_info.fd;
+	uint64_t size = sizeof(qfmetadata) + qf->metadata->total_size_in_bytes;
+	uint64_t new_size;
+	int64_t ret;
+
+	if (!qf_relayout_geometry(qf, qf->metadata->nslots * 2, &md))
+		return QF_NO_SPACE;
+	new_size = sizeof(qfmetadata) + md.total_size_in_bytes;
+	if (new_size > size) {
+		if (posix_fallocate(fd, 0, new_size) != 0) {
+			fprintf(stderr, "Couldn't fallocate file.\n");
+			return QF_NO_SPACE;
+		}
+		qf->metadata = (qfmetadata *)mremap(qf->metadata, size, new_size,
+																				MREMAP_MAYMOVE);
+		if (qf->metadata == MAP_FAILED) {
+			perror("Couldn't mremap metadata.");
+			exit(EXIT_FAILURE);
+		}
+		qf->blocks = (qfblock *)(qf->metadata + 1);
+	}
+
+	ret = qf_relayout(qf, &md);
+	qf_trim_file(qf, size);
+	return ret;
+}
+
+int64_t qf_shrink_file(QF *qf)
+{
+	qfmetadata md;
+	uint64_t size = sizeof(qfmetadata) + qf->metadata->total_size_in_bytes;
+	int64_t ret;
+
+	if (!qf_relayout_geometry(qf, qf->metadata->nslots / 2, &md))
+		return QF_NO_SPACE;
+	ret = qf_relayout(qf, &md);
+	qf_trim_file(qf, size);
+
+	return ret;
+}
+
 bool qf_closefile(QF* qf)
 {
 	assert(qf->metadata != NULL);
 	int fd = qf->runtimedata->f_info.fd;
 	qf_sync_counters(qf);
-	uint64_t size = qf->metadata->total_size_in_bytes + sizeof(qfmetadata);
+	uint64_t size = qf->runtimedata->mapped_size > 0 ?
+		qf->runtimedata->mapped_size : qf->metadata->total_size_in_bytes +
+		sizeof(qfmetadata);
 	void *buffer = qf_destroy(qf);
 	if (buffer != NULL) {
 		munmap(buffer, size);
@@ -291,17 +404,13 @@ uint64_t qf_deserialize(QF *qf, const char *filename)
 		perror("Couldn't allocate memory for runtime data.");
 		exit(EXIT_FAILURE);
 	}
-	qf->metadata = (qfmetadata *)calloc(sizeof(qfmetadata), 1);
-	if (qf->metadata == NULL) {
-		perror("Couldn't allocate memory for metadata.");
-		exit(EXIT_FAILURE);
-	}
-	int ret = fread(qf->metadata, sizeof(qfmetadata), 1, fin);
+	qfmetadata md;
+	int ret = fread(&md, sizeof(qfmetadata), 1, fin);
 	if (ret < 1) {
 		perror("Couldn't read metadata from file.");
 		exit(EXIT_FAILURE);
 	}
-	if (qf->metadata->magic_endian_number != MAGIC_NUMBER) {
+	if (md.magic_endian_number != MAGIC_NUMBER) {
 		fprintf(stderr, "Can't read the CQF. It was written on a different endian machine.");
 		exit(EXIT_FAILURE);
 	}
@@ -312,23 +421,19 @@ uint64_t qf_deserialize(QF *qf, const char *filename)
 		exit(EXIT_FAILURE);
 	}
 	strcpy(qf->runtimedata->f_info.filepath, filename);
+	/* Aligned so that the blocks of the aligned layout are. */
+	if (posix_memalign((void **)&qf->metadata, 64, md.total_size_in_bytes +
+										 sizeof(qfmetadata)) != 0) {
+		perror("Couldn't allocate memory for metadata.");
+		exit(EXIT_FAILURE);
+	}
+	*qf->metadata = md;
 	/* initlialize the locks in the QF */
-	qf->runtimedata->num_locks = (qf->metadata->xnslots/NUM_SLOTS_TO_LOCK)+2;
 	qf->runtimedata->metadata_lock = 0;
-	/* initialize all the locks to 0 */
-	qf->runtimedata->locks = (volatile int *)calloc(qf->runtimedata->num_locks,
-																									sizeof(volatile int));
-	if (qf->runtimedata->locks == NULL) {
+	if (!qf_init_locks(qf)) {
 		perror("Couldn't allocate memory for runtime locks.");
 		exit(EXIT_FAILURE);
 	}
-	qf->metadata = (qfmetadata *)realloc(qf->metadata,
-																			 qf->metadata->total_size_in_bytes +
-																			 sizeof(qfmetadata));
-	if (qf->metadata == NULL) {
-		perror("Couldn't allocate memory for metadata.");
-		exit(EXIT_FAILURE);
-	}
 	qf->blocks = (qfblock *)(qf->metadata + 1);
 	if (qf->blocks == NULL) {
 		perror("Couldn't allocate memory for blocks.");
@@ -341,9 +446,11 @@ uint64_t qf_deserialize(QF *qf, const char *filename)
 	}
 	fclose(fin);
 
-	pc_init(&qf->runtimedata->pc_nelts, (int64_t*)&qf->metadata->nelts, 8, 100);
-	pc_init(&qf->runtimedata->pc_ndistinct_elts, (int64_t*)&qf->metadata->ndistinct_elts, 8, 100);
-	pc_init(&qf->runtimedata->pc_noccupied_slots, (int64_t*)&qf->metadata->noccupied_slots, 8, 100);
+	if (!qf_init_counters(qf)) {
+		perror("Couldn't allocate memory for local counters.");
+		exit(EXIT_FAILURE);
+	}
+	qf_init_kernels(qf);
 
 	return sizeof(qfmetadata) + qf->metadata->total_size_in_bytes;
 }
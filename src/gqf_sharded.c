@@ -0,0 +1,286 @@
+/*
+ * ============================================================================
+ *
+ *        Authors:  Prashant Pandey <ppandey@cs.stonybrook.edu>
+ *                  Rob Johnson <robj@vmware.com>
+ *
+ * ============================================================================
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "hashutil.h"
+#include "gqf.h"
+#include "gqf_int.h"
+#include "gqf_sharded.h"
+
+#define BITMASK(nbits)                                    \
+	((nbits) == 64 ? 0xffffffffffffffff : (1ULL << (nbits)) - 1ULL)
+
+/* Largest node number that shards and threads can be bound to. */
+#define QF_SHARDED_MAX_NODES 1024
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+/* Read a list like "0-3,8,10-11", the format of the node and cpu lists in
+ * sysfs, into set. */
+static bool read_id_list(const char *path, cpu_set_t *set)
+{
+	FILE *f = fopen(path, "r");
+	unsigned int first, last;
+	int c;
+
+	if (f == NULL)
+		return false;
+	CPU_ZERO(set);
+	while (fscanf(f, "%u", &first) == 1) {
+		last = first;
+		c = fgetc(f);
+		if (c == '-') {
+			if (fscanf(f, "%u", &last) != 1)
+				break;
+			c = fgetc(f);
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+		if (c != ',')
+			break;
+	}
+	fclose(f);
+	return CPU_COUNT(set) > 0;
+}
+
+static void node_mask(unsigned long *mask, int node)
+{
+	memset(mask, 0, QF_SHARDED_MAX_NODES / 8);
+	mask[node / BITS_PER_LONG] |= 1UL << (node % BITS_PER_LONG);
+}
+
+/* Bind [addr, addr + len) to node.  Must be called before the memory is
+ * first touched, as pages that are already there don't move. */
+static bool bind_to_node(void *addr, uint64_t len, int node)
+{
+	unsigned long mask[QF_SHARDED_MAX_NODES / BITS_PER_LONG];
+
+	if (node < 0 || node >= QF_SHARDED_MAX_NODES)
+		return false;
+	node_mask(mask, node);
+	return syscall(SYS_mbind, addr, len, MPOL_BIND, mask,
+								 QF_SHARDED_MAX_NODES + 1, 0) == 0;
+}
+
+bool qf_sharded_bind_thread(int node)
+{
+	unsigned long mask[QF_SHARDED_MAX_NODES / BITS_PER_LONG];
+	char path[64];
+	cpu_set_t cpus;
+
+	if (node < 0 || node >= QF_SHARDED_MAX_NODES)
+		return false;
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+					 node);
+	if (!read_id_list(path, &cpus) ||
+			sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+		return false;
+	node_mask(mask, node);
+	return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+								 QF_SHARDED_MAX_NODES + 1) == 0;
+}
+
+bool qf_sharded_malloc(QFsharded *qfs, uint32_t nshards, const int *nodes,
+											 uint64_t nslots, uint64_t key_bits, uint64_t
+											 value_bits, enum qf_hashmode hash, uint32_t seed)
+{
+	uint64_t shard_bits = __builtin_ctz(nshards);
+	uint64_t shard_nslots = nslots / nshards;
+	int online[QF_SHARDED_MAX_NODES];
+	int nonline = 0;
+	cpu_set_t set;
+
+	if (nshards == 0 || (nshards & (nshards - 1)) != 0 || shard_nslots <
+			QF_SLOTS_PER_BLOCK || key_bits <= shard_bits)
+		return false;
+
+	if (nodes == NULL && read_id_list("/sys/devices/system/node/online",
+																		&set)) {
+		for (int i = 0; i < QF_SHARDED_MAX_NODES; i++)
+			if (CPU_ISSET(i, &set))
+				online[nonline++] = i;
+	}
+
+	qfs->hash_mode = hash;
+	qfs->seed = seed;
+	qfs->key_bits = key_bits;
+	qfs->shard_bits = shard_bits;
+	qfs->nshards = nshards;
+	qfs->shards = (QF *)calloc(nshards, sizeof(QF));
+	qfs->nodes = (int *)calloc(nshards, sizeof(int));
+	qfs->sizes = (uint64_t *)calloc(nshards, sizeof(uint64_t));
+	if (qfs->shards == NULL || qfs->nodes == NULL || qfs->sizes == NULL) {
+		perror("Couldn't allocate memory for the shards.");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The shards store hashes without the top shard_bits bits, which are
+	 * the number of the shard, and don't hash keys themselves. */
+	for (uint32_t i = 0; i < nshards; i++) {
+		int node = nodes != NULL ? nodes[i] : nonline > 0 ? online[i % nonline]
+			: -1;
+		uint64_t size = qf_init(&qfs->shards[i], shard_nslots, key_bits -
+														shard_bits, value_bits, QF_HASH_NONE, seed, NULL,
+														0);
+		void *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+												MAP_ANONYMOUS, -1, 0);
+		if (buffer == MAP_FAILED) {
+			perror("Couldn't allocate memory for a shard.");
+			exit(EXIT_FAILURE);
+		}
+		qfs->nodes[i] = bind_to_node(buffer, size, node) ? node : -1;
+		qfs->sizes[i] = size;
+		qfs->shards[i].runtimedata = (qfruntime *)calloc(sizeof(qfruntime), 1);
+		if (qfs->shards[i].runtimedata == NULL) {
+			perror("Couldn't allocate memory for runtime data.");
+			exit(EXIT_FAILURE);
+		}
+		if (qf_init(&qfs->shards[i], shard_nslots, key_bits - shard_bits,
+								value_bits, QF_HASH_NONE, seed, buffer, size) != size) {
+			perror("Couldn't allocate memory for runtime locks.");
+			exit(EXIT_FAILURE);
+		}
+		/* The buffer isn't from malloc, so it can't be resized. */
+		qfs->shards[i].runtimedata->container_resize = NULL;
+		qfs->shards[i].runtimedata->container_expand = NULL;
+		qfs->shards[i].runtimedata->container_shrink = NULL;
+	}
+
+	return true;
+}
+
+bool qf_sharded_free(QFsharded *qfs)
+{
+	assert(qfs->shards != NULL);
+	for (uint32_t i = 0; i < qfs->nshards; i++)
+		munmap(qf_destroy(&qfs->shards[i]), qfs->sizes[i]);
+	free(qfs->shards);
+	free(qfs->nodes);
+	free(qfs->sizes);
+	qfs->shards = NULL;
+	return true;
+}
+
+uint64_t qf_sharded_hash(const QFsharded *qfs, uint64_t key, uint8_t flags)
+{
+	if ((flags & QF_KEY_IS_HASH) != QF_KEY_IS_HASH) {
+		if (qfs->hash_mode == QF_HASH_DEFAULT)
+			key = MurmurHash64A(((void *)&key), sizeof(key), qfs->seed);
+		else if (qfs->hash_mode == QF_HASH_INVERTIBLE)
+			key = hash_64(key, BITMASK(qfs->key_bits));
+	}
+	return key & BITMASK(qfs->key_bits);
+}
+
+uint32_t qf_sharded_shard(const QFsharded *qfs, uint64_t hash)
+{
+	return hash >> (qfs->key_bits - qfs->shard_bits);
+}
+
+int qf_sharded_node(const QFsharded *qfs, uint32_t shard)
+{
+	return qfs->nodes[shard];
+}
+
+int qf_sharded_insert(QFsharded *qfs, uint64_t key, uint64_t value, uint64_t
+											count, uint8_t flags)
+{
+	uint64_t hash = qf_sharded_hash(qfs, key, flags);
+	return qf_insert(&qfs->shards[qf_sharded_shard(qfs, hash)], hash &
+									 BITMASK(qfs->key_bits - qfs->shard_bits), value, count,
+									 flags | QF_KEY_IS_HASH);
+}
+
+uint64_t qf_sharded_count_key_value(const QFsharded *qfs, uint64_t key,
+																		uint64_t value, uint8_t flags)
+{
+	uint64_t hash = qf_sharded_hash(qfs, key, flags);
+	return qf_count_key_value(&qfs->shards[qf_sharded_shard(qfs, hash)], hash
+														& BITMASK(qfs->key_bits - qfs->shard_bits),
+														value, flags | QF_KEY_IS_HASH);
+}
+
+uint64_t qf_sharded_query(const QFsharded *qfs, uint64_t key, uint64_t
+													*value, uint8_t flags)
+{
+	uint64_t hash = qf_sharded_hash(qfs, key, flags);
+	return qf_query(&qfs->shards[qf_sharded_shard(qfs, hash)], hash &
+									BITMASK(qfs->key_bits - qfs->shard_bits), value, flags |
+									QF_KEY_IS_HASH);
+}
+
+/* Move qfsi to the first item in shard or a later one. */
+static int64_t qfsi_seek(QFsi *qfsi, uint32_t shard)
+{
+	for (qfsi->shard = shard; qfsi->shard < qfsi->qfs->nshards;
+			 qfsi->shard++) {
+		qf_iterator_from_position(&qfsi->qfs->shards[qfsi->shard], &qfsi->qfi,
+															0);
+		if (!qfi_end(&qfsi->qfi))
+			return 0;
+	}
+	return QFI_INVALID;
+}
+
+int64_t qf_sharded_iterator(const QFsharded *qfs, QFsi *qfsi)
+{
+	qfsi->qfs = qfs;
+	return qfsi_seek(qfsi, 0);
+}
+
+int qfsi_get_hash(const QFsi *qfsi, uint64_t *hash, uint64_t *value,
+									uint64_t *count)
+{
+	if (qfsi_end(qfsi)) {
+		*hash = *value = *count = 0;
+		return QFI_INVALID;
+	}
+	int ret = qfi_get_hash(&qfsi->qfi, hash, value, count);
+	*hash |= (uint64_t)qfsi->shard << (qfsi->qfs->key_bits -
+																		 qfsi->qfs->shard_bits);
+	return ret;
+}
+
+int qfsi_get_key(const QFsi *qfsi, uint64_t *key, uint64_t *value, uint64_t
+								 *count)
+{
+	int ret = qfsi_get_hash(qfsi, key, value, count);
+	if (ret == 0) {
+		if (qfsi->qfs->hash_mode == QF_HASH_DEFAULT) {
+			*key = 0; *value = 0; *count = 0;
+			return QF_INVALID;
+		} else if (qfsi->qfs->hash_mode == QF_HASH_INVERTIBLE)
+			*key = hash_64i(*key, BITMASK(qfsi->qfs->key_bits));
+	}
+	return ret;
+}
+
+int qfsi_next(QFsi *qfsi)
+{
+	if (qfsi_end(qfsi))
+		return QFI_INVALID;
+	qfi_next(&qfsi->qfi);
+	if (qfi_end(&qfsi->qfi))
+		return qfsi_seek(qfsi, qfsi->shard + 1);
+	return 0;
+}
+
+bool qfsi_end(const QFsi *qfsi)
+{
+	return qfsi->shard >= qfsi->qfs->nshards;
+}
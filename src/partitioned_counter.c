@@ -10,68 +10,146 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sched.h>
 #include <sys/sysinfo.h>
 #include <linux/unistd.h>
 #include <sys/syscall.h>
 #include <errno.h>
+#include <assert.h>
 
 #include "partitioned_counter.h"
 
 #define min(a,b) ((a) < (b) ? (a) : (b))
 
-int pc_init(pc_t *pc, int64_t *global_counter, uint32_t num_counters,
-						int32_t threshold) {
+/* Threads are numbered as they first update a counter, and each thread
+ * always uses the local counter of its number.  This avoids looking up the
+ * CPU on every update, and threads only share a local counter when there
+ * are more threads than local counters. */
+static uint32_t pc_num_threads = 0;
+static __thread int64_t pc_thread_id = -1;
+
+static inline uint32_t pc_thread(void)
+{
+	if (pc_thread_id < 0)
+		pc_thread_id = __atomic_fetch_add(&pc_num_threads, 1, __ATOMIC_RELAXED);
+	return pc_thread_id;
+}
+
+uint32_t pc_num_counters(uint32_t num_counters) {
 	int num_cpus = (int)sysconf( _SC_NPROCESSORS_ONLN );
 	if (num_cpus < 0) {
 		perror( "sysconf" );
+		return 0;
+	}
+	return num_counters == 0 ? num_cpus : min(num_cpus, num_counters);
+}
+
+int pc_init_group_in(pc_t **pcs, int64_t **global_counters, uint32_t npcs,
+										 lctr_t *local_counters, uint32_t num_counters,
+										 int32_t threshold) {
+	if (npcs == 0 || npcs > PC_GROUP_SIZE || local_counters == NULL)
 		return PC_ERROR;
+	num_counters = pc_num_counters(num_counters);
+	if (num_counters == 0)
+		return PC_ERROR;
+	for (uint32_t i = 0; i < npcs; i++) {
+		pcs[i]->local_counters = local_counters;
+		pcs[i]->global_counter = global_counters[i];
+		pcs[i]->num_counters = num_counters;
+		pcs[i]->threshold = threshold;
+		pcs[i]->index = i;
+		pcs[i]->shared = true;
 	}
-	pc->num_counters = num_counters == 0 ? num_cpus : min(num_cpus,
-																												num_counters);
-	
-	pc->local_counters = (lctr_t *)calloc(pc->num_counters,
-																				 sizeof(*pc->local_counters));
-	if (pc->local_counters == NULL) {
+
+	return 0;
+}
+
+int pc_init_group(pc_t **pcs, int64_t **global_counters, uint32_t npcs,
+									uint32_t num_counters, int32_t threshold) {
+	num_counters = pc_num_counters(num_counters);
+	if (num_counters == 0 || npcs == 0 || npcs > PC_GROUP_SIZE)
+		return PC_ERROR;
+
+	lctr_t *local_counters = NULL;
+	if (posix_memalign((void **)&local_counters, sizeof(lctr_t), num_counters *
+										 sizeof(lctr_t)) != 0) {
 		perror("Couldn't allocate memory for local counters.");
 		return PC_ERROR;
 	}
-	/*printf("Padding check: 0: %p 1: %p\n", (void*)&pc->local_counters[0],*/
-				 /*(void*)&pc->local_counters[1]);*/
-	pc->global_counter = global_counter;
-	pc->threshold = threshold;
-	
+	memset(local_counters, 0, num_counters * sizeof(lctr_t));
+	if (pc_init_group_in(pcs, global_counters, npcs, local_counters,
+											 num_counters, threshold) == PC_ERROR) {
+		free(local_counters);
+		return PC_ERROR;
+	}
+	pcs[0]->shared = false;
+
 	return 0;
 }
 
+int pc_init(pc_t *pc, int64_t *global_counter, uint32_t num_counters,
+						int32_t threshold) {
+	return pc_init_group(&pc, &global_counter, 1, num_counters, threshold);
+}
+
 void pc_destructor(pc_t *pc)
 {
 	pc_sync(pc);
 	lctr_t *lc = pc->local_counters;
 	pc->local_counters = NULL;
-	free(lc);
+	if (!pc->shared)
+		free(lc);
+}
+
+void pc_destroy_group(pc_t **pcs, uint32_t npcs)
+{
+	lctr_t *lc = pcs[0]->local_counters;
+	bool owned = !pcs[0]->shared;
+	for (uint32_t i = 0; i < npcs; i++) {
+		assert(pcs[i]->local_counters == lc && (i == 0 || pcs[i]->shared));
+		pc_sync(pcs[i]);
+	}
+	for (uint32_t i = 0; i < npcs; i++)
+		pcs[i]->local_counters = NULL;
+	if (owned)
+		free(lc);
 }
-	
+
+/* Local counters are only ever added to atomically, and nothing else is
+ * ordered by them, so relaxed atomics suffice. */
 void pc_add(pc_t *pc, int64_t count) {
-	int cpuid = sched_getcpu();
-	uint32_t counter_id = cpuid % pc->num_counters;
-	int64_t cur_count =
-		__atomic_add_fetch(&pc->local_counters[counter_id].counter, count,
-											 __ATOMIC_SEQ_CST);
+	uint32_t counter_id = pc_thread() % pc->num_counters;
+	int64_t *counter = &pc->local_counters[counter_id].counter[pc->index];
+	int64_t cur_count = __atomic_add_fetch(counter, count, __ATOMIC_RELAXED);
 	if (cur_count > pc->threshold || cur_count < -pc->threshold) {
-		int64_t new_count =
-			__atomic_exchange_n(&pc->local_counters[counter_id].counter, 0,
-													__ATOMIC_SEQ_CST);
-		__atomic_fetch_add(pc->global_counter, new_count, __ATOMIC_SEQ_CST);
+		int64_t new_count = __atomic_exchange_n(counter, 0, __ATOMIC_RELAXED);
+		__atomic_fetch_add(pc->global_counter, new_count, __ATOMIC_RELAXED);
 	}
 }
 
 void pc_sync(pc_t *pc) {
 	for (uint32_t i = 0; i < pc->num_counters; i++) {
-		int64_t c = __atomic_exchange_n(&pc->local_counters[i].counter, 0,
-																		__ATOMIC_SEQ_CST);
-		__atomic_fetch_add(pc->global_counter, c, __ATOMIC_SEQ_CST);
+		int64_t c =
+			__atomic_exchange_n(&pc->local_counters[i].counter[pc->index], 0,
+													__ATOMIC_RELAXED);
+		__atomic_fetch_add(pc->global_counter, c, __ATOMIC_RELAXED);
 	}
 }
 
+int64_t pc_read(const pc_t *pc) {
+	int64_t sum = __atomic_load_n(pc->global_counter, __ATOMIC_RELAXED);
+	for (uint32_t i = 0; i < pc->num_counters; i++)
+		sum += __atomic_load_n(&pc->local_counters[i].counter[pc->index],
+													 __ATOMIC_RELAXED);
+	return sum;
+}
+
+int64_t pc_read_approx(const pc_t *pc) {
+	return __atomic_load_n(pc->global_counter, __ATOMIC_RELAXED);
+}
+
+int64_t pc_error(const pc_t *pc) {
+	return (int64_t)pc->num_counters * pc->threshold;
+}
@@ -22,6 +22,61 @@
 #include "include/gqf.h"
 #include "include/gqf_int.h"
 #include "include/gqf_file.h"
+#include "include/gqf_sharded.h"
+
+/* An allocator that keeps the number of bytes it has out in ctx. */
+static void *counting_alloc(void *ctx, size_t size)
+{
+	*(uint64_t *)ctx += size;
+	return malloc(size);
+}
+
+static void *counting_aligned_alloc(void *ctx, size_t alignment, size_t size)
+{
+	void *ptr;
+	if (posix_memalign(&ptr, alignment, size) != 0)
+		return NULL;
+	*(uint64_t *)ctx += size;
+	return ptr;
+}
+
+static void counting_free(void *ctx, void *ptr, size_t size)
+{
+	if (ptr == NULL)
+		return;
+	*(uint64_t *)ctx -= size;
+	free(ptr);
+}
+
+/* A counting allocator, with the count in allocated, that fails once it
+ * has handed out budget allocations. */
+typedef struct limited_allocator {
+	uint64_t allocated;
+	uint64_t budget;
+} limited_allocator;
+
+static void *limited_alloc(void *ctx, size_t size)
+{
+	limited_allocator *l = (limited_allocator *)ctx;
+	if (l->budget == 0)
+		return NULL;
+	l->budget--;
+	return counting_alloc(&l->allocated, size);
+}
+
+static void *limited_aligned_alloc(void *ctx, size_t alignment, size_t size)
+{
+	limited_allocator *l = (limited_allocator *)ctx;
+	if (l->budget == 0)
+		return NULL;
+	l->budget--;
+	return counting_aligned_alloc(&l->allocated, alignment, size);
+}
+
+static void limited_free(void *ctx, void *ptr, size_t size)
+{
+	counting_free(&((limited_allocator *)ctx)->allocated, ptr, size);
+}
 
 int main(int argc, char **argv)
 {
@@ -49,6 +104,14 @@ int main(int argc, char **argv)
 		abort();
 	}
 
+	/* 8, 16, 32 and 64-bit slots get the fixed-width kernels. */
+	if (qf.runtimedata->kernels->bits_per_slot != (rbits == 8 || rbits == 16 ||
+																								 rbits == 32 || rbits == 64 ?
+																								 rbits : 0)) {
+		fprintf(stderr, "Wrong kernels for %lu-bit slots.\n", rbits);
+		abort();
+	}
+
 	qf_set_auto_resize(&qf, true);
 
 	/* Generate random values */
@@ -61,8 +124,9 @@ int main(int argc, char **argv)
 		/*fprintf(stdout, "%lx\n", vals[i]);*/
 	}
 
-	/* Insert keys in the CQF */
-	for (uint64_t i = 0; i < nvals; i++) {
+	/* Insert keys in the CQF: the first half one at a time, the second half
+	 * through the batched API. */
+	for (uint64_t i = 0; i < nvals / 2; i++) {
 		int ret = qf_insert(&qf, vals[i], 0, key_count, QF_NO_LOCK);
 		if (ret < 0) {
 			fprintf(stderr, "failed insertion for key: %lx %d.\n", vals[i], 50);
@@ -75,6 +139,21 @@ int main(int argc, char **argv)
 			abort();
 		}
 	}
+	uint64_t nbatch = nvals - nvals / 2;
+	uint64_t *counts = (uint64_t*)malloc(nbatch*sizeof(counts[0]));
+	int *rets = (int*)malloc(nbatch*sizeof(rets[0]));
+	for (uint64_t i = 0; i < nbatch; i++)
+		counts[i] = key_count;
+	if (qf_insert_batch(&qf, &vals[nvals / 2], NULL, counts, nbatch,
+											QF_NO_LOCK, rets) != (int64_t)nbatch) {
+		for (uint64_t i = 0; i < nbatch; i++)
+			if (rets[i] < 0)
+				fprintf(stderr, "failed batch insertion for key: %lx %d.\n",
+								vals[nvals / 2 + i], rets[i]);
+		abort();
+	}
+	free(rets);
+	free(counts);
 
 	/* Lookup inserted keys and counts. */
 	for (uint64_t i = 0; i < nvals; i++) {
@@ -85,6 +164,725 @@ int main(int argc, char **argv)
 			abort();
 		}
 	}
+	counts = (uint64_t*)malloc(nvals*sizeof(counts[0]));
+	if (qf_count_key_value_batch(&qf, vals, NULL, nvals, counts, 0) != nvals) {
+		fprintf(stderr, "failed batch lookup after insertion.\n");
+		abort();
+	}
+	for (uint64_t i = 0; i < nvals; i++) {
+		if (counts[i] != qf_count_key_value(&qf, vals[i], 0, 0)) {
+			fprintf(stderr, "batch lookup mismatch for %lx %ld.\n", vals[i],
+							counts[i]);
+			abort();
+		}
+	}
+	free(counts);
+
+	/* Bulk load the same keys into a new CQF, once from the unsorted keys and
+	 * once from the (sorted) hashes of the first CQF. */
+	fprintf(stdout, "Testing bulk load.\n");
+	QF bulk_qf, dump_qf;
+	if (!qf_malloc(&bulk_qf, qf.metadata->nslots, nhashbits, 0,
+								 QF_HASH_INVERTIBLE, 0) ||
+			!qf_malloc(&dump_qf, qf.metadata->nslots, nhashbits, 0,
+								 QF_HASH_INVERTIBLE, 0)) {
+		fprintf(stderr, "Can't allocate CQF.\n");
+		abort();
+	}
+	if (qf_bulk_load(&bulk_qf, vals, NULL, NULL, nvals, 0) != (int64_t)nvals) {
+		fprintf(stderr, "failed bulk load.\n");
+		abort();
+	}
+	uint64_t ndump = qf_get_num_distinct_key_value_pairs(&qf);
+	uint64_t *hashes = (uint64_t*)malloc(ndump*sizeof(hashes[0]));
+	counts = (uint64_t*)malloc(ndump*sizeof(counts[0]));
+	QFi dump_qfi;
+	uint64_t n = 0;
+	qf_iterator_from_position(&qf, &dump_qfi, 0);
+	do {
+		uint64_t value;
+		qfi_get_hash(&dump_qfi, &hashes[n], &value, &counts[n]);
+		n++;
+	} while (!qfi_next(&dump_qfi));
+	if (n != ndump || qf_bulk_load(&dump_qf, hashes, NULL, counts, n,
+																 QF_KEY_IS_HASH) != (int64_t)n) {
+		fprintf(stderr, "failed bulk load from a dump.\n");
+		abort();
+	}
+	for (uint64_t i = 0; i < nvals; i++) {
+		uint64_t count = qf_count_key_value(&qf, vals[i], 0, 0);
+		if (qf_count_key_value(&bulk_qf, vals[i], 0, 0) * key_count != count ||
+				qf_count_key_value(&dump_qf, vals[i], 0, 0) != count) {
+			fprintf(stderr, "failed lookup after bulk load for %lx %ld.\n",
+							vals[i], count);
+			abort();
+		}
+	}
+	if (qf_get_num_occupied_slots(&dump_qf) != qf_get_num_occupied_slots(&qf) ||
+			qf_get_sum_of_counts(&bulk_qf) != nvals) {
+		fprintf(stderr, "wrong counters after bulk load.\n");
+		abort();
+	}
+	free(counts);
+	free(hashes);
+
+	/* A bulk load that doesn't fit leaves the CQF empty, unless it can grow.
+	 * Into a CQF that is not empty, it loads as many pairs as fit. */
+	QF small_qf;
+	if (!qf_malloc(&small_qf, qf.metadata->nslots / 8, nhashbits, 0,
+								 QF_HASH_INVERTIBLE, 0)) {
+		fprintf(stderr, "Can't allocate CQF.\n");
+		abort();
+	}
+	if (qf_bulk_load(&small_qf, vals, NULL, NULL, nvals, 0) != QF_NO_SPACE ||
+			qf_get_num_occupied_slots(&small_qf) != 0) {
+		fprintf(stderr, "bulk load into a full CQF didn't fail cleanly.\n");
+		abort();
+	}
+	qf_insert(&small_qf, vals[0], 0, 1, QF_NO_LOCK);
+	int64_t nbulk = qf_bulk_load(&small_qf, vals, NULL, NULL, nvals, 0);
+	if (nbulk <= 0 || nbulk >= (int64_t)nvals) {
+		fprintf(stderr, "bulk load into a non-empty CQF loaded %ld pairs.\n",
+						nbulk);
+		abort();
+	}
+	qf_reset(&small_qf);
+	qf_set_auto_resize(&small_qf, true);
+	if (qf_bulk_load(&small_qf, vals, NULL, NULL, nvals, 0) != (int64_t)nvals ||
+			qf_get_sum_of_counts(&small_qf) != nvals ||
+			small_qf.metadata->nslots == qf.metadata->nslots / 8) {
+		fprintf(stderr, "bulk load didn't resize the CQF.\n");
+		abort();
+	}
+	qf_free(&small_qf);
+
+	/* Merge the two bulk loaded CQFs into an empty CQF that is too small, so
+	 * it has to grow, and then merge them again into the result.  Each
+	 * doubling costs a remainder bit, so the CQF starts at most 4 times
+	 * smaller than qf, and only if qf has a remainder bit to spare: with 2
+	 * left, the merged counts, which are bigger than those of qf, don't fit
+	 * in any CQF with the same key bits. */
+	if (qf.metadata->key_remainder_bits > 2) {
+		fprintf(stdout, "Testing merge.\n");
+		QF merged_qf;
+		uint64_t merge_shift = qf.metadata->key_remainder_bits - 2 < 2 ?
+			qf.metadata->key_remainder_bits - 2 : 2;
+		if (!qf_malloc(&merged_qf, qf.metadata->nslots >> merge_shift, nhashbits,
+									 0, QF_HASH_INVERTIBLE, 0)) {
+			fprintf(stderr, "Can't allocate CQF.\n");
+			abort();
+		}
+		qf_set_auto_resize(&merged_qf, true);
+		qf_merge(&bulk_qf, &dump_qf, &merged_qf);
+		for (int pass = 1; pass <= 2; pass++) {
+			for (uint64_t i = 0; i < nvals; i++) {
+				uint64_t count = qf_count_key_value(&bulk_qf, vals[i], 0, 0);
+				if (qf_count_key_value(&merged_qf, vals[i], 0, 0) != pass *
+						(key_count + 1) * count) {
+					fprintf(stderr, "failed lookup after merge for %lx %ld.\n",
+									vals[i], count);
+					abort();
+				}
+			}
+			/* The doubled counts may need more space than the last doubling
+			 * left. */
+			if (pass == 1 && merged_qf.metadata->key_remainder_bits == 2)
+				break;
+			if (pass == 1)
+				qf_merge(&bulk_qf, &dump_qf, &merged_qf);
+		}
+		qf_free(&merged_qf);
+
+		/* A CQF that isn't empty is merged into by inserting, and here it is
+		 * too small for the items of one merge, so it grows while the merge
+		 * runs. */
+		fprintf(stdout, "Testing merge with a resize.\n");
+		uint64_t small_nslots = 1ULL << (qbits - 1);
+		if (!qf_malloc(&merged_qf, small_nslots, nhashbits, 0,
+									 QF_HASH_INVERTIBLE, 0)) {
+			fprintf(stderr, "Can't allocate CQF.\n");
+			abort();
+		}
+		qf_set_auto_resize(&merged_qf, true);
+		qf_insert(&merged_qf, vals[0], 0, 1, QF_NO_LOCK);
+		if (qf_merge(&bulk_qf, &dump_qf, &merged_qf) < 0 ||
+				merged_qf.metadata->nslots == small_nslots) {
+			fprintf(stderr, "merge didn't resize.\n");
+			abort();
+		}
+		for (uint64_t i = 0; i < nvals; i++) {
+			uint64_t count = qf_count_key_value(&bulk_qf, vals[i], 0, 0);
+			if (qf_count_key_value(&merged_qf, vals[i], 0, 0) != (key_count + 1) *
+					count + (vals[i] == vals[0])) {
+				fprintf(stderr, "failed lookup after merge with a resize for %lx "
+								"%ld.\n", vals[i], count);
+				abort();
+			}
+		}
+		qf_free(&merged_qf);
+
+		/* Without auto resizing, the merge reports that it ran out of space. */
+		if (!qf_malloc(&merged_qf, small_nslots, nhashbits, 0,
+									 QF_HASH_INVERTIBLE, 0)) {
+			fprintf(stderr, "Can't allocate CQF.\n");
+			abort();
+		}
+		qf_insert(&merged_qf, vals[0], 0, 1, QF_NO_LOCK);
+		if (qf_merge(&bulk_qf, &dump_qf, &merged_qf) != QF_NO_SPACE) {
+			fprintf(stderr, "merge into a full CQF didn't fail.\n");
+			abort();
+		}
+		qf_free(&merged_qf);
+
+		fprintf(stdout, "Testing parallel merge.\n");
+		const QF *merge_arr[] = {&bulk_qf, &dump_qf, &bulk_qf};
+		if (!qf_malloc(&merged_qf, qf.metadata->nslots >> merge_shift, nhashbits,
+									 0, QF_HASH_INVERTIBLE, 0)) {
+			fprintf(stderr, "Can't allocate CQF.\n");
+			abort();
+		}
+		qf_set_auto_resize(&merged_qf, true);
+		if (qf_multi_merge_parallel(merge_arr, 3, &merged_qf, 4) < 0) {
+			fprintf(stderr, "parallel merge failed.\n");
+			abort();
+		}
+		for (uint64_t i = 0; i < nvals; i++) {
+			uint64_t count = qf_count_key_value(&bulk_qf, vals[i], 0, 0);
+			if (qf_count_key_value(&merged_qf, vals[i], 0, 0) != (key_count + 2) *
+					count) {
+				fprintf(stderr, "failed lookup after parallel merge for %lx %ld.\n",
+								vals[i], count);
+				abort();
+			}
+		}
+		if (qf_get_num_distinct_key_value_pairs(&merged_qf) !=
+				qf_get_num_distinct_key_value_pairs(&bulk_qf)) {
+			fprintf(stderr, "wrong counters after parallel merge.\n");
+			abort();
+		}
+		qf_free(&merged_qf);
+	} else
+		fprintf(stdout, "Skipping merge: no remainder bits to spare.\n");
+
+	/* Insert the keys into a small CQF that grows incrementally, checking
+	 * lookups and removes while a resize is in progress against a CQF that
+	 * grows at once. */
+	fprintf(stdout, "Testing incremental resize.\n");
+	QF inc_qf, ref_qf;
+	if (!qf_malloc(&inc_qf, qf.metadata->nslots / 8, nhashbits, 0,
+								 QF_HASH_INVERTIBLE, 0) ||
+			!qf_malloc(&ref_qf, qf.metadata->nslots / 8, nhashbits, 0,
+								 QF_HASH_INVERTIBLE, 0)) {
+		fprintf(stderr, "Can't allocate CQF.\n");
+		abort();
+	}
+	qf_set_auto_resize(&inc_qf, true);
+	qf_set_auto_resize(&ref_qf, true);
+	qf_set_resize_mode(&inc_qf, QF_RESIZE_INCREMENTAL);
+	bool checked_resizing = false;
+	for (uint64_t i = 0; i < nvals; i++) {
+		qf_insert(&ref_qf, vals[i], 0, 2, QF_NO_LOCK);
+		if (qf_insert(&inc_qf, vals[i], 0, 2, QF_NO_LOCK) < 0) {
+			fprintf(stderr, "failed insertion during incremental resize.\n");
+			abort();
+		}
+		if (qf_is_resizing(&inc_qf) && !checked_resizing) {
+			checked_resizing = true;
+			for (uint64_t j = 0; j <= i; j++) {
+				if (qf_count_key_value(&inc_qf, vals[j], 0, 0) < 2) {
+					fprintf(stderr, "failed lookup during incremental resize for %lx.\n",
+									vals[j]);
+					abort();
+				}
+			}
+		}
+		if (qf_is_resizing(&inc_qf)) {
+			qf_resize_step(&inc_qf, 1, QF_TRY_ONCE_LOCK);
+			qf_remove(&inc_qf, vals[i / 2], 0, 1, QF_NO_LOCK);
+			qf_remove(&ref_qf, vals[i / 2], 0, 1, QF_NO_LOCK);
+		} else {
+			qf_insert(&inc_qf, vals[i / 2], 0, 1, QF_NO_LOCK);
+			qf_insert(&ref_qf, vals[i / 2], 0, 1, QF_NO_LOCK);
+		}
+	}
+	qf_resize_finish(&inc_qf);
+	for (uint64_t i = 0; i < nvals; i++) {
+		uint64_t count = qf_count_key_value(&ref_qf, vals[i], 0, 0);
+		uint64_t inc_count = qf_count_key_value(&inc_qf, vals[i], 0, 0);
+		if (inc_count != count) {
+			fprintf(stderr, "failed lookup after incremental resize for %lx %ld.\n",
+							vals[i], inc_count);
+			abort();
+		}
+	}
+	if (!checked_resizing || qf_is_resizing(&inc_qf)) {
+		fprintf(stderr, "incremental resize did not run.\n");
+		abort();
+	}
+	qf_free(&ref_qf);
+	qf_free(&inc_qf);
+
+	/* Inserts that take locks don't start an incremental resize. */
+	if (!qf_malloc(&inc_qf, qf.metadata->nslots / 8, nhashbits, 0,
+								 QF_HASH_INVERTIBLE, 0)) {
+		fprintf(stderr, "Can't allocate CQF.\n");
+		abort();
+	}
+	qf_set_auto_resize(&inc_qf, true);
+	qf_set_resize_mode(&inc_qf, QF_RESIZE_INCREMENTAL);
+	for (uint64_t i = 0; i < nvals; i++) {
+		if (qf_insert(&inc_qf, vals[i], 0, 1, QF_WAIT_FOR_LOCK) < 0 ||
+				qf_is_resizing(&inc_qf)) {
+			fprintf(stderr, "locked insertion resized incrementally.\n");
+			abort();
+		}
+	}
+	if (inc_qf.metadata->nslots == qf.metadata->nslots / 8) {
+		fprintf(stderr, "locked insertions did not resize.\n");
+		abort();
+	}
+	qf_free(&inc_qf);
+
+	/* Grow a small CQF in place and check that it ends up laid out exactly
+	 * like a CQF that was rebuilt at every doubling. */
+	fprintf(stdout, "Testing in-place resize.\n");
+	if (!qf_malloc(&inc_qf, qf.metadata->nslots / 8, nhashbits, 0,
+								 QF_HASH_INVERTIBLE, 0) ||
+			!qf_malloc(&ref_qf, qf.metadata->nslots / 8, nhashbits, 0,
+								 QF_HASH_INVERTIBLE, 0)) {
+		fprintf(stderr, "Can't allocate CQF.\n");
+		abort();
+	}
+	qf_set_auto_resize(&inc_qf, true);
+	qf_set_auto_resize(&ref_qf, true);
+	qf_set_resize_mode(&inc_qf, QF_RESIZE_IN_PLACE);
+	for (uint64_t i = 0; i < nvals; i++) {
+		qf_insert(&ref_qf, vals[i], 0, 1 + i % 3, QF_NO_LOCK);
+		if (qf_insert(&inc_qf, vals[i], 0, 1 + i % 3, QF_NO_LOCK) < 0) {
+			fprintf(stderr, "failed insertion during in-place resize.\n");
+			abort();
+		}
+	}
+	if (inc_qf.metadata->nslots != ref_qf.metadata->nslots ||
+			inc_qf.metadata->total_size_in_bytes !=
+			ref_qf.metadata->total_size_in_bytes ||
+			memcmp(inc_qf.blocks, ref_qf.blocks,
+						 ref_qf.metadata->total_size_in_bytes) != 0 ||
+			qf_get_sum_of_counts(&inc_qf) != qf_get_sum_of_counts(&ref_qf) ||
+			qf_get_num_occupied_slots(&inc_qf) !=
+			qf_get_num_occupied_slots(&ref_qf)) {
+		fprintf(stderr, "in-place resize differs from rebuilding.\n");
+		abort();
+	}
+	qf_free(&ref_qf);
+	qf_free(&inc_qf);
+
+	/* Delete most of the keys from a CQF that shrinks automatically and
+	 * check that the remaining ones survive the shrinking. */
+	fprintf(stdout, "Testing auto shrink.\n");
+	if (!qf_malloc(&inc_qf, qf.metadata->nslots, nhashbits, 0,
+								 QF_HASH_INVERTIBLE, 0)) {
+		fprintf(stderr, "Can't allocate CQF.\n");
+		abort();
+	}
+	qf_set_auto_shrink(&inc_qf, true);
+	for (uint64_t i = 0; i < nvals; i++)
+		qf_insert(&inc_qf, vals[i], 0, 1, QF_NO_LOCK);
+	for (uint64_t i = 0; i < nvals; i++)
+		if (i % 16 != 0)
+			qf_remove(&inc_qf, vals[i], 0, 1, QF_NO_LOCK);
+	if (inc_qf.metadata->nslots >= qf.metadata->nslots) {
+		fprintf(stderr, "auto shrink did not run.\n");
+		abort();
+	}
+	for (uint64_t i = 0; i < nvals; i += 16) {
+		if (qf_count_key_value(&inc_qf, vals[i], 0, 0) == 0) {
+			fprintf(stderr, "failed lookup after shrinking for %lx.\n", vals[i]);
+			abort();
+		}
+	}
+	qf_free(&inc_qf);
+
+	/* Grow and shrink a CQF with cache-line aligned blocks in place, and
+	 * check that it keeps its layout and its keys, also through a file. */
+	fprintf(stdout, "Testing aligned layout.\n");
+	if (!qf_malloc_layout(&inc_qf, qf.metadata->nslots / 8, nhashbits, 0,
+												QF_HASH_INVERTIBLE, 0, QF_LAYOUT_ALIGNED)) {
+		fprintf(stderr, "Can't allocate CQF.\n");
+		abort();
+	}
+	qf_set_auto_resize(&inc_qf, true);
+	qf_set_resize_mode(&inc_qf, QF_RESIZE_IN_PLACE);
+	qf_set_auto_shrink(&inc_qf, true);
+	for (uint64_t i = 0; i < nvals; i++)
+		qf_insert(&inc_qf, vals[i], 0, 1 + i % 3, QF_NO_LOCK);
+	for (uint64_t i = 0; i < nvals; i++)
+		if (i % 4 != 0)
+			qf_remove(&inc_qf, vals[i], 0, 1 + i % 3, QF_NO_LOCK);
+	qf_serialize(&inc_qf, "mycqf_aligned.cqf");
+	qf_free(&inc_qf);
+	if (!qf_deserialize(&inc_qf, "mycqf_aligned.cqf") ||
+			inc_qf.metadata->layout != QF_LAYOUT_ALIGNED) {
+		fprintf(stderr, "Can't read the aligned CQF back.\n");
+		abort();
+	}
+	for (uint64_t i = 0; i < inc_qf.metadata->nblocks; i++) {
+		if ((uintptr_t)get_block(&inc_qf, i) % 64 != 0) {
+			fprintf(stderr, "block %ld is not aligned.\n", i);
+			abort();
+		}
+	}
+	for (uint64_t i = 0; i < nvals; i += 4) {
+		if (qf_count_key_value(&inc_qf, vals[i], 0, 0) < 1 + i % 3) {
+			fprintf(stderr, "failed lookup in aligned CQF for %lx.\n", vals[i]);
+			abort();
+		}
+	}
+	qf_free(&inc_qf);
+	unlink("mycqf_aligned.cqf");
+
+	/* Doubling aligned 6-bit slots to 5 bits halves the size of the blocks,
+	 * so the doubled CQF needs less memory than the one it replaces, both
+	 * in memory and in a file. */
+	for (int file = 0; file <= 1; file++) {
+		if (!(file ? qf_initfile_layout(&inc_qf, 1ULL << 12, 18, 0,
+																		QF_HASH_INVERTIBLE, 0, QF_LAYOUT_ALIGNED,
+																		"mycqf_aligned.file") :
+					qf_malloc_layout(&inc_qf, 1ULL << 12, 18, 0, QF_HASH_INVERTIBLE, 0,
+													 QF_LAYOUT_ALIGNED))) {
+			fprintf(stderr, "Can't allocate CQF.\n");
+			abort();
+		}
+		for (uint64_t i = 0; i < 1000; i++)
+			qf_insert(&inc_qf, i, 0, 1 + i % 3, QF_NO_LOCK);
+		if ((file ? qf_expand_file(&inc_qf) : qf_expand_malloc(&inc_qf)) < 0 ||
+				inc_qf.metadata->bits_per_slot != 5) {
+			fprintf(stderr, "Can't double the aligned CQF.\n");
+			abort();
+		}
+		for (uint64_t i = 0; i < 1000; i++) {
+			if (qf_count_key_value(&inc_qf, i, 0, 0) != 1 + i % 3) {
+				fprintf(stderr, "failed lookup in doubled aligned CQF for %lx.\n",
+								i);
+				abort();
+			}
+		}
+		if (file)
+			qf_deletefile(&inc_qf);
+		else
+			qf_free(&inc_qf);
+	}
+
+	/* Fill a CQF whose block metadata is kept apart from the slots, letting
+	 * it resize by rebuilding, and check its keys, also through a file. */
+	fprintf(stdout, "Testing split layout.\n");
+	if (!qf_malloc_layout(&inc_qf, qf.metadata->nslots / 8, nhashbits, 0,
+												QF_HASH_INVERTIBLE, 0, QF_LAYOUT_SPLIT)) {
+		fprintf(stderr, "Can't allocate CQF.\n");
+		abort();
+	}
+	qf_set_auto_resize(&inc_qf, true);
+	qf_set_resize_mode(&inc_qf, QF_RESIZE_IN_PLACE);
+	for (uint64_t i = 0; i < nvals; i++)
+		qf_insert(&inc_qf, vals[i], 0, 1 + i % 3, QF_NO_LOCK);
+	for (uint64_t i = 0; i < nvals; i++)
+		if (i % 4 != 0)
+			qf_remove(&inc_qf, vals[i], 0, 1 + i % 3, QF_NO_LOCK);
+	qf_serialize(&inc_qf, "mycqf_split.cqf");
+	qf_free(&inc_qf);
+	if (!qf_deserialize(&inc_qf, "mycqf_split.cqf") ||
+			inc_qf.metadata->layout != QF_LAYOUT_SPLIT) {
+		fprintf(stderr, "Can't read the split CQF back.\n");
+		abort();
+	}
+	for (uint64_t i = 0; i < nvals; i += 4) {
+		if (qf_count_key_value(&inc_qf, vals[i], 0, 0) < 1 + i % 3) {
+			fprintf(stderr, "failed lookup in split CQF for %lx.\n", vals[i]);
+			abort();
+		}
+	}
+	qf_free(&inc_qf);
+	unlink("mycqf_split.cqf");
+
+	/* Pile keys into the first 16 buckets, so that the offsets of the
+	 * blocks after them outgrow 8 bits, and check lookups and removals. */
+	fprintf(stdout, "Testing wide offsets.\n");
+	if (!qf_malloc_layout(&inc_qf, 1ULL << 12, 20, 0, QF_HASH_NONE, 0,
+												QF_LAYOUT_WIDE_OFFSETS)) {
+		fprintf(stderr, "Can't allocate CQF.\n");
+		abort();
+	}
+	for (uint64_t i = 0; i < 768; i++)
+		qf_insert(&inc_qf, (i % 16) << 8 | (i / 16) * 4, 0, 1,
+							QF_NO_LOCK | QF_KEY_IS_HASH);
+	if (get_block(&inc_qf, 5)->offset != 255 ||
+			get_wide_offsets(&inc_qf)[5] <= 255) {
+		fprintf(stderr, "wide offsets were not used.\n");
+		abort();
+	}
+	for (uint64_t i = 0; i < 768; i += 2)
+		qf_remove(&inc_qf, (i % 16) << 8 | (i / 16) * 4, 0, 1,
+							QF_NO_LOCK | QF_KEY_IS_HASH);
+	for (uint64_t i = 0; i < 768; i++) {
+		if (qf_count_key_value(&inc_qf, (i % 16) << 8 | (i / 16) * 4, 0,
+													 QF_KEY_IS_HASH) != i % 2) {
+			fprintf(stderr, "failed lookup with wide offsets for %lx.\n", i);
+			abort();
+		}
+	}
+	qf_free(&inc_qf);
+
+	/* Ask for huge pages, which may not be there, and check that the CQF
+	 * works with whatever it got, also after growing and shrinking. */
+	fprintf(stdout, "Testing huge pages.\n");
+	if (!qf_malloc_hugepages(&inc_qf, qf.metadata->nslots / 8, nhashbits, 0,
+													 QF_HASH_INVERTIBLE, 0, QF_LAYOUT_PACKED,
+													 QF_HUGEPAGES_2MB)) {
+		fprintf(stderr, "Can't allocate CQF.\n");
+		abort();
+	}
+	fprintf(stdout, "Got huge pages of kind %u.\n", qf_get_hugepages(&inc_qf));
+	qf_set_auto_resize(&inc_qf, true);
+	qf_set_resize_mode(&inc_qf, QF_RESIZE_IN_PLACE);
+	qf_set_auto_shrink(&inc_qf, true);
+	for (uint64_t i = 0; i < nvals; i++)
+		qf_insert(&inc_qf, vals[i], 0, 1, QF_NO_LOCK);
+	for (uint64_t i = 0; i < nvals; i++)
+		if (i % 4 != 0)
+			qf_remove(&inc_qf, vals[i], 0, 1, QF_NO_LOCK);
+	if (qf_get_hugepages(&inc_qf) > QF_HUGEPAGES_2MB) {
+		fprintf(stderr, "got bigger huge pages than asked for.\n");
+		abort();
+	}
+	for (uint64_t i = 0; i < nvals; i += 4) {
+		if (qf_count_key_value(&inc_qf, vals[i], 0, 0) == 0) {
+			fprintf(stderr, "failed lookup in huge pages for %lx.\n", vals[i]);
+			abort();
+		}
+	}
+	qf_free(&inc_qf);
+
+	/* Everything a CQF allocates, also while it resizes, goes through its
+	 * allocator and is given back by qf_free. */
+	fprintf(stdout, "Testing custom allocator.\n");
+	uint64_t allocated = 0;
+	qf_allocator allocator = {counting_alloc, counting_aligned_alloc,
+		counting_free, &allocated};
+	if (!qf_malloc_allocator(&inc_qf, qf.metadata->nslots / 8, nhashbits, 0,
+													 QF_HASH_INVERTIBLE, 0, QF_LAYOUT_ALIGNED,
+													 &allocator)) {
+		fprintf(stderr, "Can't allocate CQF.\n");
+		abort();
+	}
+	qf_set_auto_resize(&inc_qf, true);
+	qf_set_resize_mode(&inc_qf, QF_RESIZE_IN_PLACE);
+	qf_set_auto_shrink(&inc_qf, true);
+	for (uint64_t i = 0; i < nvals; i++)
+		qf_insert(&inc_qf, vals[i], 0, 1, QF_NO_LOCK);
+	for (uint64_t i = 0; i < nvals; i++)
+		if (i % 4 != 0)
+			qf_remove(&inc_qf, vals[i], 0, 1, QF_NO_LOCK);
+	if (qf_resize_malloc(&inc_qf, inc_qf.metadata->nslots * 2) < 0) {
+		fprintf(stderr, "Can't resize CQF.\n");
+		abort();
+	}
+	for (uint64_t i = 0; i < nvals; i += 4) {
+		if (qf_count_key_value(&inc_qf, vals[i], 0, 0) == 0) {
+			fprintf(stderr, "failed lookup with custom allocator for %lx.\n",
+							vals[i]);
+			abort();
+		}
+	}
+	qf_free(&inc_qf);
+	if (allocated != 0) {
+		fprintf(stderr, "%lu bytes of the allocator weren't freed.\n",
+						allocated);
+		abort();
+	}
+
+	/* Slots narrower than 8 bits have no fixed-width kernels.  Grow every
+	 * layout from 6-bit slots down to 3 bits and back in place, with and
+	 * without a custom allocator, and check the counts of the keys. */
+	fprintf(stdout, "Testing layouts with narrow slots.\n");
+	const uint32_t layouts[] = {QF_LAYOUT_PACKED, QF_LAYOUT_ALIGNED,
+		QF_LAYOUT_SPLIT, QF_LAYOUT_ALIGNED | QF_LAYOUT_WIDE_OFFSETS};
+	for (uint64_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+		for (int custom = 0; custom <= 1; custom++) {
+			if (!qf_malloc_allocator(&inc_qf, 1ULL << 12, 18, 0,
+															 QF_HASH_INVERTIBLE, 0, layouts[l],
+															 custom ? &allocator : NULL)) {
+				fprintf(stderr, "Can't allocate CQF.\n");
+				abort();
+			}
+			qf_set_auto_resize(&inc_qf, true);
+			qf_set_resize_mode(&inc_qf, QF_RESIZE_IN_PLACE);
+			qf_set_auto_shrink(&inc_qf, true);
+			for (uint64_t i = 0; i < 12000; i++)
+				qf_insert(&inc_qf, i, 0, 1 + i % 3, QF_NO_LOCK);
+			if (inc_qf.metadata->bits_per_slot != 3) {
+				fprintf(stderr, "narrow CQF didn't grow to 3-bit slots.\n");
+				abort();
+			}
+			for (uint64_t i = 0; i < 12000; i++)
+				if (i % 8 != 0)
+					qf_remove(&inc_qf, i, 0, 1 + i % 3, QF_NO_LOCK);
+			for (uint64_t i = 0; i < 12000; i++) {
+				if (qf_count_key_value(&inc_qf, i, 0, 0) !=
+						(i % 8 == 0 ? 1 + i % 3 : 0)) {
+					fprintf(stderr, "failed lookup in narrow CQF with layout %u for "
+									"%lx.\n", layouts[l], i);
+					abort();
+				}
+			}
+			qf_free(&inc_qf);
+		}
+	}
+	if (allocated != 0) {
+		fprintf(stderr, "%lu bytes of the allocator weren't freed.\n",
+						allocated);
+		abort();
+	}
+
+	/* Let the allocator fail at every step of creating a CQF, and then of
+	 * growing it, and check that nothing leaks and that the CQF keeps
+	 * working after a failed resize. */
+	fprintf(stdout, "Testing allocation failures.\n");
+	limited_allocator limited = {0, 0};
+	qf_allocator failing = {limited_alloc, limited_aligned_alloc, limited_free,
+		&limited};
+	for (uint64_t budget = 0; ; budget++) {
+		limited.budget = budget;
+		if (qf_malloc_allocator(&inc_qf, 1ULL << 12, 20, 0, QF_HASH_INVERTIBLE,
+														0, QF_LAYOUT_ALIGNED, &failing))
+			break;
+		if (limited.allocated != 0) {
+			fprintf(stderr, "a failed qf_malloc_allocator leaked %lu bytes.\n",
+							limited.allocated);
+			abort();
+		}
+	}
+	qf_set_auto_resize(&inc_qf, true);
+	qf_set_resize_mode(&inc_qf, QF_RESIZE_IN_PLACE);
+	uint64_t nloaded = 0;
+	for (uint64_t budget = 0; budget < 8; budget++) {
+		limited.budget = budget;
+		while (qf_insert(&inc_qf, nloaded, 0, 1, QF_NO_LOCK) >= 0)
+			nloaded++;
+		for (uint64_t i = 0; i < nloaded; i++) {
+			if (qf_count_key_value(&inc_qf, i, 0, 0) == 0) {
+				fprintf(stderr, "failed lookup after a failed resize for %lx.\n", i);
+				abort();
+			}
+		}
+	}
+	limited.budget = 0;
+	QFbuffer failed_buf;
+	if (qf_set_counters(&inc_qf, 2, 16) ||
+			qf_set_lock_granularity(&inc_qf, 1ULL << 14, true) ||
+			qf_buffer_init(&failed_buf, &inc_qf, 64, QF_NO_LOCK)) {
+		fprintf(stderr, "an allocation that failed was reported as done.\n");
+		abort();
+	}
+	if (qf_get_nslots(&inc_qf) == 1ULL << 12) {
+		fprintf(stderr, "the CQF never grew.\n");
+		abort();
+	}
+	/* Shrinking fails as well, and automatic shrinking backs off after the
+	 * first failure instead of retrying on every remove. */
+	qf_set_auto_shrink(&inc_qf, true);
+	for (uint64_t i = 0; i < nloaded; i++)
+		if (i % 16 != 0)
+			qf_remove(&inc_qf, i, 0, 1, QF_NO_LOCK);
+	if (inc_qf.runtimedata->shrink_failed_nslots != qf_get_nslots(&inc_qf) ||
+			inc_qf.runtimedata->shrink_failed_at <
+			qf_get_num_occupied_slots(&inc_qf)) {
+		fprintf(stderr, "auto shrink did not back off.\n");
+		abort();
+	}
+	qf_free(&inc_qf);
+	if (limited.allocated != 0) {
+		fprintf(stderr, "%lu bytes of the failing allocator weren't freed.\n",
+						limited.allocated);
+		abort();
+	}
+
+	/* Pile locked inserts into the last bucket until they run off the end
+	 * of the CQF, and check that the failed inserts let go of their locks:
+	 * lookups still finish, and later inserts fail for want of space, not
+	 * of the lock. */
+	fprintf(stdout, "Testing locked inserts into a full cluster.\n");
+	if (!qf_malloc(&inc_qf, 1ULL << 12, 24, 0, QF_HASH_NONE, 0)) {
+		fprintf(stderr, "Can't allocate CQF.\n");
+		abort();
+	}
+	uint64_t last_bucket = ((1ULL << 12) - 1) << 12;
+	int no_space = 0;
+	for (uint64_t count = 1; count <= 2; count++) {
+		for (uint64_t i = 0; i < 4096; i++) {
+			if (qf_insert(&inc_qf, last_bucket | i, 0, count, QF_WAIT_FOR_LOCK |
+										QF_KEY_IS_HASH) == QF_NO_SPACE)
+				no_space++;
+			if (qf_count_key_value(&inc_qf, last_bucket, 0, QF_KEY_IS_HASH) == 0) {
+				fprintf(stderr, "failed lookup in a full cluster.\n");
+				abort();
+			}
+		}
+		if (qf_insert(&inc_qf, last_bucket | 4095, 0, count, QF_TRY_ONCE_LOCK |
+									QF_KEY_IS_HASH) == QF_COULDNT_LOCK) {
+			fprintf(stderr, "a failed insert kept its lock.\n");
+			abort();
+		}
+	}
+	if (no_space == 0) {
+		fprintf(stderr, "the cluster didn't fill up.\n");
+		abort();
+	}
+	qf_free(&inc_qf);
+
+	/* Spread half of the keys over four shards and check that they are
+	 * found, and that the iterator walks them in the order of their hashes. */
+	fprintf(stdout, "Testing sharded CQF.\n");
+	QFsharded qfs;
+	if (!qf_sharded_malloc(&qfs, 4, NULL, qf.metadata->nslots, nhashbits, 0,
+												 QF_HASH_INVERTIBLE, 0)) {
+		fprintf(stderr, "Can't allocate sharded CQF.\n");
+		abort();
+	}
+	for (uint64_t i = 0; i < nvals / 2; i++) {
+		if (qf_sharded_insert(&qfs, vals[i], 0, 1, QF_NO_LOCK) < 0) {
+			fprintf(stderr, "failed insertion into sharded CQF for %lx.\n", vals[i]);
+			abort();
+		}
+	}
+	for (uint64_t i = 0; i < nvals / 2; i++) {
+		if (qf_sharded_count_key_value(&qfs, vals[i], 0, 0) == 0) {
+			fprintf(stderr, "failed lookup in sharded CQF for %lx.\n", vals[i]);
+			abort();
+		}
+	}
+	QFsi qfsi;
+	uint64_t nsharded = 0, last_hash = 0;
+	for (qf_sharded_iterator(&qfs, &qfsi); !qfsi_end(&qfsi); qfsi_next(&qfsi)) {
+		uint64_t key, hash, value, count;
+		qfsi_get_hash(&qfsi, &hash, &value, &count);
+		qfsi_get_key(&qfsi, &key, &value, &count);
+		if ((nsharded > 0 && hash <= last_hash) ||
+				qf_sharded_hash(&qfs, key, 0) != hash ||
+				qf_sharded_count_key_value(&qfs, key, 0, 0) != count) {
+			fprintf(stderr, "sharded iterator is out of order at %lx.\n", key);
+			abort();
+		}
+		last_hash = hash;
+		nsharded += count;
+	}
+	if (nsharded != nvals / 2) {
+		fprintf(stderr, "sharded iterator found %ld of %ld items.\n", nsharded,
+						nvals / 2);
+		abort();
+	}
+	qf_sharded_free(&qfs);
+	qf_free(&dump_qf);
+	qf_free(&bulk_qf);
 
 #if 0
 	for (uint64_t i = 0; i < nvals; i++) {
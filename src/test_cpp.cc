@@ -0,0 +1,95 @@
+/*
+ * ============================================================================
+ *
+ *        Authors:  Prashant Pandey <ppandey@cs.stonybrook.edu>
+ *                  Rob Johnson <robj@vmware.com>
+ *
+ * ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <openssl/rand.h>
+
+#include "include/gqf_cpp.h"
+
+/* Fill a CQF with compile-time widths and check its lookups against the
+ * counts inserted and against the C library. */
+template <unsigned RemainderBits, unsigned ValueBits, enum qf_hashmode
+					HashMode, uint32_t Layout = QF_LAYOUT_PACKED>
+static void test_width(uint64_t qbits)
+{
+	uint64_t nslots = 1ULL << qbits;
+	uint64_t nvals = 3 * nslots / 4 / 3;
+	uint64_t *vals = (uint64_t *)malloc(nvals * sizeof(vals[0]));
+	cqf<RemainderBits, ValueBits, HashMode, Layout> cf(nslots);
+
+	fprintf(stdout, "Testing %u-bit remainders with %u-bit values%s.\n",
+					RemainderBits, ValueBits, Layout & QF_LAYOUT_ALIGNED ?
+					", aligned" : Layout & QF_LAYOUT_SPLIT ? ", split" : "");
+	RAND_bytes((unsigned char *)vals, sizeof(*vals) * nvals);
+	for (uint64_t i = 0; i < nvals; i++) {
+		if (cf.insert(vals[i], i, i % 3 + 1, QF_NO_LOCK) < 0) {
+			fprintf(stderr, "failed insertion for %lx.\n", vals[i]);
+			abort();
+		}
+	}
+	for (uint64_t i = 0; i < nvals; i++) {
+		uint64_t value;
+		uint64_t count = cf.count(vals[i], i, 0);
+		if (count < i % 3 + 1 ||
+				count != qf_count_key_value(cf.get(), vals[i], i, 0) ||
+				cf.query(vals[i], &value, 0) != qf_query(cf.get(), vals[i], &value,
+																								 0)) {
+			fprintf(stderr, "failed lookup for %lx.\n", vals[i]);
+			abort();
+		}
+	}
+	/* Resizing through the C library takes a bit off the remainders, so the
+	 * lookups have to go through the library as well. */
+	if (qf_resize_malloc(cf.get(), nslots * 2) < 0) {
+		fprintf(stderr, "failed resize.\n");
+		abort();
+	}
+	for (uint64_t i = 0; i < nvals; i++) {
+		if (cf.count(vals[i], i, 0) != qf_count_key_value(cf.get(), vals[i], i,
+																											 0)) {
+			fprintf(stderr, "failed lookup after resize for %lx.\n", vals[i]);
+			abort();
+		}
+	}
+	free(vals);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Please specify the log of the number of slots in the CQFs.\n");
+		exit(1);
+	}
+	uint64_t qbits = atoi(argv[1]);
+
+	test_width<8, 0, QF_HASH_DEFAULT>(qbits);
+	test_width<12, 4, QF_HASH_INVERTIBLE>(qbits);
+	test_width<32, 0, QF_HASH_DEFAULT>(qbits);
+	test_width<7, 4, QF_HASH_DEFAULT>(qbits);
+	test_width<20, 0, QF_HASH_INVERTIBLE>(qbits);
+	test_width<8, 0, QF_HASH_DEFAULT, QF_LAYOUT_ALIGNED>(qbits);
+	test_width<7, 4, QF_HASH_INVERTIBLE, QF_LAYOUT_ALIGNED>(qbits);
+	test_width<8, 0, QF_HASH_DEFAULT, QF_LAYOUT_SPLIT>(qbits);
+	test_width<12, 4, QF_HASH_INVERTIBLE, QF_LAYOUT_SPLIT>(qbits);
+	test_width<8, 0, QF_HASH_DEFAULT, QF_LAYOUT_WIDE_OFFSETS>(qbits);
+	fprintf(stdout, "Verified all widths.\n");
+
+	/* A CQF that can't be allocated throws instead of exiting. */
+	try {
+		cqf<8> huge(1ULL << 56);
+		fprintf(stderr, "allocated a CQF of 2^56 slots.\n");
+		abort();
+	} catch (const std::bad_alloc &) {
+	}
+	fprintf(stdout, "Verified allocation failures.\n");
+
+	return 0;
+}
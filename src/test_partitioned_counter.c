@@ -65,6 +65,24 @@ int main (int argc, char *argv[])
 		return 1;
 	}
 	int procs = atoi(argv[1]);
+
+	/* The counts of a group reach their global counters when it is
+	 * destroyed. */
+	int64_t group_counters[2] = {0, 0};
+	pc_t group[2];
+	pc_t *group_pcs[] = {&group[0], &group[1]};
+	int64_t *group_globals[] = {&group_counters[0], &group_counters[1]};
+	if (pc_init_group(group_pcs, group_globals, 2, 8, 100) == PC_ERROR) {
+		printf("Can't create a group of counters.\n");
+		return 1;
+	}
+	pc_add(&group[0], 3);
+	pc_add(&group[1], -5);
+	pc_destroy_group(group_pcs, 2);
+	if (group_counters[0] != 3 || group_counters[1] != -5) {
+		printf("Group counting failed!\n");
+		return 1;
+	}
 	TOTAL_COUNT =  (1ULL << 30) / procs;
 
 	struct timeval start, stop;
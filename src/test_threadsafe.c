@@ -9,6 +9,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include <time.h>
 #include <sys/time.h>
@@ -27,13 +28,29 @@ typedef struct insert_args {
 	int freq;
 	uint64_t start;
 	uint64_t end;
+	volatile uint64_t ninserted;
+	bool buffered;
 } insert_args;
 
+typedef struct lookup_args {
+	insert_args *writers;
+	int nwriters;
+} lookup_args;
+
 void *insert_bm(void *arg)
 {
 	insert_args *a = (insert_args *)arg;
+	QFbuffer buf;
+	if (a->buffered)
+		qf_buffer_init(&buf, a->cf, 1024, QF_WAIT_FOR_LOCK);
 	for (uint32_t i = a->start; i <= a->end; i++) {
-		int ret = qf_insert(a->cf, a->vals[i], 0, a->freq, QF_WAIT_FOR_LOCK);
+		int ret;
+		if (a->buffered) {
+			ret = qf_buffer_insert(&buf, a->vals[i], 0, a->freq, 0);
+			if (ret >= 0 && i == a->end)
+				ret = qf_buffer_flush(&buf);
+		} else
+			ret = qf_insert(a->cf, a->vals[i], 0, a->freq, QF_WAIT_FOR_LOCK);
 		if (ret < 0) {
 			fprintf(stderr, "failed insertion for key: %lx %d.\n", a->vals[i],
 							a->freq);
@@ -47,6 +64,39 @@ void *insert_bm(void *arg)
 				fprintf(stderr, "Does not recognise return value.\n");
 			abort();
 		}
+		__atomic_store_n(&a->ninserted, i - a->start + 1 - (a->buffered ?
+																												 buf.nitems : 0),
+										 __ATOMIC_RELEASE);
+	}
+	if (a->buffered)
+		qf_buffer_free(&buf);
+	return NULL;
+}
+
+/* Look up keys that the writers have already inserted while they keep
+ * inserting. */
+void *lookup_bm(void *arg)
+{
+	lookup_args *a = (lookup_args *)arg;
+	uint64_t nlookups = 0;
+	bool done = false;
+	while (!done) {
+		done = true;
+		for (int t = 0; t < a->nwriters; t++) {
+			insert_args *w = &a->writers[t];
+			uint64_t n = __atomic_load_n(&w->ninserted, __ATOMIC_ACQUIRE);
+			if (n <= w->end - w->start)
+				done = false;
+			if (n == 0)
+				continue;
+			uint64_t i = w->start + nlookups++ % n;
+			uint64_t count = qf_count_key_value(w->cf, w->vals[i], 0, 0);
+			if (count < (uint64_t)w->freq) {
+				fprintf(stderr, "failed lookup during insertion for %lx %ld.\n",
+								w->vals[i], count);
+				abort();
+			}
+		}
 	}
 	return NULL;
 }
@@ -54,7 +104,13 @@ void *insert_bm(void *arg)
 void multi_threaded_insertion(insert_args args[], int tcnt)
 {
 	pthread_t threads[tcnt];
+	pthread_t reader;
+	lookup_args largs = { args, tcnt };
 
+	if (pthread_create(&reader, NULL, &lookup_bm, &largs)) {
+		fprintf(stderr, "Error creating thread\n");
+		exit(0);
+	}
 	for (int i = 0; i < tcnt; i++) {
 		fprintf(stdout, "Thread %d bounds %ld %ld\n", i, args[i].start, args[i].end);
 		if (pthread_create(&threads[i], NULL, &insert_bm, &args[i])) {
@@ -69,6 +125,10 @@ void multi_threaded_insertion(insert_args args[], int tcnt)
 			exit(0);
 		}
 	}
+	if (pthread_join(reader, NULL)) {
+		fprintf(stderr, "Error joining thread\n");
+		exit(0);
+	}
 }
 
 int main(int argc, char **argv)
@@ -111,6 +171,8 @@ int main(int argc, char **argv)
 		args[i].freq = freq;
 		args[i].start = (nvals/tcnt) * i;
 		args[i].end = (nvals/tcnt) * (i + 1) - 1;
+		args[i].ninserted = 0;
+		args[i].buffered = false;
 	}
 	fprintf(stdout, "Total number of items: %ld\n", args[tcnt-1].end);
 
@@ -141,8 +203,39 @@ int main(int argc, char **argv)
 		}
 	} while(!qfi_end(&cfir));
 
+	/* Insert the same items again through per-thread insert buffers,
+	 * with padded locks sized for tcnt threads and two counters per thread,
+	 * parking the threads that wait for a lock. */
+	QF cfb;
+	if (!qf_malloc(&cfb, nslots, nhashbits, 0, QF_HASH_INVERTIBLE, 0)) {
+		fprintf(stderr, "Can't allocate CQF.\n");
+		abort();
+	}
+	qf_set_lock_policy(&cfb, QF_LOCK_PARK);
+	qf_tune_lock_granularity(&cfb, tcnt, true);
+	qf_set_counters(&cfb, 2 * tcnt, 16);
+	for (uint32_t i = 0; i < tcnt; i++) {
+		args[i].cf = &cfb;
+		args[i].ninserted = 0;
+		args[i].buffered = true;
+	}
+	multi_threaded_insertion(args, tcnt);
+	for (uint64_t i = 0; i < args[tcnt-1].end; i++) {
+		if (qf_count_key_value(&cfb, vals[i], 0, 0) !=
+				qf_count_key_value(&cfr, vals[i], 0, 0)) {
+			fprintf(stderr, "failed lookup after buffered insertion for %lx.\n",
+							vals[i]);
+			abort();
+		}
+	}
+	if (qf_get_sum_of_counts(&cfb) != qf_get_sum_of_counts(&cfr)) {
+		fprintf(stderr, "buffered insertion lost items.\n");
+		abort();
+	}
+	qf_free(&cfb);
+
 	fprintf(stdout, "Total num of distinct items in the CQF %ld\n",
-					cfr.metadata->ndistinct_elts);
+					qf_get_num_distinct_key_value_pairs(&cfr));
 	fprintf(stdout, "Verified all items: %ld\n", args[tcnt-1].end);
 
 	return 0;